@@ -0,0 +1,189 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+/* Benchmark for the memory allocations of the search.
+ *
+ * Caches a document with synthetic text and searches it with the output
+ * options below, like `pdfgrep --cache` would. Counts the calls of operator
+ * new and the time per page. The output is thrown away.
+ *
+ * Usage: alloc-bench [PAGES [PAGE_SIZE]]
+ */
+
+#include "cache.h"
+#include "output.h"
+#include "regengine.h"
+#include "search.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// Number of calls of operator new so far. The search of a single document
+// runs on one thread, so this doesn't have to be atomic.
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+	allocations++;
+	void *p = malloc(size == 0 ? 1 : size);
+	if (p == nullptr) {
+		throw bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+// Discards everything, but still makes the output code do all of its work
+class NullBuf : public streambuf
+{
+protected:
+	int overflow(int c) override { return c; }
+	streamsize xsputn(const char *, streamsize n) override { return n; }
+};
+
+// Lines of words, some of which match the pattern below
+static string make_page(mt19937 &rng, size_t size)
+{
+	static const char *words[] = {
+		"the", "of", "and", "a", "to", "in", "is", "that", "for", "it",
+		"with", "as", "was", "on", "are", "by", "this", "be", "from", "or",
+		"document", "page", "section", "figure", "table", "results",
+		"algorithm", "performance", "value", "function", "between",
+	};
+	const size_t nwords = sizeof(words) / sizeof(words[0]);
+
+	uniform_int_distribution<size_t> word(0, nwords - 1);
+	string page;
+	size_t line = 0;
+	while (page.size() < size) {
+		page += words[word(rng)];
+		page += ++line % 12 == 0 ? '\n' : ' ';
+	}
+	return page;
+}
+
+struct Mode {
+	const char *name;
+	void (*setup)(Options &opts);
+};
+
+static const Mode modes[] = {
+	{ "lines", [](Options &) {} },
+	{ "-n", [](Options &opts) { opts.outconf.pagenum = true; } },
+	{ "-H -n", [](Options &opts) {
+		opts.outconf.filename = true;
+		opts.outconf.pagenum = true;
+	} },
+	{ "-o", [](Options &opts) { opts.outconf.only_matching = true; } },
+	{ "-C 2", [](Options &opts) {
+		opts.outconf.context_before = opts.outconf.context_after = 2;
+		opts.outconf.context_mode = true;
+	} },
+	{ "--json", [](Options &opts) { opts.outconf.json = true; } },
+	{ "-c", [](Options &opts) { opts.count = true; } },
+};
+
+int main(int argc, char **argv)
+{
+	size_t npages = argc > 1 ? strtoul(argv[1], nullptr, 10) : 2000;
+	size_t page_size = argc > 2 ? strtoul(argv[2], nullptr, 10) : 3000;
+
+	if (npages == 0) {
+		cerr << "Usage: " << argv[0] << " [PAGES [PAGE_SIZE]]" << endl;
+		return 2;
+	}
+
+	char dir[] = "/tmp/pdfgrep-bench.XXXXXX";
+	if (mkdtemp(dir) == nullptr) {
+		perror("mkdtemp");
+		return 1;
+	}
+	string file = string(dir) + "/cache";
+
+	mt19937 rng(0);
+	{
+		Cache cache(file, CacheCompression::NONE, nullptr);
+		cache.set_document_info(npages, false);
+		for (size_t i = 0; i < npages; i++) {
+			cache.set_page(i + 1, CachePage { make_page(rng, page_size), to_string(i + 1) });
+		}
+		cache.dump();
+	}
+
+	PosixRegex re("algorithm|results", false);
+
+	NullBuf null_buf;
+	ostream null_stream(&null_buf);
+
+	cout << npages << " pages of " << page_size << " bytes" << endl << endl;
+	cout << left << setw(8) << "mode" << right
+	     << setw(16) << "allocs/page" << setw(12) << "us/page" << endl;
+
+	for (const Mode &mode : modes) {
+		Options opts;
+		opts.use_cache = true;
+		mode.setup(opts);
+
+		// Warm up, so that only the allocations of the search itself
+		// are counted
+		redirect_output(&null_stream, &null_stream);
+		search_document(opts, nullptr, make_unique<Cache>(file, CacheCompression::NONE, nullptr),
+		                file, re, IntervalContainer());
+
+		auto cache = make_unique<Cache>(file, CacheCompression::NONE, nullptr);
+		size_t before = allocations;
+		Clock::time_point start = Clock::now();
+		search_document(opts, nullptr, std::move(cache), file, re, IntervalContainer());
+		double time = chrono::duration<double>(Clock::now() - start).count();
+		size_t count = allocations - before;
+		redirect_output(nullptr, nullptr);
+
+		cout << left << setw(8) << mode.name << right << fixed
+		     << setw(16) << setprecision(2) << double(count) / npages
+		     << setw(12) << setprecision(2) << time / npages * 1e6 << endl;
+	}
+
+	unlink(file.c_str());
+	rmdir(dir);
+	return 0;
+}
@@ -0,0 +1,83 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "arena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+// Size of the first block. Most pages need less than that.
+static const size_t MIN_BLOCK_SIZE = 16 * 1024;
+
+// Unlike make_unique, this doesn't fill the block with zeros
+static unique_ptr<char[]> allocate_block(size_t size)
+{
+	return unique_ptr<char[]>(new char[size]);
+}
+
+void *PageArena::do_allocate(size_t bytes, size_t alignment)
+{
+	uintptr_t base = reinterpret_cast<uintptr_t>(current.data.get());
+	size_t start = ((base + used + alignment - 1) & ~(alignment - 1)) - base;
+
+	if (current.data == nullptr || start + bytes > current.size) {
+		// Each block is at least twice as large as the one before, so
+		// a page needs only a few of them
+		size_t size = max({ MIN_BLOCK_SIZE, 2 * current.size, bytes + alignment });
+		if (current.data != nullptr) {
+			full.push_back(std::move(current));
+		}
+		current = Block { allocate_block(size), size };
+
+		base = reinterpret_cast<uintptr_t>(current.data.get());
+		start = ((base + alignment - 1) & ~(alignment - 1)) - base;
+	}
+
+	used = start + bytes;
+	return current.data.get() + start;
+}
+
+void PageArena::do_deallocate(void *, size_t, size_t)
+{
+}
+
+bool PageArena::do_is_equal(const std::pmr::memory_resource &other) const noexcept
+{
+	return this == &other;
+}
+
+void PageArena::reset()
+{
+	// The last page needed more than one block. They are replaced by a
+	// single one that is large enough for all of it.
+	if (!full.empty()) {
+		size_t size = current.size;
+		for (const Block &block : full) {
+			size += block.size;
+		}
+		full.clear();
+		current = Block { nullptr, 0 };
+		current = Block { allocate_block(size), size };
+	}
+
+	used = 0;
+}
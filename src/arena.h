@@ -0,0 +1,73 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+/** Memory for what is only needed while a single page is reported.
+ *
+ * Allocations just take the next bytes of a block and are only freed all at
+ * once, by reset(). The blocks are kept for the next page, so once the
+ * arena is as large as the largest page needs, reporting a page doesn't
+ * allocate at all.
+ *
+ * Use it with the std::pmr containers. It is not thread-safe.
+ */
+class PageArena : public std::pmr::memory_resource {
+public:
+	PageArena() {}
+
+	PageArena(const PageArena &) = delete;
+	PageArena &operator=(const PageArena &) = delete;
+
+	/* Free everything that was allocated since the last reset(). Nothing
+	 * that was allocated from the arena may be used afterwards. */
+	void reset();
+
+protected:
+	void *do_allocate(size_t bytes, size_t alignment) override;
+	// Does nothing, see reset()
+	void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+
+private:
+	struct Block {
+		std::unique_ptr<char[]> data;
+		size_t size;
+	};
+
+	// The block that is allocated from
+	Block current = { nullptr, 0 };
+	// number of used bytes of the current block
+	size_t used = 0;
+	// Blocks that were full since the last reset()
+	std::vector<Block> full;
+};
+
+#endif /* ARENA_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
@@ -0,0 +1,297 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "buildcache.h"
+#include "cache.h"
+#include "exclude.h"
+#include "extract.h"
+#include "jobs.h"
+#include "output.h"
+#include "trigram.h"
+#include "walk.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cpp/poppler-document.h>
+
+using namespace std;
+
+// How often the progress line on stderr is updated
+static const chrono::milliseconds PROGRESS_INTERVAL(500);
+
+namespace {
+
+struct BuildStats {
+	const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	// documents with new pages in the cache
+	atomic<size_t> built{0};
+	// documents that had all pages in the cache already
+	atomic<size_t> complete{0};
+	atomic<size_t> failed{0};
+	// pages extracted so far
+	atomic<size_t> pages{0};
+
+	string summary() const;
+};
+
+/* Shows the stats on stderr and updates them periodically, if stderr is a
+ * terminal */
+class ProgressLine {
+public:
+	explicit ProgressLine(const BuildStats &stats);
+	// Removes the line again
+	~ProgressLine();
+
+	ProgressLine(const ProgressLine &) = delete;
+	ProgressLine &operator=(const ProgressLine &) = delete;
+
+private:
+	void work();
+
+	const BuildStats &stats;
+	std::mutex mutex;
+	condition_variable stopped;
+	bool done = false;
+	thread updater;
+};
+
+}
+
+string BuildStats::summary() const
+{
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	size_t extracted = pages;
+	double rate = seconds > 0 ? extracted / seconds : 0;
+
+	char buf[256];
+	snprintf(buf, sizeof(buf),
+	         "%zu files (%zu complete already), %zu pages extracted in %.1f s (%.0f pages/s)",
+	         built + complete + failed, complete.load(), extracted, seconds, rate);
+	string result(buf);
+	if (failed > 0) {
+		result += ", " + to_string(failed) + " failed";
+	}
+	return result;
+}
+
+ProgressLine::ProgressLine(const BuildStats &stats)
+	: stats(stats)
+{
+	if (isatty(STDERR_FILENO)) {
+		updater = thread(&ProgressLine::work, this);
+	}
+}
+
+ProgressLine::~ProgressLine()
+{
+	if (!updater.joinable()) {
+		return;
+	}
+
+	{
+		lock_guard<std::mutex> lock(mutex);
+		done = true;
+	}
+	stopped.notify_all();
+	updater.join();
+
+	set_status_line("");
+}
+
+void ProgressLine::work()
+{
+	unique_lock<std::mutex> lock(mutex);
+	while (!stopped.wait_for(lock, PROGRESS_INTERVAL, [this] { return done; })) {
+		set_status_line(stats.summary());
+	}
+}
+
+BuildResult build_document(const Options &opts, const string &path, string &cache_file,
+                           size_t &extracted)
+{
+	cache_file.clear();
+	string name;
+	if (cache_file_name(opts.cache_directory, path, opts.cache_hash, name) != 0) {
+		err() << "Could not compute checksum for " << path << endl;
+		return BuildResult::FAILED;
+	}
+
+	unique_ptr<Cache> cache = open_cache(opts, name);
+	if (cache->is_complete(opts.page_range)) {
+		cache_file = name;
+		return BuildResult::COMPLETE;
+	}
+
+	unique_ptr<poppler::document> doc = open_document(opts, path);
+	if (doc == nullptr) {
+		err() << "Could not open " << path << endl;
+		return BuildResult::FAILED;
+	}
+	cache_file = name;
+
+	// doc->pages() returns an int, although it should be a size_t
+	size_t doc_pages = static_cast<size_t>(doc->pages());
+	cache->set_document_info(doc_pages, doc->is_encrypted());
+
+	vector<size_t> pages;
+	for (size_t pagenum = 1; pagenum <= doc_pages; pagenum++) {
+		if (opts.page_range.contains(pagenum) && !cache->has_page(pagenum)) {
+			pages.push_back(pagenum);
+		}
+	}
+
+	unique_ptr<PageExtractor> extractor;
+	if (opts.page_jobs > 1 && pages.size() > 1) {
+		unsigned threads = min(static_cast<size_t>(opts.page_jobs), pages.size());
+		extractor = make_unique<PageExtractor>(opts, path, std::move(doc), pages, threads);
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < pages.size(); i++) {
+		CachePage page;
+		if (extractor ? !extractor->get(pages[i], page) : !extract_page(*doc, pages[i], page)) {
+			err() << "Could not extract page " << pages[i] << " of " << path << endl;
+			ok = false;
+			continue;
+		}
+
+		cache->set_page(pages[i], std::move(page));
+		extracted++;
+	}
+	extractor.reset();
+
+	cache->dump();
+
+	if (!ok) {
+		return BuildResult::FAILED;
+	}
+	// Encrypted documents are never complete, but they may have been
+	// cached before.
+	return pages.empty() ? BuildResult::COMPLETE : BuildResult::BUILT;
+}
+
+int build_cache(const Options &opts, const vector<string> &paths, BuiltCallback on_built)
+{
+	BuildStats stats;
+	atomic<bool> error{false};
+
+	{
+		JobPool pool(opts.jobs);
+		ProgressLine progress(stats);
+
+		auto add = [&](const string &path) {
+			pool.add([&opts, path, &stats, &error, &on_built] {
+				string cache_file;
+				size_t pages = 0;
+				BuildResult result = build_document(opts, path, cache_file, pages);
+				stats.pages += pages;
+				if (result == BuildResult::BUILT) {
+					stats.built++;
+				} else if (result == BuildResult::COMPLETE) {
+					stats.complete++;
+				} else {
+					stats.failed++;
+					error = true;
+				}
+				if (on_built && !cache_file.empty()) {
+					on_built(path, cache_file);
+				}
+			});
+		};
+
+		auto walk = [&](const string &root) {
+			DirWalker walker(opts, opts.jobs, [&](const string &path, const string &name) {
+				if (is_excluded(opts.includes, name) && !is_excluded(opts.excludes, name)) {
+					add(path);
+				}
+			});
+			if (walker.walk(root) != 0) {
+				error = true;
+			}
+		};
+
+		for (const string &path : paths) {
+			struct stat st;
+			if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+				add(path);
+			} else if (opts.recursive != Recursion::NONE) {
+				walk(path);
+			} else {
+				err() << path << " is a directory. Did you mean to use '--recursive'?" << endl;
+				error = true;
+			}
+		}
+
+		if (paths.empty() && opts.recursive != Recursion::NONE) {
+			walk(".");
+		}
+
+		pool.wait();
+	}
+	release_cache_mappings(opts);
+
+	cout << stats.summary() << endl;
+
+	// The index covers the whole cache store, not only these files
+	if (!build_trigram_index(opts)) {
+		error = true;
+	}
+
+	return error ? EXIT_ERROR : EXIT_SUCCESS;
+}
+
+bool build_trigram_index(const Options &opts)
+{
+	TrigramIndexStats index;
+	if (!TrigramIndex::build(opts, index)) {
+		return false;
+	}
+	cout << "Trigram index: " << index.documents << " files, " << index.pages
+	     << " pages, " << index.trigrams << " trigrams" << endl;
+	return true;
+}
+
+bool update_trigram_index(const Options &opts)
+{
+	TrigramIndexStats index;
+	bool rebuilt;
+	if (!TrigramIndex::update(opts, index, rebuilt)) {
+		return false;
+	}
+	if (rebuilt) {
+		cout << "Trigram index: " << index.documents << " files, " << index.pages
+		     << " pages, " << index.trigrams << " trigrams" << endl;
+	} else {
+		cout << "Trigram index: " << index.documents << " new files, " << index.pages
+		     << " pages" << endl;
+	}
+	return true;
+}
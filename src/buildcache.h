@@ -0,0 +1,77 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef BUILDCACHE_H
+#define BUILDCACHE_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "pdfgrep.h"
+
+enum class BuildResult {
+	// new pages were put into the cache
+	BUILT,
+	// all pages were cached already
+	COMPLETE,
+	FAILED
+};
+
+/* Put all pages of the PDF at `path` that opts.page_range selects into the
+ * cache. Sets `cache_file` to its entry, unless the PDF couldn't be read, and
+ * adds the number of extracted pages to `pages`. Errors are printed with
+ * err(). */
+BuildResult build_document(const Options &opts, const std::string &path,
+                           std::string &cache_file, size_t &pages);
+
+// Called with each PDF of build_cache() and its cache entry
+typedef std::function<void(const std::string &path, const std::string &cache_file)> BuiltCallback;
+
+/** Fill the cache with all pages of the PDFs in `paths` (--build-cache)
+ *
+ * Directories are walked like with --recursive. Documents whose pages are all
+ * cached already are skipped without opening them. The others are extracted
+ * by opts.jobs threads, each using opts.page_jobs threads per document.
+ * Finally, the trigram index is rebuilt from the whole cache store. While
+ * this runs, the progress is shown on stderr if it is a terminal, and a
+ * summary is printed to stdout at the end.
+ *
+ * `on_built` is called from the worker threads for every PDF that has an
+ * entry in the cache now, unless it is nullptr. Returns the exit status.
+ */
+int build_cache(const Options &opts, const std::vector<std::string> &paths,
+                BuiltCallback on_built = nullptr);
+
+/* Rebuild the trigram index from the whole cache store and print its size.
+ * Returns false on errors. */
+bool build_trigram_index(const Options &opts);
+
+/* Add the entries that the trigram index doesn't cover yet, see
+ * TrigramIndex::update(), and print what was indexed. Returns false on
+ * errors. */
+bool update_trigram_index(const Options &opts);
+
+#endif /* BUILDCACHE_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
@@ -0,0 +1,206 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+/* Benchmark for the compression of the cache (--cache-compression).
+ *
+ * Writes a cache file with synthetic text for every compression algorithm
+ * that pdfgrep was compiled with and compares the time to read pages back. A
+ * "hit" opens the cache file and reads one random page, like a search of a
+ * single page with --page-range does. "scan" reads all pages in order, like a
+ * search of the whole document.
+ *
+ * Usage: cache-bench [PAGES [PAGE_SIZE [HITS]]]
+ */
+
+#include "cache.h"
+#include "compress.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start)
+{
+	return chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Text that compresses roughly like the text of real documents
+static string make_page(mt19937 &rng, size_t size)
+{
+	static const char *words[] = {
+		"the", "of", "and", "a", "to", "in", "is", "that", "for", "it",
+		"with", "as", "was", "on", "are", "by", "this", "be", "from", "or",
+		"which", "an", "at", "not", "can", "document", "page", "section",
+		"figure", "table", "results", "algorithm", "performance", "value",
+		"function", "between", "2017", "42", "(see", "above)", "however,",
+	};
+	const size_t nwords = sizeof(words) / sizeof(words[0]);
+
+	// Zipf-like: the first words are much more frequent
+	uniform_real_distribution<double> dist(0, 1);
+	string page;
+	size_t line = 0;
+	while (page.size() < size) {
+		double x = dist(rng);
+		page += words[static_cast<size_t>(x * x * x * nwords)];
+		if (++line % 12 == 0) {
+			page += '\n';
+		} else {
+			page += ' ';
+		}
+	}
+	return page;
+}
+
+struct Result {
+	off_t file_size;
+	double write_time;
+	double hit_time;
+	double scan_time;
+};
+
+static bool run(CacheCompression algorithm, const string &file,
+                const vector<string> &pages, size_t hits, Result &result)
+{
+	unlink(file.c_str());
+
+	Clock::time_point start = Clock::now();
+	{
+		Cache cache(file, algorithm, nullptr);
+		cache.set_document_info(pages.size(), false);
+		for (size_t i = 0; i < pages.size(); i++) {
+			cache.set_page(i + 1, CachePage { pages[i], to_string(i + 1) });
+		}
+		cache.dump();
+	}
+	result.write_time = seconds_since(start);
+
+	struct stat st;
+	if (stat(file.c_str(), &st) != 0) {
+		return false;
+	}
+	result.file_size = st.st_size;
+
+	mt19937 rng(1);
+	uniform_int_distribution<unsigned> pagenum(1, pages.size());
+	size_t bytes = 0;
+
+	start = Clock::now();
+	for (size_t i = 0; i < hits; i++) {
+		Cache cache(file, algorithm, nullptr);
+		CachePageView view;
+		if (!cache.get_page_view(pagenum(rng), view)) {
+			return false;
+		}
+		bytes += view.text.size();
+	}
+	result.hit_time = seconds_since(start) / hits;
+
+	start = Clock::now();
+	{
+		Cache cache(file, algorithm, nullptr);
+		for (size_t i = 1; i <= pages.size(); i++) {
+			CachePageView view;
+			if (!cache.get_page_view(i, view)) {
+				return false;
+			}
+			bytes += view.text.size();
+		}
+	}
+	result.scan_time = seconds_since(start);
+
+	// Keep the compiler from dropping the reads
+	return bytes > 0;
+}
+
+int main(int argc, char **argv)
+{
+	size_t npages = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000;
+	size_t page_size = argc > 2 ? strtoul(argv[2], nullptr, 10) : 3000;
+	size_t hits = argc > 3 ? strtoul(argv[3], nullptr, 10) : 20000;
+
+	if (npages == 0 || hits == 0) {
+		cerr << "Usage: " << argv[0] << " [PAGES [PAGE_SIZE [HITS]]]" << endl;
+		return 2;
+	}
+
+	char dir[] = "/tmp/pdfgrep-bench.XXXXXX";
+	if (mkdtemp(dir) == nullptr) {
+		perror("mkdtemp");
+		return 1;
+	}
+	string file = string(dir) + "/cache";
+
+	mt19937 rng(0);
+	vector<string> pages;
+	size_t total = 0;
+	for (size_t i = 0; i < npages; i++) {
+		pages.push_back(make_page(rng, page_size));
+		total += pages.back().size();
+	}
+
+	cout << npages << " pages, " << total << " bytes of text, "
+	     << hits << " hits" << endl << endl;
+	cout << left << setw(8) << "algo" << right
+	     << setw(12) << "file size" << setw(8) << "ratio"
+	     << setw(12) << "write ms" << setw(12) << "hit us"
+	     << setw(12) << "scan ms" << setw(12) << "scan MB/s" << endl;
+
+	int status = 0;
+	for (CacheCompression algorithm : { CacheCompression::NONE, CacheCompression::LZ4,
+	                                    CacheCompression::ZSTD }) {
+		if (!compression_supported(algorithm)) {
+			cout << left << setw(8) << compression_name(algorithm)
+			     << "  not supported" << endl;
+			continue;
+		}
+
+		Result result;
+		if (!run(algorithm, file, pages, hits, result)) {
+			cerr << compression_name(algorithm) << ": could not read the cache back" << endl;
+			status = 1;
+			continue;
+		}
+
+		cout << left << setw(8) << compression_name(algorithm) << right << fixed
+		     << setw(12) << result.file_size
+		     << setw(8) << setprecision(2) << double(total) / result.file_size
+		     << setw(12) << setprecision(1) << result.write_time * 1e3
+		     << setw(12) << setprecision(2) << result.hit_time * 1e6
+		     << setw(12) << setprecision(2) << result.scan_time * 1e3
+		     << setw(12) << setprecision(0) << total / result.scan_time / 1e6 << endl;
+	}
+
+	unlink(file.c_str());
+	rmdir(dir);
+	return status;
+}
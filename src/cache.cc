@@ -25,7 +25,6 @@
 #include <fstream>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <dirent.h>
 #include <unistd.h>
 #include <iostream>
 #include <cstdlib>
@@ -34,140 +33,864 @@
 #include <sys/stat.h>
 #include <cerrno>
 #include <cstring>
+#include <sstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <cstdint>
+#include <bitset>
+#include <unordered_set>
+
+#include "cacheindex.h"
+#include "cachepack.h"
+#include "compress.h"
+#include "hash.h"
+#include "trigram.h"
 
 using namespace std;
 
-const char *CACHE_VERSION = "1";
+/* Format of the cache file (version 6). All numbers are little endian.
+ *
+ *   header:     "CPDFGREP"               magic
+ *               u32 version              CACHE_VERSION
+ *               u32 flags                FLAG_ENCRYPTED
+ *               u32 page count           of the document, 0 if unknown
+ *               u32 bitmap size          number of pages in the bitmap
+ *               u32 entries              number of cached pages
+ *               u32 compression          algorithm of the page data, see
+ *                                        COMPRESSION_IDS
+ *   bitmap:     u64 words                bit i of word j is set if page
+ *                                        64 * j + i + 1 is cached
+ *   page table: one entry per cached page, in the order of the pages:
+ *               u64 offset               of the page data
+ *               u32 stored length        of the page data
+ *               u32 label length         uncompressed
+ *               u32 text length          uncompressed
+ *               u32 filter length        0 if the page has no filter
+ *               u64 checksum             XXH64 of the page data and filter
+ *   page data:  label and text of each page, without separators, compressed
+ *               as one block per page. If the stored length is the sum of
+ *               label and text length, the page is stored uncompressed,
+ *               because compression didn't make it smaller. The Bloom
+ *               filter of the page's trigrams follows the block (see
+ *               build_page_filter()).
+ *
+ * Any subset of the pages can be cached, e.g. the pages that a search with
+ * --max-count looked at. The table entry of a page is found by counting the
+ * bits before it in the bitmap.
+ *
+ * Version 5 is the same without filters, i.e. with a filter length of 0. Its
+ * files are read and converted when they are written again. Older versions of
+ * pdfgrep stored text, separated by NUL bytes. They see a wrong version in
+ * this format and ignore it.
+ */
+static const uint32_t CACHE_VERSION = 6;
+static const uint32_t UNFILTERED_VERSION = 5;
+static const char CACHE_MAGIC[] = "CPDFGREP";
+static const size_t MAGIC_SIZE = 8;
+static const size_t HEADER_SIZE = MAGIC_SIZE + 6 * 4;
+static const size_t ENTRY_SIZE = 8 + 4 * 4 + 8;
+static const uint32_t FLAG_ENCRYPTED = 1;
+
+// The compression algorithms in the order of their ids in the header
+static const CacheCompression COMPRESSION_IDS[] = {
+	CacheCompression::NONE,
+	CacheCompression::LZ4,
+	CacheCompression::ZSTD,
+};
+
+enum { UNCHECKED = 0, CHECK_OK, CHECK_FAILED };
+
+// How old a cache file may get before dump() records its use again
+static const time_t TOUCH_INTERVAL = 60 * 60;
 
-static std::ostream& operator<<(std::ostream& out, const CachePage& page) {
-	out << page.label << '\0';
-	out << page.text << '\0';
-	return out;
+static bool write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
 }
 
-static std::istream& operator>>(std::istream& in, CachePage& page) {
-	std::getline(in, page.label, '\0');
-	std::getline(in, page.text, '\0');
-	return in;
+static uint64_t get_le(const char *p, int bytes) {
+	uint64_t value = 0;
+	for (int i = bytes - 1; i >= 0; i--) {
+		value = (value << 8) | static_cast<unsigned char>(p[i]);
+	}
+	return value;
+}
+
+static void put_le(string &out, uint64_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		out += static_cast<char>((value >> (8 * i)) & 0xff);
+	}
 }
 
-Cache::Cache(string const &cache_file)
-	: cache_file(cache_file), valid(false) {
-	// Open the cache file
-	ifstream fd(cache_file);
-	if (!fd) {
+static uint64_t checksum(string_view data, const string &filter = string()) {
+	Xxh64 hasher;
+	hasher.update(reinterpret_cast<const unsigned char *>(data.data()), data.size());
+	hasher.update(reinterpret_cast<const unsigned char *>(filter.data()), filter.size());
+	return hasher.digest();
+}
+
+static uint32_t compression_id(CacheCompression algorithm) {
+	for (uint32_t id = 0; id < sizeof(COMPRESSION_IDS) / sizeof(COMPRESSION_IDS[0]); id++) {
+		if (COMPRESSION_IDS[id] == algorithm) {
+			return id;
+		}
+	}
+	return 0;
+}
+
+Cache::Cache(string const &cache_file, CacheCompression compression, CacheIndex *index,
+             CachePack *pack)
+	: cache_file(cache_file), compression(compression), index(index), pack(pack) {
+	if (pack != nullptr) {
+		PackEntry entry;
+		if (pack->lookup(entry_name(), entry) && entry.data.size() >= HEADER_SIZE) {
+			data = entry.data.data();
+			size = entry.data.size();
+			mtime = entry.last_use;
+			pack_offset = entry.offset;
+			parse();
+		}
 		return;
 	}
 
-	unsigned char indicator;
-	fd >> indicator;
-	if (indicator != 'C') {
+	int fd = open(cache_file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		return;
 	}
-	std::string version;
-	std::getline(fd, version, '\0');
-	if (version != CACHE_VERSION) {
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)HEADER_SIZE) {
+		close(fd);
 		return;
 	}
 
-	for (CachePage page; fd >> page; ) {
-		pages.push_back(page);
+	void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return;
 	}
-	valid = true;
+
+	data = static_cast<const char *>(map);
+	size = st.st_size;
+	mtime = st.st_mtime;
+	file_dev = st.st_dev;
+	file_ino = st.st_ino;
+	parse();
 }
 
-void Cache::set_page(unsigned pagenum, const CachePage& page) {
-	pages.resize(max(pagenum, (unsigned)pages.size()));
-	pages[pagenum-1] = page;
+// Check the header of the cache file in `data` and read its bitmap
+void Cache::parse() {
+	uint32_t version = get_le(data + MAGIC_SIZE, 4);
+	uint64_t pages = get_le(data + MAGIC_SIZE + 12, 4);
+	uint64_t table_entries = get_le(data + MAGIC_SIZE + 16, 4);
+	uint64_t words = (pages + 63) / 64;
+
+	if (memcmp(data, CACHE_MAGIC, MAGIC_SIZE) != 0
+	    || (version != CACHE_VERSION && version != UNFILTERED_VERSION)
+	    || HEADER_SIZE + words * 8 + table_entries * ENTRY_SIZE > size) {
+		unmap();
+		return;
+	}
+
+	encrypted = get_le(data + MAGIC_SIZE + 4, 4) & FLAG_ENCRYPTED;
+	page_count = get_le(data + MAGIC_SIZE + 8, 4);
+
+	// Compressed pages of an algorithm that this pdfgrep doesn't know are
+	// treated as missing, see find_entry()
+	uint32_t id = get_le(data + MAGIC_SIZE + 20, 4);
+	if (id < sizeof(COMPRESSION_IDS) / sizeof(COMPRESSION_IDS[0])) {
+		file_compression = COMPRESSION_IDS[id];
+		can_unpack = compression_supported(file_compression);
+	}
+
+	bitmap = data + HEADER_SIZE;
+	table = bitmap + words * 8;
+
+	// Number of cached pages before each word of the bitmap
+	rank.resize(words);
+	uint64_t cached = 0;
+	for (uint64_t i = 0; i < words; i++) {
+		rank[i] = cached;
+		cached += bitset<64>(get_le(bitmap + i * 8, 8)).count();
+	}
+	if (cached != table_entries) {
+		rank.clear();
+		return;
+	}
+
+	bitmap_pages = pages;
+	checked.resize(table_entries, UNCHECKED);
+	// Files are converted to the current algorithm the next time they are
+	// used, so that changing --cache-compression also shrinks old files.
+	// The same goes for files without filters.
+	if (can_unpack && (file_compression != compression || version != CACHE_VERSION)) {
+		dirty = true;
+	}
 }
 
-bool Cache::get_page(unsigned pagenum, CachePage& page) {
-	if (!valid) {
+Cache::~Cache() {
+	unmap();
+}
+
+void Cache::unmap() {
+	// The pack owns the mapping of its entries
+	if (data != nullptr && pack == nullptr) {
+		munmap(const_cast<char *>(data), size);
+	}
+	data = nullptr;
+	size = 0;
+}
+
+string Cache::entry_name() const {
+	return cache_file.substr(cache_file.rfind('/') + 1);
+}
+
+const char *Cache::find_entry(unsigned pagenum) const {
+	if (pagenum == 0 || pagenum > bitmap_pages) {
+		return nullptr;
+	}
+
+	size_t word = (pagenum - 1) / 64;
+	unsigned bit = (pagenum - 1) % 64;
+	uint64_t bits = get_le(bitmap + word * 8, 8);
+	if (!(bits & (uint64_t(1) << bit))) {
+		return nullptr;
+	}
+
+	size_t index = rank[word] + bitset<64>(bits & ((uint64_t(1) << bit) - 1)).count();
+	if (checked[index] == CHECK_FAILED) {
+		return nullptr;
+	}
+
+	const char *entry = table + index * ENTRY_SIZE;
+	uint64_t offset = get_le(entry, 8);
+	uint64_t stored_len = get_le(entry + 8, 4);
+	uint64_t raw_len = get_le(entry + 12, 4) + get_le(entry + 16, 4);
+	uint64_t filter_len = get_le(entry + 20, 4);
+
+	if (offset > size || stored_len + filter_len > size - offset
+	    || (stored_len != raw_len && !can_unpack)) {
+		checked[index] = CHECK_FAILED;
+		return nullptr;
+	}
+
+	// Only the pages that are actually used are checked
+	if (checked[index] == UNCHECKED) {
+		checked[index] = checksum(string_view(data + offset, stored_len + filter_len))
+			== get_le(entry + 24, 8) ? CHECK_OK : CHECK_FAILED;
+	}
+
+	return checked[index] == CHECK_OK ? entry : nullptr;
+}
+
+bool Cache::get_entry(unsigned pagenum, CachePageView &view) const {
+	const char *entry = find_entry(pagenum);
+	if (entry == nullptr) {
 		return false;
 	}
-	if (pagenum-1 < pages.size()) {
-		page = pages[pagenum-1];
+
+	const char *stored = data + get_le(entry, 8);
+	uint64_t stored_len = get_le(entry + 8, 4);
+	uint64_t label_len = get_le(entry + 12, 4);
+	uint64_t text_len = get_le(entry + 16, 4);
+
+	if (stored_len == label_len + text_len) {
+		view.label = string_view(stored, label_len);
+		view.text = string_view(stored + label_len, text_len);
 		return true;
 	}
-	return false;
+
+	auto it = unpacked.find(pagenum);
+	if (it == unpacked.end()) {
+		string buf;
+		if (!decompress_block(file_compression, string_view(stored, stored_len),
+		                      label_len + text_len, buf)) {
+			return false;
+		}
+
+		CachePage &page = unpacked[pagenum];
+		page.label = buf.substr(0, label_len);
+		buf.erase(0, label_len);
+		page.text = std::move(buf);
+		it = unpacked.find(pagenum);
+	}
+
+	view.label = it->second.label;
+	view.text = it->second.text;
+	return true;
+}
+
+void Cache::set_page(unsigned pagenum, CachePage page) {
+	CachePageView old;
+	if (get_page_view(pagenum, old) && old.label == page.label && old.text == page.text) {
+		return;
+	}
+
+	new_pages[pagenum] = std::move(page);
+	dirty = true;
+}
+
+bool Cache::get_page_view(unsigned pagenum, CachePageView &view) const {
+	auto it = new_pages.find(pagenum);
+	if (it != new_pages.end()) {
+		view.label = it->second.label;
+		view.text = it->second.text;
+		return true;
+	}
+
+	return get_entry(pagenum, view);
+}
+
+bool Cache::get_page(unsigned pagenum, CachePage& page) {
+	CachePageView view;
+	if (!get_page_view(pagenum, view)) {
+		return false;
+	}
+	page.label = string(view.label);
+	page.text = string(view.text);
+	return true;
+}
+
+string_view Cache::get_page_filter(unsigned pagenum) const {
+	// New pages get their filter when they are written
+	const char *entry = nullptr;
+	if (new_pages.count(pagenum) == 0) {
+		entry = find_entry(pagenum);
+	}
+	if (entry == nullptr) {
+		return string_view();
+	}
+	return string_view(data + get_le(entry, 8) + get_le(entry + 8, 4), get_le(entry + 20, 4));
+}
+
+bool Cache::has_page(unsigned pagenum) const {
+	// Compressed pages are checked, but not decompressed
+	return new_pages.count(pagenum) > 0 || find_entry(pagenum) != nullptr;
+}
+
+void Cache::set_document_info(unsigned page_count, bool encrypted) {
+	if (page_count != this->page_count || encrypted != this->encrypted) {
+		dirty = true;
+	}
+	this->page_count = page_count;
+	this->encrypted = encrypted;
+}
+
+bool Cache::is_complete(const IntervalContainer &range) const {
+	if (page_count == 0 || encrypted) {
+		return false;
+	}
+
+	for (unsigned pagenum = 1; pagenum <= page_count; pagenum++) {
+		if (range.contains(pagenum) && !has_page(pagenum)) {
+			return false;
+		}
+	}
+	return true;
 }
 
 void Cache::dump() {
-	ofstream fd(cache_file);
-	if (!fd) {
+	if (!dirty) {
+		// The cache index removes the least recently used files, so
+		// files that are used must be touched now and then.
+		if (data != nullptr && time(nullptr) - mtime > TOUCH_INTERVAL) {
+			if (pack != nullptr) {
+				pack->touch(entry_name());
+			} else {
+				utimensat(AT_FDCWD, cache_file.c_str(), nullptr, 0);
+				if (index != nullptr) {
+					index->touch(entry_name(), size);
+				}
+			}
+		}
+		return;
+	}
+
+	if (pack != nullptr) {
+		// Appends are serialized by the lock of the pack. As with files,
+		// the pages of a version that another process appended in the
+		// meantime are kept.
+		int lock = pack->lock();
+		if (lock < 0) {
+			return;
+		}
+
+		PackEntry current;
+		if (pack->lookup(entry_name(), current)
+		    && (data == nullptr || current.offset != pack_offset)) {
+			merge(Cache(cache_file, compression, nullptr, pack));
+		}
+
+		if (pack->append(lock, entry_name(), serialize())) {
+			dirty = false;
+		}
+		close(lock);
+		return;
+	}
+
+	// Writers of the same file are serialized by its lock, and the cache
+	// index doesn't remove a file while it is locked. If the lock creates
+	// the file, it is empty and other processes ignore it.
+	int lock = open_locked(cache_file, O_RDONLY | O_CREAT, LOCK_EX);
+	if (lock < 0) {
 		return;
 	}
-	// The first byte of the cache file is an indicator byte, which can be
-	// written atomically. Initial it is \0, after all pages have been
-	// flushed, the indicator byte is written to 'C' (complete cache).
-	fd << '\0';
-	fd << CACHE_VERSION << '\0';
 
-	for (const CachePage& page : pages) {
-		fd << page;
+	// Another process may have written the file since it was loaded. Its
+	// pages are kept, so that concurrent searches of different pages of a
+	// document don't undo each other's work.
+	struct stat st;
+	if (fstat(lock, &st) == 0 && (data == nullptr || st.st_dev != file_dev
+	                              || st.st_ino != file_ino)) {
+		merge(Cache(cache_file, compression, nullptr));
 	}
 
-	fd.flush();
-	fd.seekp(0, ios_base::beg);
-	fd << 'C';
-	fd.close();
+	if (!write_file(serialize()) && fstat(lock, &st) == 0 && st.st_size == 0) {
+		unlink(cache_file.c_str());
+	}
+	close(lock);
 }
 
-// I feel so bad...
-static const char *cache_directory;
-static int agesort(const struct dirent ** a, const struct dirent **b) {
-	std::string A = string(cache_directory) + "/" + (*a)->d_name;
-	std::string B = string(cache_directory) + "/" + (*b)->d_name;
+void Cache::merge(const Cache &other) {
+	for (unsigned pagenum = 1; pagenum <= other.bitmap_pages; pagenum++) {
+		CachePageView view;
+		if (!has_page(pagenum) && other.get_page_view(pagenum, view)) {
+			new_pages[pagenum] = CachePage { string(view.text), string(view.label) };
+		}
+	}
 
-	struct stat bufa, bufb;
-	if (stat(A.c_str(), &bufa) != 0) {
-		return 0;
+	if (page_count == 0) {
+		page_count = other.page_count;
+		encrypted = other.encrypted;
 	}
-	if (stat(B.c_str(), &bufb) != 0) {
-		return 0;
+}
+
+string Cache::serialize() {
+	unsigned pages = bitmap_pages;
+	if (!new_pages.empty()) {
+		pages = max(pages, new_pages.rbegin()->first);
 	}
 
-	return bufb.st_mtime - bufa.st_mtime;
+	// Pages of the old file that are already compressed with the right
+	// algorithm are copied as they are.
+	struct StoredPage {
+		// the page in the old file or nullptr if it is in `buffer`
+		const char *mapped = nullptr;
+		size_t mapped_len = 0;
+		string buffer;
+		uint64_t label_len;
+		uint64_t text_len;
+		// follows the data
+		string filter;
+
+		string_view data() const {
+			return mapped ? string_view(mapped, mapped_len) : string_view(buffer);
+		}
+	};
+
+	vector<uint64_t> bits((pages + 63) / 64);
+	vector<StoredPage> cached;
+	for (unsigned pagenum = 1; pagenum <= pages; pagenum++) {
+		const char *entry = nullptr;
+		if (new_pages.count(pagenum) == 0) {
+			entry = find_entry(pagenum);
+		}
+
+		StoredPage stored;
+		if (entry != nullptr && get_le(entry + 20, 4) > 0) {
+			stored.filter = string(get_page_filter(pagenum));
+		}
+
+		if (entry != nullptr && file_compression == compression && !stored.filter.empty()) {
+			stored.mapped = data + get_le(entry, 8);
+			stored.mapped_len = get_le(entry + 8, 4);
+			stored.label_len = get_le(entry + 12, 4);
+			stored.text_len = get_le(entry + 16, 4);
+		} else {
+			CachePageView view;
+			if (!get_page_view(pagenum, view)) {
+				continue;
+			}
+			string raw = string(view.label) + string(view.text);
+			if (!compress_block(compression, raw, stored.buffer)
+			    || stored.buffer.size() >= raw.size()) {
+				stored.buffer = std::move(raw);
+			}
+			stored.label_len = view.label.size();
+			stored.text_len = view.text.size();
+			if (stored.filter.empty()) {
+				stored.filter = build_page_filter(view.text);
+			}
+		}
+
+		bits[(pagenum - 1) / 64] |= uint64_t(1) << ((pagenum - 1) % 64);
+		cached.push_back(std::move(stored));
+	}
+
+	string header(CACHE_MAGIC, MAGIC_SIZE);
+	put_le(header, CACHE_VERSION, 4);
+	put_le(header, encrypted ? FLAG_ENCRYPTED : 0, 4);
+	put_le(header, page_count, 4);
+	put_le(header, pages, 4);
+	put_le(header, cached.size(), 4);
+	put_le(header, compression_id(compression), 4);
+
+	for (uint64_t word : bits) {
+		put_le(header, word, 8);
+	}
+
+	uint64_t offset = HEADER_SIZE + bits.size() * 8 + cached.size() * ENTRY_SIZE;
+	for (const StoredPage &page : cached) {
+		put_le(header, offset, 8);
+		put_le(header, page.data().size(), 4);
+		put_le(header, page.label_len, 4);
+		put_le(header, page.text_len, 4);
+		put_le(header, page.filter.size(), 4);
+		put_le(header, checksum(page.data(), page.filter), 8);
+		offset += page.data().size() + page.filter.size();
+	}
+
+	string content = std::move(header);
+	for (const StoredPage &page : cached) {
+		content += page.data();
+		content += page.filter;
+	}
+	return content;
 }
 
-static int agefilter(const struct dirent * a) {
-	if (a->d_name[0] == '.') {
-		return 0;
+bool Cache::write_file(const string &content) {
+	// The new file is written under a temporary name and then renamed, so
+	// that other processes never see a partial file. This also keeps the
+	// old file, which may still be mapped, intact. The leading dot keeps
+	// the cache index away from it.
+	size_t slash = cache_file.rfind('/') + 1;
+	string tmp = cache_file.substr(0, slash) + "." + cache_file.substr(slash) + ".XXXXXX";
+	int fd = create_temp_file(tmp);
+	if (fd < 0) {
+		return false;
 	}
-	std::string A = string(cache_directory) + "/" + a->d_name;
-	struct stat bufa;
-	if (stat(A.c_str(), &bufa) != 0) {
-		return 0;
+
+
+	bool ok = write_all(fd, content.data(), content.size());
+	if (close(fd) != 0 || !ok || rename(tmp.c_str(), cache_file.c_str()) != 0) {
+		unlink(tmp.c_str());
+		forget_temp_file(tmp);
+		return false;
 	}
+	forget_temp_file(tmp);
 
-	// Filter all files that are younger than one day
-	if ((time(nullptr) - bufa.st_mtime) > 24 * 60 * 60) {
-		return 1;
+	if (index != nullptr) {
+		index->touch(entry_name(), content.size());
 	}
+	dirty = false;
+	return true;
+}
 
-	return 0;
+unique_ptr<Cache> open_cache(const Options &opts, const string &cache_file) {
+	if (opts.cache_store == CacheStore::PACK) {
+		return make_unique<Cache>(cache_file, opts.cache_compression, nullptr,
+		                          &get_cache_pack(opts.cache_directory));
+	}
+	return make_unique<Cache>(cache_file, opts.cache_compression,
+	                          &get_cache_index(opts.cache_directory));
 }
 
-void limit_cachesize(const char *cache, int entries) {
-	struct dirent **namelist;
-	cache_directory = cache;
-	int n = scandir(cache, &namelist, agefilter, agesort);
+void remove_cache_entry(const Options &opts, const string &cache_file) {
+	string name = cache_file.substr(cache_file.rfind('/') + 1);
+	if (opts.cache_store == CacheStore::PACK) {
+		get_cache_pack(opts.cache_directory).remove(name);
+	} else {
+		get_cache_index(opts.cache_directory).remove(name);
+	}
+}
 
-	if (n < 0) {
-		return;
+static const char *MANIFEST_FILE = ".manifest";
+
+// The manifest is rewritten when it has this many more lines than entries
+static const size_t MANIFEST_SLACK = 1000;
+
+/* The manifest remembers the checksums of files by their stat data, so that
+ * files that didn't change since the last run don't have to be read again.
+ *
+ * It is a text file in the cache directory with one line per file: the
+ * fingerprint (hash algorithm, device, inode, size, modification and change
+ * time) and the checksum, separated by a space. New entries are appended and
+ * later lines win, so concurrent runs of pdfgrep can't corrupt it. Appends
+ * hold a shared lock on the manifest and compact() an exclusive one, so that
+ * no line is lost when it is rewritten. The leading dot keeps the cache index
+ * from deleting it.
+ *
+ * A file that changed keeps its device and inode, so its new line replaces
+ * the one of the old version. Lines whose cache entry was pruned are only
+ * dropped by compact().
+ */
+class Manifest {
+public:
+	explicit Manifest(const string &cache_directory)
+		: path(cache_directory + MANIFEST_FILE) {
+		size_t lines = read();
+		if (lines > entries.size() + MANIFEST_SLACK) {
+			compact(nullptr);
+		}
 	}
 
-	while (entries--, n-- > 0) {
-		// Skip the first N cache entries
-		if (entries >= 0) {
-			continue;
+	bool lookup(const string &fingerprint, string &digest) {
+		lock_guard<std::mutex> lock(mutex);
+		auto it = entries.find(fingerprint);
+		if (it == entries.end()) {
+			return false;
+		}
+		digest = it->second;
+		return true;
+	}
+
+	void add(const string &fingerprint, const string &digest) {
+		lock_guard<std::mutex> lock(mutex);
+		insert(fingerprint, digest);
+
+		// A single write with O_APPEND, so that lines of concurrent
+		// processes aren't mixed.
+		string line = fingerprint + " " + digest + "\n";
+		int fd = open_locked(path, O_WRONLY | O_APPEND | O_CREAT, LOCK_SH);
+		if (fd < 0) {
+			return;
+		}
+		if (write(fd, line.data(), line.size()) != (ssize_t)line.size()) {
+			err() << "Could not write " << path << endl;
 		}
+		close(fd);
+	}
+
+	/* Read the lines that other processes appended since the manifest was
+	 * read, e.g. in the daemon, which keeps it for a long time. */
+	void reload() {
+		lock_guard<std::mutex> lock(mutex);
+		read();
+	}
+
+	/* Rewrite the manifest with only the entries whose checksum is in
+	 * `live`, or all current entries if it is nullptr. */
+	void compact(const unordered_set<string> *live) {
+		lock_guard<std::mutex> lock(mutex);
+		compact_locked(live);
+	}
 
-		string path(cache + string("/") + namelist[n]->d_name);
-		unlink(path.c_str());
-		free(namelist[n]);
+private:
+	/* Set the checksum of `fingerprint` and forget older versions of the
+	 * same file */
+	void insert(const string &fingerprint, const string &digest) {
+		// The hash algorithm, device and inode, up to the size
+		size_t end = fingerprint.find(':', fingerprint.find(':', fingerprint.find(':') + 1) + 1);
+		if (end != string::npos) {
+			string file = fingerprint.substr(0, end + 1);
+			auto it = entries.lower_bound(file);
+			while (it != entries.end() && it->first.compare(0, file.size(), file) == 0) {
+				it = it->first == fingerprint ? next(it) : entries.erase(it);
+			}
+		}
+		entries[fingerprint] = digest;
 	}
-	free(namelist);
+
+	/* Add the entries of the manifest file that weren't read yet and
+	 * return their number of lines */
+	size_t read() {
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			return 0;
+		}
+
+		// compact() replaces the file, which is then read again
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			return 0;
+		}
+		if (st.st_dev != file_dev || st.st_ino != file_ino || st.st_size < read_end) {
+			file_dev = st.st_dev;
+			file_ino = st.st_ino;
+			read_end = 0;
+		}
+
+		string content;
+		char buf[65536];
+		ssize_t len;
+		while ((len = pread(fd, buf, sizeof(buf), read_end + content.size())) > 0) {
+			content.append(buf, len);
+		}
+		close(fd);
+
+		size_t lines = 0;
+		size_t start = 0;
+		for (size_t end; (end = content.find('\n', start)) != string::npos; start = end + 1) {
+			size_t sep = content.find(' ', start);
+			if (sep >= end) {
+				continue;
+			}
+			insert(content.substr(start, sep - start), content.substr(sep + 1, end - sep - 1));
+			lines++;
+		}
+
+		// A line that is still being written is read next time
+		read_end += start;
+		return lines;
+	}
+
+	// Write only the current entries to a new manifest
+	void compact_locked(const unordered_set<string> *live) {
+		int lock = open_locked(path, O_RDONLY | O_CREAT, LOCK_EX);
+		if (lock < 0) {
+			return;
+		}
+
+		// Other processes may have appended lines since the manifest was
+		// read
+		read();
+
+		if (live) {
+			for (auto it = entries.begin(); it != entries.end();) {
+				it = live->count(it->second) > 0 ? next(it) : entries.erase(it);
+			}
+		}
+
+		string tmp = path + ".XXXXXX";
+		int fd = create_temp_file(tmp);
+		if (fd < 0) {
+			close(lock);
+			return;
+		}
+		close(fd);
+		bool ok;
+		{
+			ofstream file(tmp);
+			for (const auto &entry : entries) {
+				file << entry.first << ' ' << entry.second << '\n';
+			}
+			ok = static_cast<bool>(file.flush());
+		}
+		if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+			unlink(tmp.c_str());
+		}
+		forget_temp_file(tmp);
+		close(lock);
+	}
+
+	string path;
+	map<string, string> entries;
+	// the file that was read and how much of it
+	dev_t file_dev = 0;
+	ino_t file_ino = 0;
+	off_t read_end = 0;
+	std::mutex mutex;
+};
+
+static std::mutex manifest_mutex;
+// by cache directory
+static map<string, unique_ptr<Manifest>> manifests;
+
+static Manifest &get_manifest(const string &cache_directory)
+{
+	lock_guard<std::mutex> lock(manifest_mutex);
+	unique_ptr<Manifest> &manifest = manifests[cache_directory];
+	if (!manifest) {
+		manifest = make_unique<Manifest>(cache_directory);
+	}
+	return *manifest;
+}
+
+void prune_manifest(const string &cache_directory)
+{
+	// An entry can be in either store, even if only one of them was
+	// pruned. The names are collected before the manifest is locked,
+	// because that blocks lookups and other processes. A checksum that
+	// is added meanwhile may be dropped, which only means that its file
+	// is read again.
+	unordered_set<string> live;
+	for (string &name : get_cache_pack(cache_directory).entry_names()) {
+		live.insert(std::move(name));
+	}
+	for (string &name : get_cache_index(cache_directory).entry_names()) {
+		live.insert(std::move(name));
+	}
+
+	get_manifest(cache_directory).compact(&live);
+}
+
+void release_cache_mappings(const Options &opts)
+{
+	if (opts.cache_store == CacheStore::PACK) {
+		get_cache_pack(opts.cache_directory).release_mappings();
+	}
+}
+
+void reload_cache_state(const string &cache_directory)
+{
+	get_manifest(cache_directory).reload();
+	get_cache_pack(cache_directory).reload();
+}
+
+static string fingerprint(CacheHash algorithm, const struct stat &st)
+{
+	ostringstream str;
+	str << (algorithm == CacheHash::SHA1 ? "sha1" : "xxh64")
+	    << ':' << st.st_dev << ':' << st.st_ino << ':' << st.st_size
+#ifdef __APPLE__
+	    << ':' << st.st_mtimespec.tv_sec << '.' << st.st_mtimespec.tv_nsec
+	    << ':' << st.st_ctimespec.tv_sec << '.' << st.st_ctimespec.tv_nsec;
+#else
+	    << ':' << st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec
+	    << ':' << st.st_ctim.tv_sec << '.' << st.st_ctim.tv_nsec;
+#endif
+	return str.str();
+}
+
+int cache_file_name(const std::string &cache_directory, const std::string &path,
+                    CacheHash algorithm, std::string &cache_file)
+{
+	Manifest &files = get_manifest(cache_directory);
+	string digest;
+
+	struct stat st;
+	if (stat(path.c_str(), &st) == 0
+	    && files.lookup(fingerprint(algorithm, st), digest)) {
+		cache_file = cache_directory + digest;
+		return 0;
+	}
+
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	struct stat before, after;
+	if (fstat(fd, &before) != 0 || hash_file(fd, algorithm, digest) != 0
+	    || fstat(fd, &after) != 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	// If the file changed while we read it, the checksum may belong to
+	// neither version.
+	if (fingerprint(algorithm, before) == fingerprint(algorithm, after)) {
+		files.add(fingerprint(algorithm, after), digest);
+	}
+
+	cache_file = cache_directory + digest;
+	return 0;
 }
 
 int find_cache_directory(std::string &dir)
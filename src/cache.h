@@ -22,28 +22,169 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <map>
+#include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <ctime>
+#include <cstdint>
+
+#include <sys/types.h>
+
+#include "pdfgrep.h"
+
+class CacheIndex;
+class CachePack;
 
 struct CachePage {
 	std::string text;
 	std::string label;
 };
 
+// A page in the cache, without a copy of its text
+struct CachePageView {
+	std::string_view text;
+	std::string_view label;
+};
+
+/** The extracted text of the pages of one PDF.
+ *
+ * The cache file is mapped into memory and only the pages that are requested
+ * are read (see the description of the format in cache.cc). Any subset of the
+ * pages of a document can be cached. Pages that are
+ * added with set_page() are kept in memory until dump() writes a new file.
+ *
+ * Each page can be compressed on its own, so reading a page never needs more
+ * than that page to be decompressed.
+ */
 class Cache {
-	std::vector<CachePage> pages;
 	std::string cache_file;
-	bool valid;
+	// the mapped cache file or nullptr
+	const char *data = nullptr;
+	size_t size = 0;
+	// compression of the pages in the mapped file
+	CacheCompression file_compression = CacheCompression::NONE;
+	// false if the pages of the file were compressed with an algorithm that
+	// pdfgrep wasn't compiled with
+	bool can_unpack = false;
+	// compression for the pages written by dump()
+	CacheCompression compression;
+	// the presence bitmap and the page table in the file
+	const char *bitmap = nullptr;
+	const char *table = nullptr;
+	// number of pages in the bitmap
+	unsigned bitmap_pages = 0;
+	// number of cached pages before each word of the bitmap
+	std::vector<uint32_t> rank;
+	// result of the checksum test of each table entry, see has_page()
+	mutable std::vector<char> checked;
+	// compressed pages of the file that were read
+	mutable std::map<unsigned, CachePage> unpacked;
+	// pages added since the file was loaded
+	std::map<unsigned, CachePage> new_pages;
+	// number of pages of the document or 0 if it isn't known
+	unsigned page_count = 0;
+	bool encrypted = false;
+	// true if the file has to be written by dump()
+	bool dirty = false;
+	// modification time and identity of the file
+	time_t mtime = 0;
+	dev_t file_dev = 0;
+	ino_t file_ino = 0;
+	// notified by dump(), may be nullptr
+	CacheIndex *index;
+	// the pack that holds the entry, nullptr if it is a file of its own
+	CachePack *pack;
+	// position of the entry in the pack
+	uint64_t pack_offset = 0;
+
+	void parse();
+	void unmap();
+	std::string entry_name() const;
+	const char *find_entry(unsigned pagenum) const;
+	bool get_entry(unsigned pagenum, CachePageView &view) const;
+	// Add the pages of `other` that this cache doesn't have
+	void merge(const Cache &other);
+	// The mapped and the new pages in the format of a cache file
+	std::string serialize();
+	bool write_file(const std::string &content);
 public:
-	explicit Cache(std::string const& cache_file);
+	/* Open the cache file. New pages are compressed with `compression`
+	 * when the file is written again. Pages that are already in the file
+	 * can be read with any algorithm that pdfgrep was compiled with.
+	 *
+	 * dump() records the use of the file in `index`, unless it is
+	 * nullptr. If `pack` isn't nullptr, the entry is kept in the pack
+	 * under the name of `cache_file` instead. */
+	Cache(std::string const& cache_file, CacheCompression compression,
+	      CacheIndex *index, CachePack *pack = nullptr);
+	~Cache();
+
+	Cache(const Cache &) = delete;
+	Cache &operator=(const Cache &) = delete;
 
 	bool get_page(unsigned pagenum, CachePage& text);
-	void set_page(unsigned pagenum, const CachePage& page);
+	/* Like get_page(), but the view is only valid until the next call of
+	 * set_page() or dump(), or until the cache is destroyed. */
+	bool get_page_view(unsigned pagenum, CachePageView &view) const;
+	bool has_page(unsigned pagenum) const;
+	/* The Bloom filter of a page in the file (see build_page_filter()),
+	 * valid as long as a view of get_page_view(). Empty if the page has
+	 * none, e.g. because it was added with set_page(). */
+	std::string_view get_page_filter(unsigned pagenum) const;
+	/* Add a page. Pass it with std::move() if it isn't needed anymore,
+	 * then it isn't copied. */
+	void set_page(unsigned pagenum, CachePage page);
 
+	/* Remember the number of pages of the document and if it is
+	 * encrypted, so that later runs don't need to open it. */
+	void set_document_info(unsigned page_count, bool encrypted);
+	unsigned get_page_count() const { return page_count; }
+	bool is_encrypted() const { return encrypted; }
+
+	/* True if all pages in `range` are cached. In that case, the document
+	 * doesn't have to be opened at all. Never true for encrypted documents,
+	 * which have to be opened to check the password.
+	 */
+	bool is_complete(const IntervalContainer &range) const;
+
+	/* Write the cache file, if anything changed since it was loaded.
+	 *
+	 * Many processes may use the same cache file. The file is replaced
+	 * atomically, so readers see either the old or the new version. If
+	 * another process wrote the file in the meantime, its pages are
+	 * merged into the new version. */
 	void dump();
 };
 
-void limit_cachesize(const char *cache, int entries);
+/* Open the cache for `cache_file` in the store that `opts` select */
+std::unique_ptr<Cache> open_cache(const Options &opts, const std::string &cache_file);
+
+/* Remove the entry `cache_file` from the store that `opts` select */
+void remove_cache_entry(const Options &opts, const std::string &cache_file);
+
+/** Write the name of the cache file for the PDF at `path` to cache_file.
+ *
+ * The name is derived from the checksum of the file's content. The checksum is
+ * only computed if the file changed since it was last seen (see the manifest
+ * in cache.cc). Returns -1 if the file can't be read and 0 on success.
+ */
+int cache_file_name(const std::string &cache_directory, const std::string &path,
+                    CacheHash algorithm, std::string &cache_file);
+
+/* Drop the checksums of files whose cache entry is gone from the manifest
+ * of `cache_directory`. Run it after pruning or compacting the cache. */
+void prune_manifest(const std::string &cache_directory);
+
+/* Unmap the old versions of the pack that `opts` select, see
+ * CachePack::release_mappings(). Only while no Cache is open. */
+void release_cache_mappings(const Options &opts);
+
+/* Read what other processes added to the manifest and the pack of
+ * `cache_directory` since they were loaded. For the daemon, whose children
+ * inherit both. */
+void reload_cache_state(const std::string &cache_directory);
 
 /** Write cache directory to dir.
  *
@@ -0,0 +1,664 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "cacheindex.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+/* The index is a sequence of records of RECORD_SIZE bytes. Numbers are little
+ * endian.
+ *
+ *   u8  name length    number of bytes in name, 0 for the summary
+ *   20  name           the name of the cache file, a hex string, as bytes
+ *   3   padding        0
+ *   u64 size           of the cache file
+ *   u64 last use       seconds since the epoch
+ *
+ * The first record of an index written by prune() is a summary: its name is
+ * SUMMARY_MAGIC, the size is the total size of all entries and the last use
+ * field is the number of entries, which follow the summary.
+ *
+ * touch() only appends records, later ones win. needs_prune() thus only has
+ * to read the records after the entries to notice that the cache grew. When
+ * there are INDEX_SLACK of them, prune() writes a compacted index. A record
+ * with a size of 0 means that the file was removed (see remove()).
+ *
+ * Many processes can share the cache directory:
+ *
+ *  - touch() holds a shared lock on the index while it appends, prune() an
+ *    exclusive lock while it replaces the index. So no record is lost.
+ *  - Only one process prunes at a time. It holds the lock file LOCK_FILE.
+ *  - Writers of a cache file and prune() lock the file (see Cache::dump()),
+ *    so prune() never removes a file that was just written or used.
+ *    Processes that read the file don't lock it. If it is removed, they
+ *    keep the copy that they have mapped.
+ */
+static const char *INDEX_FILE = ".index";
+static const char *LOCK_FILE = ".lock";
+static const size_t RECORD_SIZE = 1 + 20 + 3 + 8 + 8;
+static const char SUMMARY_MAGIC[] = "PGINDEX1";
+static const size_t MAX_NAME_BYTES = 20;
+static const size_t INDEX_SLACK = 1000;
+
+struct IndexEntry {
+	uint64_t size;
+	uint64_t last_use;
+};
+
+struct CacheIndex::Entries {
+	unordered_map<string, IndexEntry> map;
+};
+
+static uint64_t get_le(const char *p, int bytes) {
+	uint64_t value = 0;
+	for (int i = bytes - 1; i >= 0; i--) {
+		value = (value << 8) | static_cast<unsigned char>(p[i]);
+	}
+	return value;
+}
+
+static void put_le(char *p, uint64_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		p[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+	}
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+// Cache files are named by the hex string of a SHA-1 or XXH64 checksum
+static bool is_cache_name(const string &name) {
+	if (name.size() != 2 * 8 && name.size() != 2 * MAX_NAME_BYTES) {
+		return false;
+	}
+	return all_of(name.begin(), name.end(), [](char c) { return hex_value(c) >= 0; });
+}
+
+static string make_record(const string &name, uint64_t size, uint64_t last_use) {
+	string record(RECORD_SIZE, '\0');
+	record[0] = static_cast<char>(name.size() / 2);
+	for (size_t i = 0; i < name.size() / 2; i++) {
+		record[1 + i] = static_cast<char>(hex_value(name[2 * i]) << 4 | hex_value(name[2 * i + 1]));
+	}
+	put_le(&record[24], size, 8);
+	put_le(&record[32], last_use, 8);
+	return record;
+}
+
+static string make_summary(size_t entries, uint64_t bytes) {
+	string record(RECORD_SIZE, '\0');
+	memcpy(&record[1], SUMMARY_MAGIC, strlen(SUMMARY_MAGIC));
+	put_le(&record[24], bytes, 8);
+	put_le(&record[32], entries, 8);
+	return record;
+}
+
+static bool is_summary(const char *record) {
+	return record[0] == 0 && memcmp(record + 1, SUMMARY_MAGIC, strlen(SUMMARY_MAGIC)) == 0;
+}
+
+// The name of the cache file in a record, or "" if the record is invalid
+static string record_name(const char *record) {
+	const char translate[] = "0123456789abcdef";
+	size_t len = static_cast<unsigned char>(record[0]);
+	if (len != 8 && len != MAX_NAME_BYTES) {
+		return "";
+	}
+
+	string name;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = record[1 + i];
+		name += translate[c >> 4];
+		name += translate[c & 0xf];
+	}
+	return name;
+}
+
+static bool read_all(int fd, off_t offset, char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = pread(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+static bool write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+// Add the records in [from, to) of the index to `entries`
+static bool read_records(int fd, off_t from, off_t to,
+                         unordered_map<string, IndexEntry> &entries) {
+	string buf(to - from, '\0');
+	if (!read_all(fd, from, &buf[0], buf.size())) {
+		return false;
+	}
+
+	for (size_t pos = 0; pos + RECORD_SIZE <= buf.size(); pos += RECORD_SIZE) {
+		const char *record = buf.data() + pos;
+		string name = record_name(record);
+		uint64_t size = get_le(record + 24, 8);
+		if (name.empty()) {
+			continue;
+		} else if (size == 0) {
+			entries.erase(name);
+		} else {
+			entries[name] = IndexEntry { size, get_le(record + 32, 8) };
+		}
+	}
+	return true;
+}
+
+int open_locked(const string &path, int flags, int operation)
+{
+	while (true) {
+		int fd = open(path.c_str(), flags | O_CLOEXEC, 0600);
+		if (fd < 0) {
+			return -1;
+		}
+
+		int ret;
+		do {
+			ret = flock(fd, operation);
+		} while (ret != 0 && errno == EINTR);
+		if (ret != 0) {
+			int saved_errno = errno;
+			close(fd);
+			errno = saved_errno;
+			return -1;
+		}
+
+		struct stat locked, current;
+		if (fstat(fd, &locked) == 0 && stat(path.c_str(), &current) == 0
+		    && locked.st_dev == current.st_dev && locked.st_ino == current.st_ino) {
+			return fd;
+		}
+
+		// The file was replaced or removed while we waited for the lock
+		close(fd);
+	}
+}
+
+namespace {
+
+// The files of create_temp_file(). A signal handler only reads the path of a
+// slot while its state is SLOT_READY.
+enum { SLOT_FREE, SLOT_BUSY, SLOT_READY };
+struct TempSlot {
+	std::atomic<int> state { SLOT_FREE };
+	char path[PATH_MAX];
+};
+// Only so many temporary files are open at once. The rest is not removed by
+// remove_temp_files().
+TempSlot temp_slots[64];
+
+} // namespace
+
+int create_temp_file(string &path)
+{
+	int fd = mkstemp(&path[0]);
+	if (fd < 0 || path.size() >= PATH_MAX) {
+		return fd;
+	}
+
+	for (TempSlot &slot : temp_slots) {
+		int expected = SLOT_FREE;
+		if (slot.state.compare_exchange_strong(expected, SLOT_BUSY)) {
+			memcpy(slot.path, path.c_str(), path.size() + 1);
+			slot.state = SLOT_READY;
+			break;
+		}
+	}
+	return fd;
+}
+
+void forget_temp_file(const string &path)
+{
+	for (TempSlot &slot : temp_slots) {
+		int expected = SLOT_READY;
+		if (slot.state == SLOT_READY && path == slot.path
+		    && slot.state.compare_exchange_strong(expected, SLOT_BUSY)) {
+			slot.state = SLOT_FREE;
+			return;
+		}
+	}
+}
+
+void remove_temp_files()
+{
+	for (TempSlot &slot : temp_slots) {
+		if (slot.state == SLOT_READY) {
+			unlink(slot.path);
+		}
+	}
+}
+
+CacheIndex::CacheIndex(const string &cache_directory)
+	: directory(cache_directory)
+	, path(cache_directory + INDEX_FILE)
+{
+}
+
+CacheIndex::~CacheIndex()
+{
+	stop_background();
+}
+
+void CacheIndex::touch(const string &name, uint64_t size)
+{
+	if (!is_cache_name(name)) {
+		return;
+	}
+
+	string record = make_record(name, size, time(nullptr));
+
+	// A single write with O_APPEND, so that records of concurrent
+	// processes aren't mixed.
+	int fd = open_locked(path, O_WRONLY | O_APPEND | O_CREAT, LOCK_SH);
+	if (fd < 0) {
+		return;
+	}
+	write_all(fd, record.data(), record.size());
+	close(fd);
+}
+
+void CacheIndex::remove(const string &name)
+{
+	if (!is_cache_name(name)) {
+		return;
+	}
+
+	// Writers of the file hold the same lock, see remove_entry()
+	string file = directory + name;
+	int fd = open_locked(file, O_RDONLY, LOCK_EX);
+	if (fd < 0) {
+		return;
+	}
+	bool removed = unlink(file.c_str()) == 0;
+	close(fd);
+
+	if (removed) {
+		touch(name, 0);
+	}
+}
+
+/* Read the whole index into `entries` and set `end` to the offset up to which
+ * it was read. Returns false if the index doesn't start with a summary, i.e.
+ * it may not know all files in the directory.
+ */
+bool CacheIndex::load(Entries &entries, off_t &end)
+{
+	end = 0;
+
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	char first[RECORD_SIZE];
+	bool complete = false;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)RECORD_SIZE) {
+		end = st.st_size - st.st_size % RECORD_SIZE;
+		complete = read_all(fd, 0, first, RECORD_SIZE) && is_summary(first);
+		if (!read_records(fd, 0, end, entries.map)) {
+			complete = false;
+		}
+	}
+
+	close(fd);
+	return complete;
+}
+
+/* Add the cache files that aren't in the index yet and drop the entries whose
+ * files are gone. The last use of a new file is its modification time, which
+ * older versions of pdfgrep updated on every use.
+ */
+void CacheIndex::scan_directory(Entries &entries)
+{
+	DIR *dir = opendir(directory.c_str());
+	if (dir == nullptr) {
+		return;
+	}
+
+	unordered_map<string, IndexEntry> found;
+	struct dirent *dirent;
+	while ((dirent = readdir(dir)) != nullptr) {
+		string name = dirent->d_name;
+		if (!is_cache_name(name)) {
+			continue;
+		}
+
+		auto it = entries.map.find(name);
+		if (it != entries.map.end()) {
+			found.insert(*it);
+			continue;
+		}
+
+		struct stat st;
+		if (fstatat(dirfd(dir), name.c_str(), &st, 0) == 0 && S_ISREG(st.st_mode)) {
+			found[name] = IndexEntry { static_cast<uint64_t>(st.st_size),
+			                           static_cast<uint64_t>(st.st_mtime) };
+		}
+	}
+	closedir(dir);
+
+	entries.map = std::move(found);
+}
+
+bool CacheIndex::needs_prune(const CacheBudget &budget)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return true;
+	}
+
+	struct stat st;
+	char summary[RECORD_SIZE];
+	if (fstat(fd, &st) != 0 || !read_all(fd, 0, summary, RECORD_SIZE) || !is_summary(summary)) {
+		close(fd);
+		return true;
+	}
+
+	uint64_t bytes = get_le(summary + 24, 8);
+	uint64_t entries = get_le(summary + 32, 8);
+	off_t tail = (1 + entries) * RECORD_SIZE;
+	off_t end = st.st_size - st.st_size % RECORD_SIZE;
+
+	if (tail > end || static_cast<size_t>(end - tail) / RECORD_SIZE > INDEX_SLACK) {
+		close(fd);
+		return true;
+	}
+
+	// The new records may replace old entries, so this overestimates the
+	// size a bit.
+	string buf(end - tail, '\0');
+	bool ok = read_all(fd, tail, &buf[0], buf.size());
+	close(fd);
+	if (!ok) {
+		return true;
+	}
+
+	for (size_t pos = 0; pos < buf.size(); pos += RECORD_SIZE) {
+		bytes += get_le(buf.data() + pos + 24, 8);
+		entries++;
+	}
+
+	return bytes > budget.bytes || (budget.entries > 0 && entries > budget.entries);
+}
+
+PruneResult CacheIndex::prune(const CacheBudget &budget)
+{
+	// If the lock file can't be created, prune anyway
+	int lock = open_locked(directory + LOCK_FILE, O_RDONLY | O_CREAT, LOCK_EX);
+	PruneResult result = prune_locked(budget);
+	if (lock >= 0) {
+		close(lock);
+	}
+	return result;
+}
+
+void CacheIndex::prune_in_background(const CacheBudget &budget,
+                                     function<void()> removed)
+{
+	if (pruner.joinable()) {
+		return;
+	}
+
+	pruner = thread([this, budget, removed] {
+		int lock = open_locked(directory + LOCK_FILE, O_RDONLY | O_CREAT, LOCK_EX | LOCK_NB);
+		if (lock < 0) {
+			return;
+		}
+		PruneResult result = prune_locked(budget);
+		close(lock);
+		if (result.removed > 0 && removed && !stopping) {
+			removed();
+		}
+	});
+}
+
+void CacheIndex::stop_background()
+{
+	stopping = true;
+	if (pruner.joinable()) {
+		pruner.join();
+	}
+	stopping = false;
+}
+
+/* Remove the cache file `name`, unless it was written or used after
+ * `last_use`. Returns true if the file is gone.
+ */
+bool CacheIndex::remove_entry(const string &name, uint64_t last_use)
+{
+	string file = directory + name;
+	int fd = open_locked(file, O_RDONLY, LOCK_EX);
+	if (fd < 0) {
+		return errno == ENOENT;
+	}
+
+	struct stat st;
+	bool removed = fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_mtime) <= last_use
+		&& unlink(file.c_str()) == 0;
+	close(fd);
+	return removed;
+}
+
+PruneResult CacheIndex::prune_locked(const CacheBudget &budget)
+{
+	Entries entries;
+	off_t end;
+	if (!load(entries, end)) {
+		scan_directory(entries);
+	}
+
+	vector<pair<string, IndexEntry>> lru(entries.map.begin(), entries.map.end());
+	sort(lru.begin(), lru.end(), [](const pair<string, IndexEntry> &a,
+	                                const pair<string, IndexEntry> &b) {
+		return a.second.last_use < b.second.last_use;
+	});
+
+	PruneResult result;
+	result.entries = lru.size();
+	for (const auto &entry : lru) {
+		result.bytes += entry.second.size;
+	}
+
+	for (const auto &entry : lru) {
+		if (result.bytes <= budget.bytes
+		    && (budget.entries == 0 || result.entries <= budget.entries)) {
+			break;
+		}
+		if (stopping && !budget.far_exceeded(result.bytes, result.entries)) {
+			break;
+		}
+
+		if (!remove_entry(entry.first, entry.second.last_use)) {
+			continue;
+		}
+
+		entries.map.erase(entry.first);
+		result.removed++;
+		result.removed_bytes += entry.second.size;
+		result.entries--;
+		result.bytes -= entry.second.size;
+	}
+
+	write_index(entries, end, result);
+	return result;
+}
+
+/* Replace the index with the summary and `entries`, and the records that
+ * were appended after `end` in the meantime.
+ */
+void CacheIndex::write_index(Entries &entries, off_t end, PruneResult &result)
+{
+	int fd = open_locked(path, O_RDONLY | O_CREAT, LOCK_EX);
+	if (fd < 0) {
+		return;
+	}
+
+	// Files that were written in the meantime are kept, even if an older
+	// version of them was just removed.
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > end) {
+		read_records(fd, end, st.st_size - st.st_size % RECORD_SIZE, entries.map);
+	}
+
+	result.entries = entries.map.size();
+	result.bytes = 0;
+	string content = make_summary(0, 0);
+	for (const auto &entry : entries.map) {
+		content += make_record(entry.first, entry.second.size, entry.second.last_use);
+		result.bytes += entry.second.size;
+	}
+	content.replace(0, RECORD_SIZE, make_summary(result.entries, result.bytes));
+
+	// The new index is renamed while the lock on the old one is still
+	// held, so that no record is appended to the old one after it was
+	// read. The leading dot of the index keeps its temporary file out of
+	// scan_directory().
+	string tmp = path + ".XXXXXX";
+	int tmp_fd = create_temp_file(tmp);
+	if (tmp_fd >= 0) {
+		bool ok = write_all(tmp_fd, content.data(), content.size());
+		if (close(tmp_fd) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+			unlink(tmp.c_str());
+		}
+		forget_temp_file(tmp);
+	}
+
+	close(fd);
+}
+
+CacheStats CacheIndex::stats()
+{
+	Entries entries;
+	off_t end;
+	bool complete = load(entries, end);
+	if (!complete) {
+		scan_directory(entries);
+	}
+
+	CacheStats stats;
+	stats.records = end / RECORD_SIZE;
+	if (complete) {
+		// the summary isn't an entry
+		stats.records--;
+	}
+
+	for (const auto &entry : entries.map) {
+		const IndexEntry &e = entry.second;
+		if (stats.entries == 0 || (time_t)e.last_use < stats.oldest) {
+			stats.oldest = e.last_use;
+		}
+		if (stats.entries == 0 || (time_t)e.last_use > stats.newest) {
+			stats.newest = e.last_use;
+		}
+		stats.entries++;
+		stats.bytes += e.size;
+	}
+	return stats;
+}
+
+vector<string> CacheIndex::entry_names()
+{
+	vector<string> names;
+
+	DIR *dir = opendir(directory.c_str());
+	if (dir == nullptr) {
+		return names;
+	}
+
+	struct dirent *dirent;
+	while ((dirent = readdir(dir)) != nullptr) {
+		if (is_cache_name(dirent->d_name)) {
+			names.push_back(dirent->d_name);
+		}
+	}
+	closedir(dir);
+
+	return names;
+}
+
+static std::mutex index_mutex;
+// by cache directory
+static map<string, unique_ptr<CacheIndex>> cache_indexes;
+
+CacheIndex &get_cache_index(const string &cache_directory)
+{
+	lock_guard<std::mutex> lock(index_mutex);
+	unique_ptr<CacheIndex> &index = cache_indexes[cache_directory];
+	if (!index) {
+		index = make_unique<CacheIndex>(cache_directory);
+	}
+	return *index;
+}
+
+void stop_cache_pruning()
+{
+	lock_guard<std::mutex> lock(index_mutex);
+	for (auto &index : cache_indexes) {
+		index.second->stop_background();
+	}
+}
@@ -0,0 +1,171 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef CACHEINDEX_H
+#define CACHEINDEX_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How much the cache may hold before prune() removes entries
+struct CacheBudget {
+	uint64_t bytes;
+	// maximum number of entries, 0 for no limit
+	size_t entries = 0;
+
+	/* True if the cache is more than twice as large as the budget. Then
+	 * the removal of entries isn't stopped, see
+	 * CacheIndex::stop_background(). */
+	bool far_exceeded(uint64_t cache_bytes, size_t cache_entries) const {
+		return cache_bytes > 2 * bytes || (entries > 0 && cache_entries > 2 * entries);
+	}
+};
+
+struct CacheStats {
+	size_t entries = 0;
+	uint64_t bytes = 0;
+	// last use of the least and most recently used entry
+	time_t oldest = 0;
+	time_t newest = 0;
+	// records in the index file, including outdated ones. For the pack,
+	// the records that its hash table doesn't cover yet.
+	size_t records = 0;
+	// size of the pack file, 0 if every entry is a file of its own
+	uint64_t pack_bytes = 0;
+};
+
+struct PruneResult {
+	size_t removed = 0;
+	uint64_t removed_bytes = 0;
+	size_t entries = 0;
+	uint64_t bytes = 0;
+};
+
+/** The size and last use of every file in the cache directory.
+ *
+ * The index is the file .index in the cache directory (see the format in
+ * cacheindex.cc). It is only read to prune the cache. Writing or using a
+ * cache file appends a record to it, so a normal search never reads it. A
+ * cache directory of an older pdfgrep without index is scanned once by the
+ * first prune().
+ */
+class CacheIndex {
+public:
+	explicit CacheIndex(const std::string &cache_directory);
+	// Stops a pruning thread
+	~CacheIndex();
+
+	CacheIndex(const CacheIndex &) = delete;
+	CacheIndex &operator=(const CacheIndex &) = delete;
+
+	/* Record that the cache file `name` was written or used and has `size`
+	 * bytes now. */
+	void touch(const std::string &name, uint64_t size);
+
+	/* Remove the cache file `name`, e.g. because its PDF was deleted */
+	void remove(const std::string &name);
+
+	/* Cheap check if prune() has work to do: The records added since the
+	 * last prune() may exceed the budget, or the index needs to be
+	 * compacted or built. Only reads the end of the index. */
+	bool needs_prune(const CacheBudget &budget);
+
+	/* Remove the least recently used entries until the cache fits into
+	 * `budget` and compact the index. Waits if another process prunes
+	 * the same directory. */
+	PruneResult prune(const CacheBudget &budget);
+
+	/* Run prune() in a thread, while the search goes on. Does nothing
+	 * if another process prunes the directory already. The thread calls
+	 * `removed` if entries were removed. */
+	void prune_in_background(const CacheBudget &budget,
+	                         std::function<void()> removed = nullptr);
+
+	/* Make the thread of prune_in_background() stop after the entry it is
+	 * removing and wait for it. A later prune removes the rest. While the
+	 * cache is more than twice as large as the budget, the thread goes on
+	 * until it isn't, so that short runs of pdfgrep can't let it grow
+	 * forever. The scan of a directory without index isn't interrupted
+	 * either, because it would have to start over. */
+	void stop_background();
+
+	CacheStats stats();
+
+	/* The names of all files in the cache directory */
+	std::vector<std::string> entry_names();
+
+private:
+	struct Entries;
+
+	bool load(Entries &entries, off_t &end);
+	void scan_directory(Entries &entries);
+	bool remove_entry(const std::string &name, uint64_t last_use);
+	PruneResult prune_locked(const CacheBudget &budget);
+	void write_index(Entries &entries, off_t end, PruneResult &result);
+
+	std::string directory;
+	std::string path;
+	std::thread pruner;
+	// set by stop_background()
+	std::atomic<bool> stopping { false };
+};
+
+/* The index of `cache_directory`, created on the first call for it */
+CacheIndex &get_cache_index(const std::string &cache_directory);
+
+/* Stop the pruning threads of the indexes, if there are any, see
+ * CacheIndex::stop_background() */
+void stop_cache_pruning();
+
+/** Open the file at `path` and lock it with flock(`operation`).
+ *
+ * Files in the cache directory are replaced with rename(), so a lock on the
+ * file is only useful if it is still the file at `path` once the lock is
+ * granted. Otherwise, the newer file is locked instead. Readers don't need
+ * locks, because the file at a path is always complete and never changes.
+ *
+ * Returns the file descriptor, which holds the lock until it is closed, or -1
+ * with errno set. With LOCK_NB, errno is EWOULDBLOCK if the file is locked.
+ */
+int open_locked(const std::string &path, int flags, int operation);
+
+/** Create a file from the mkstemp() template `path`, like mkstemp().
+ *
+ * The file is remembered until forget_temp_file(), which must be called once
+ * it was renamed or removed, so that remove_temp_files() can remove it if the
+ * process is terminated before that.
+ */
+int create_temp_file(std::string &path);
+void forget_temp_file(const std::string &path);
+
+/* Remove the files of create_temp_file() that weren't forgotten yet. Safe to
+ * call from a signal handler. */
+void remove_temp_files();
+
+#endif /* CACHEINDEX_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
@@ -0,0 +1,947 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "cachepack.h"
+#include "hash.h"
+#include "output.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+/* Format of the pack. All numbers are little endian.
+ *
+ *   header:  "PGPACK01"          PACK_MAGIC
+ *            u64 id              random, changes when the pack is compacted
+ *   records: u8  name length
+ *            40  name            of the entry, padded with zeros
+ *            7   padding         0
+ *            u64 time            when the record was appended
+ *            u64 length          of the data
+ *            u64 checksum        XXH64 of the header before it
+ *            data                padded with zeros to a multiple of 8 bytes
+ *
+ * The data of an entry is the content of a cache file in the format described
+ * in cache.cc. Later records of the same name replace earlier ones, and a
+ * record without data removes the entry. A record whose header is incomplete
+ * or has a wrong checksum ends the pack. Such a record is the remainder of a
+ * crash and is overwritten by the next append.
+ *
+ * Format of the index, a hash table with linear probing:
+ *
+ *   header:  "PGPKIDX1"          INDEX_MAGIC
+ *            u64 id              of the pack that the table belongs to
+ *            u64 end             the table covers the records before this
+ *                                offset in the pack
+ *            u64 slots           size of the table, a power of two
+ *            u64 entries         number of used slots
+ *            u64 bytes           size of the records of the entries
+ *   slots:   u64 hash            XXH64 of the name, 0 for an empty slot
+ *            u64 offset          of the record in the pack
+ *            u64 last use        seconds since the epoch
+ *
+ * touch() overwrites the last use in place. The records after `end` are read
+ * when the pack is opened. append() writes a new table when there are too
+ * many of them.
+ *
+ * All writers hold an exclusive lock on the pack (see open_locked()).
+ * Compaction writes a new pack and replaces the old one with rename(), so
+ * processes that still have the old one mapped can keep using it. It holds
+ * the lock file LOCK_FILE, which the cache index uses for pruning, too.
+ * Because records before the end of the pack never change, it copies them
+ * without the lock of the pack and only takes it for the records that were
+ * appended in the meantime.
+ */
+static const char *PACK_FILE = ".pack";
+static const char *PACK_INDEX_FILE = ".pack-index";
+static const char *LOCK_FILE = ".lock";
+static const char PACK_MAGIC[] = "PGPACK01";
+static const char INDEX_MAGIC[] = "PGPKIDX1";
+static const size_t MAGIC_SIZE = 8;
+static const size_t PACK_HEADER_SIZE = MAGIC_SIZE + 8;
+static const size_t MAX_NAME_SIZE = 40;
+static const size_t RECORD_HEADER_SIZE = 1 + MAX_NAME_SIZE + 7 + 3 * 8;
+static const size_t INDEX_HEADER_SIZE = MAGIC_SIZE + 5 * 8;
+static const size_t SLOT_SIZE = 3 * 8;
+
+// Records after the table before append() writes a new one, in addition to a
+// quarter of the entries in the table
+static const size_t INDEX_SLACK = 1000;
+
+// The pack is mapped with room to grow, so that the records that append()
+// writes rarely need a new mapping
+static const uint64_t MIN_MAPPING_SIZE = 64 << 20;
+
+// compact() only copies the pack to get rid of replaced entries, if they take
+// up more space than this and than the live entries.
+static const uint64_t MIN_GARBAGE = 1 << 20;
+
+struct CachePack::LiveEntry {
+	uint64_t offset;
+	// of the whole record
+	uint64_t size;
+	uint64_t last_use;
+};
+
+static uint64_t get_le(const char *p, int bytes) {
+	uint64_t value = 0;
+	for (int i = bytes - 1; i >= 0; i--) {
+		value = (value << 8) | static_cast<unsigned char>(p[i]);
+	}
+	return value;
+}
+
+static void put_le(char *p, uint64_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		p[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+	}
+}
+
+static bool write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+static uint64_t checksum(const char *data, size_t len) {
+	Xxh64 hasher;
+	hasher.update(reinterpret_cast<const unsigned char *>(data), len);
+	return hasher.digest();
+}
+
+// The hash of a name in the table, never 0
+static uint64_t name_hash(const string &name) {
+	uint64_t hash = checksum(name.data(), name.size());
+	return hash != 0 ? hash : 1;
+}
+
+static uint64_t record_size(uint64_t data_len) {
+	return RECORD_HEADER_SIZE + (data_len + 7) / 8 * 8;
+}
+
+static string record_header(const string &name, uint64_t time, uint64_t data_len) {
+	string header(RECORD_HEADER_SIZE, '\0');
+	header[0] = static_cast<char>(name.size());
+	memcpy(&header[1], name.data(), name.size());
+	put_le(&header[48], time, 8);
+	put_le(&header[56], data_len, 8);
+	put_le(&header[64], checksum(header.data(), 64), 8);
+	return header;
+}
+
+static string record_name(const char *record) {
+	return string(record + 1, static_cast<unsigned char>(record[0]));
+}
+
+static uint64_t record_time(const char *record) {
+	return get_le(record + 48, 8);
+}
+
+static uint64_t record_data_len(const char *record) {
+	return get_le(record + 56, 8);
+}
+
+// Twice the size of the pack, so that the number of mappings only grows with
+// the logarithm of its size
+static size_t mapping_size(off_t pack_size) {
+	return max(MIN_MAPPING_SIZE, 2 * static_cast<uint64_t>(pack_size));
+}
+
+static uint64_t new_pack_id() {
+	random_device random;
+	return (static_cast<uint64_t>(random()) << 32) | random();
+}
+
+CachePack::CachePack(const string &cache_directory)
+	: path(cache_directory + PACK_FILE)
+	, index_path(cache_directory + PACK_INDEX_FILE)
+	, lock_path(cache_directory + LOCK_FILE)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	open_pack(fd);
+	close(fd);
+
+	// Reading many records at the end of the pack is slow, so they are
+	// added to the table. If the pack is busy, the next run does it.
+	if (tail.size() > INDEX_SLACK + table_entries / 4) {
+		fd = open_locked(path, O_RDWR, LOCK_EX | LOCK_NB);
+		if (fd >= 0) {
+			refresh();
+			if (segment != nullptr) {
+				write_index(live_entries(), scanned_end, segment_id);
+			}
+			close(fd);
+		}
+	}
+}
+
+CachePack::~CachePack()
+{
+	stop_background();
+	for (const auto &mapping : mappings) {
+		munmap(mapping.first, mapping.second);
+	}
+}
+
+/* Map the pack open as `fd` and its table, and read the records after the
+ * table. Returns false if the pack can't be mapped. */
+bool CachePack::open_pack(int fd)
+{
+	segment = nullptr;
+	segment_size = 0;
+	segment_mapped = 0;
+	segment_id = 0;
+	scanned_end = 0;
+	table = nullptr;
+	slots = 0;
+	table_entries = 0;
+	table_bytes = 0;
+	tail.clear();
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		return false;
+	}
+	segment_dev = st.st_dev;
+	segment_ino = st.st_ino;
+	if (st.st_size < static_cast<off_t>(PACK_HEADER_SIZE)) {
+		return true;
+	}
+
+	// Only the part up to the end of the file may be read. The rest of
+	// the mapping shows what is appended later.
+	size_t size = mapping_size(st.st_size);
+	void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		err() << "Could not map " << path << ": " << strerror(errno) << endl;
+		return false;
+	}
+	mappings.emplace_back(map, size);
+
+	const char *data = static_cast<const char *>(map);
+	if (memcmp(data, PACK_MAGIC, MAGIC_SIZE) != 0) {
+		return true;
+	}
+	segment = data;
+	segment_size = st.st_size;
+	segment_mapped = size;
+	segment_id = get_le(data + MAGIC_SIZE, 8);
+	scanned_end = PACK_HEADER_SIZE;
+
+	int index_fd = open(index_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (index_fd >= 0) {
+		struct stat index_st;
+		if (fstat(index_fd, &index_st) == 0
+		    && index_st.st_size >= static_cast<off_t>(INDEX_HEADER_SIZE)) {
+			map = mmap(nullptr, index_st.st_size, PROT_READ, MAP_SHARED, index_fd, 0);
+			if (map != MAP_FAILED) {
+				mappings.emplace_back(map, index_st.st_size);
+				const char *index = static_cast<const char *>(map);
+				uint64_t end = get_le(index + MAGIC_SIZE + 8, 8);
+				uint64_t n = get_le(index + MAGIC_SIZE + 16, 8);
+
+				// A table of another pack is ignored, e.g. if
+				// the pack was compacted, but the new table
+				// isn't written yet.
+				if (memcmp(index, INDEX_MAGIC, MAGIC_SIZE) == 0
+				    && get_le(index + MAGIC_SIZE, 8) == segment_id
+				    && end >= PACK_HEADER_SIZE && end <= segment_size
+				    && n > 0 && (n & (n - 1)) == 0
+				    && INDEX_HEADER_SIZE + n * SLOT_SIZE == static_cast<uint64_t>(index_st.st_size)) {
+					table = index + INDEX_HEADER_SIZE;
+					slots = n;
+					table_entries = get_le(index + MAGIC_SIZE + 24, 8);
+					table_bytes = get_le(index + MAGIC_SIZE + 32, 8);
+					table_ino = index_st.st_ino;
+					scanned_end = end;
+				}
+			}
+		}
+		close(index_fd);
+	}
+
+	scan_tail();
+	return true;
+}
+
+/* Map the pack again, if it was replaced or grew beyond its mapping since it
+ * was mapped. Needs the lock of the pack. Returns false if the new records
+ * can't be mapped, so that they aren't overwritten.
+ *
+ * A mapping keeps the file descriptor that it was made from open, and with it
+ * the lock. So the pack is opened again for the mapping.
+ */
+bool CachePack::refresh()
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		// There is no pack yet
+		return errno == ENOENT;
+	}
+	bool ok = refresh(fd);
+	close(fd);
+	return ok;
+}
+
+bool CachePack::refresh(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		return false;
+	}
+
+	if (segment == nullptr || st.st_dev != segment_dev || st.st_ino != segment_ino) {
+		return open_pack(fd);
+	}
+
+	if (static_cast<uint64_t>(st.st_size) == segment_size) {
+		return true;
+	}
+
+	if (static_cast<uint64_t>(st.st_size) > segment_mapped) {
+		size_t size = mapping_size(st.st_size);
+		void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			err() << "Could not map " << path << ": " << strerror(errno) << endl;
+			return false;
+		}
+		// The old mapping stays until release_mappings(), because
+		// entries returned by lookup() point into it.
+		mappings.emplace_back(map, size);
+		segment = static_cast<const char *>(map);
+		segment_mapped = size;
+	}
+	segment_size = st.st_size;
+	scan_tail();
+	return true;
+}
+
+// Read the headers of the records after scanned_end
+void CachePack::scan_tail()
+{
+	while (scanned_end + RECORD_HEADER_SIZE <= segment_size) {
+		const char *record = segment + scanned_end;
+		size_t name_len = static_cast<unsigned char>(record[0]);
+		if (name_len == 0 || name_len > MAX_NAME_SIZE
+		    || checksum(record, 64) != get_le(record + 64, 8)
+		    || record_data_len(record) > segment_size) {
+			break;
+		}
+
+		uint64_t size = record_size(record_data_len(record));
+		if (size > segment_size - scanned_end) {
+			break;
+		}
+
+		tail[record_name(record)] = scanned_end;
+		scanned_end += size;
+	}
+}
+
+const char *CachePack::find_slot(const string &name, uint64_t hash) const
+{
+	if (table == nullptr) {
+		return nullptr;
+	}
+
+	for (uint64_t i = hash & (slots - 1), probes = 0; probes < slots;
+	     i = (i + 1) & (slots - 1), probes++) {
+		const char *slot = table + i * SLOT_SIZE;
+		uint64_t key = get_le(slot, 8);
+		if (key == 0) {
+			return nullptr;
+		}
+
+		uint64_t offset = get_le(slot + 8, 8);
+		if (key == hash && offset + RECORD_HEADER_SIZE <= scanned_end
+		    && record_name(segment + offset) == name) {
+			return slot;
+		}
+	}
+	return nullptr;
+}
+
+bool CachePack::lookup(const string &name, PackEntry &entry)
+{
+	lock_guard<std::mutex> lock(mutex);
+	if (segment == nullptr) {
+		return false;
+	}
+
+	uint64_t offset;
+	uint64_t last_use = 0;
+	auto it = tail.find(name);
+	if (it != tail.end()) {
+		offset = it->second;
+	} else {
+		const char *slot = find_slot(name, name_hash(name));
+		if (slot == nullptr) {
+			return false;
+		}
+		offset = get_le(slot + 8, 8);
+		last_use = get_le(slot + 16, 8);
+	}
+
+	const char *record = segment + offset;
+	uint64_t len = record_data_len(record);
+	if (len == 0 || len > scanned_end - offset - RECORD_HEADER_SIZE) {
+		return false;
+	}
+
+	entry.data = string_view(record + RECORD_HEADER_SIZE, len);
+	entry.offset = offset;
+	entry.last_use = max(last_use, record_time(record));
+	return true;
+}
+
+int CachePack::lock()
+{
+	int fd = open_locked(path, O_RDWR | O_APPEND | O_CREAT, LOCK_EX);
+	if (fd < 0) {
+		return -1;
+	}
+
+	lock_guard<std::mutex> guard(mutex);
+	if (!refresh()) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool CachePack::append(int fd, const string &name, string_view data)
+{
+	if (name.empty() || name.size() > MAX_NAME_SIZE) {
+		return false;
+	}
+
+	lock_guard<std::mutex> lock(mutex);
+
+	uint64_t end = scanned_end;
+	string header;
+	if (segment == nullptr) {
+		// A new pack, or a file that isn't a pack at all
+		end = 0;
+		header.assign(PACK_MAGIC, MAGIC_SIZE);
+		header.resize(PACK_HEADER_SIZE);
+		put_le(&header[MAGIC_SIZE], new_pack_id(), 8);
+	}
+	if (end < segment_size || segment == nullptr) {
+		// Remove what is left of an incomplete record
+		if (ftruncate(fd, end) != 0) {
+			return false;
+		}
+	}
+
+	header += record_header(name, time(nullptr), data.size());
+	string padding(record_size(data.size()) - RECORD_HEADER_SIZE - data.size(), '\0');
+	if (!write_all(fd, header.data(), header.size())
+	    || !write_all(fd, data.data(), data.size())
+	    || !write_all(fd, padding.data(), padding.size())) {
+		// The next append() overwrites the incomplete record
+		return false;
+	}
+
+	refresh();
+	if (tail.size() > INDEX_SLACK + table_entries / 4) {
+		write_index(live_entries(), scanned_end, segment_id);
+	}
+	return true;
+}
+
+void CachePack::touch(const string &name)
+{
+	lock_guard<std::mutex> lock(mutex);
+
+	// Entries that aren't in the table yet were written recently
+	const char *slot = find_slot(name, name_hash(name));
+	if (slot == nullptr) {
+		return;
+	}
+
+	int fd = open(index_path.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	// If the table was replaced, the use is lost. That only makes the
+	// entry a bit more likely to be evicted.
+	struct stat st;
+	char buf[8];
+	put_le(buf, time(nullptr), 8);
+	if (fstat(fd, &st) == 0 && st.st_ino == table_ino) {
+		off_t offset = INDEX_HEADER_SIZE + (slot - table) + 16;
+		if (pwrite(fd, buf, sizeof(buf), offset) != sizeof(buf)) {
+			err() << "Could not write " << index_path << endl;
+		}
+	}
+	close(fd);
+}
+
+void CachePack::remove(const string &name)
+{
+	int fd = lock();
+	if (fd < 0) {
+		return;
+	}
+
+	PackEntry entry;
+	if (lookup(name, entry)) {
+		append(fd, name, string_view());
+	}
+	close(fd);
+}
+
+// The newest record of each entry. Needs the mutex.
+unordered_map<string, CachePack::LiveEntry> CachePack::live_entries() const
+{
+	unordered_map<string, LiveEntry> entries;
+
+	for (uint64_t i = 0; table != nullptr && i < slots; i++) {
+		const char *slot = table + i * SLOT_SIZE;
+		uint64_t offset = get_le(slot + 8, 8);
+		if (get_le(slot, 8) == 0 || offset + RECORD_HEADER_SIZE > scanned_end) {
+			continue;
+		}
+		const char *record = segment + offset;
+		uint64_t size = record_size(record_data_len(record));
+		if (size > scanned_end - offset) {
+			continue;
+		}
+		entries[record_name(record)] = LiveEntry {
+			offset, size, max(get_le(slot + 16, 8), record_time(record))
+		};
+	}
+
+	for (const auto &entry : tail) {
+		const char *record = segment + entry.second;
+		entries[entry.first] = LiveEntry {
+			entry.second, record_size(record_data_len(record)), record_time(record)
+		};
+	}
+
+	// Removed entries
+	for (auto it = entries.begin(); it != entries.end(); ) {
+		if (it->second.size == RECORD_HEADER_SIZE) {
+			it = entries.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	return entries;
+}
+
+/* Write the table for `entries` of the pack `id`, which covers the pack up to
+ * `end`. If it belongs to the mapped pack, it is used from now on. Needs the
+ * mutex and the lock of the pack.
+ */
+void CachePack::write_index(const unordered_map<string, LiveEntry> &entries,
+                            uint64_t end, uint64_t id)
+{
+	uint64_t n = 16;
+	while (n < 2 * entries.size()) {
+		n *= 2;
+	}
+
+	string content(INDEX_HEADER_SIZE + n * SLOT_SIZE, '\0');
+	uint64_t bytes = 0;
+	char *slots_start = &content[INDEX_HEADER_SIZE];
+	for (const auto &entry : entries) {
+		uint64_t hash = name_hash(entry.first);
+		uint64_t i = hash & (n - 1);
+		while (get_le(slots_start + i * SLOT_SIZE, 8) != 0) {
+			i = (i + 1) & (n - 1);
+		}
+		char *slot = slots_start + i * SLOT_SIZE;
+		put_le(slot, hash, 8);
+		put_le(slot + 8, entry.second.offset, 8);
+		put_le(slot + 16, entry.second.last_use, 8);
+		bytes += entry.second.size;
+	}
+
+	memcpy(&content[0], INDEX_MAGIC, MAGIC_SIZE);
+	put_le(&content[MAGIC_SIZE], id, 8);
+	put_le(&content[MAGIC_SIZE + 8], end, 8);
+	put_le(&content[MAGIC_SIZE + 16], n, 8);
+	put_le(&content[MAGIC_SIZE + 24], entries.size(), 8);
+	put_le(&content[MAGIC_SIZE + 32], bytes, 8);
+
+	// The leading dot keeps the cache index away from the temporary file
+	string tmp = index_path + ".XXXXXX";
+	int fd = create_temp_file(tmp);
+	if (fd < 0) {
+		return;
+	}
+
+	struct stat st;
+	bool ok = write_all(fd, content.data(), content.size()) && fstat(fd, &st) == 0;
+	void *map = MAP_FAILED;
+	if (ok && id == segment_id) {
+		map = mmap(nullptr, content.size(), PROT_READ, MAP_SHARED, fd, 0);
+	}
+	if (close(fd) != 0 || !ok || rename(tmp.c_str(), index_path.c_str()) != 0) {
+		unlink(tmp.c_str());
+		forget_temp_file(tmp);
+		if (map != MAP_FAILED) {
+			munmap(map, content.size());
+		}
+		return;
+	}
+	forget_temp_file(tmp);
+
+	if (map != MAP_FAILED) {
+		mappings.emplace_back(map, content.size());
+		table = static_cast<const char *>(map) + INDEX_HEADER_SIZE;
+		slots = n;
+		table_entries = entries.size();
+		table_bytes = bytes;
+		table_ino = st.st_ino;
+		tail.clear();
+	}
+}
+
+bool CachePack::needs_compaction(const CacheBudget &budget)
+{
+	lock_guard<std::mutex> lock(mutex);
+	if (segment == nullptr) {
+		return false;
+	}
+
+	// Replaced entries in the tail are counted twice, which only makes
+	// compact() run a bit early.
+	uint64_t entries = table_entries + tail.size();
+	uint64_t bytes = table_bytes;
+	for (const auto &entry : tail) {
+		bytes += record_size(record_data_len(segment + entry.second));
+	}
+
+	if (bytes > budget.bytes || (budget.entries > 0 && entries > budget.entries)) {
+		return true;
+	}
+
+	uint64_t garbage = scanned_end - PACK_HEADER_SIZE - min(bytes, scanned_end - PACK_HEADER_SIZE);
+	return garbage > bytes && garbage > MIN_GARBAGE;
+}
+
+PruneResult CachePack::compact(const CacheBudget &budget)
+{
+	int lock = open_locked(lock_path, O_RDONLY | O_CREAT, LOCK_EX);
+	if (lock < 0) {
+		return PruneResult();
+	}
+	PruneResult result = compact_locked(budget);
+	close(lock);
+	return result;
+}
+
+void CachePack::compact_in_background(const CacheBudget &budget,
+                                      function<void()> removed)
+{
+	if (compactor.joinable()) {
+		return;
+	}
+
+	compactor = thread([this, budget, removed] {
+		int lock = open_locked(lock_path, O_RDONLY | O_CREAT, LOCK_EX | LOCK_NB);
+		if (lock < 0) {
+			return;
+		}
+		PruneResult result = compact_locked(budget);
+		close(lock);
+		if (result.removed > 0 && removed && !stopping) {
+			removed();
+		}
+	});
+}
+
+void CachePack::stop_background()
+{
+	stopping = true;
+	if (compactor.joinable()) {
+		compactor.join();
+	}
+	stopping = false;
+}
+
+/* Compact the pack while holding the lock file. The pack itself is only
+ * locked at the start and for the records that were appended while the
+ * others were copied. */
+PruneResult CachePack::compact_locked(const CacheBudget &budget)
+{
+	PruneResult result;
+	unordered_map<string, LiveEntry> entries;
+	const char *old;
+	uint64_t end;
+	uint64_t old_id;
+	{
+		int fd = lock();
+		if (fd < 0) {
+			return result;
+		}
+		lock_guard<std::mutex> guard(mutex);
+		close(fd);
+		if (segment == nullptr) {
+			return result;
+		}
+		entries = live_entries();
+		old = segment;
+		end = scanned_end;
+		old_id = segment_id;
+		// release_mappings() must keep the mapping while it is copied
+		copying = old;
+	}
+
+	// Keep the most recently used entries that fit into the budget
+	vector<pair<string, LiveEntry>> lru(entries.begin(), entries.end());
+	sort(lru.begin(), lru.end(), [](const pair<string, LiveEntry> &a,
+	                                const pair<string, LiveEntry> &b) {
+		return a.second.last_use > b.second.last_use;
+	});
+
+	uint64_t live_bytes = 0;
+	vector<pair<string, LiveEntry>> kept;
+	for (const auto &entry : lru) {
+		live_bytes += entry.second.size;
+		if (result.removed == 0 && result.bytes + entry.second.size <= budget.bytes
+		    && (budget.entries == 0 || result.entries < budget.entries)) {
+			kept.push_back(entry);
+			result.entries++;
+			result.bytes += entry.second.size;
+		} else {
+			result.removed++;
+			result.removed_bytes += entry.second.size;
+		}
+	}
+
+	uint64_t garbage = end - PACK_HEADER_SIZE - live_bytes;
+	if (result.removed == 0 && (garbage <= live_bytes || garbage <= MIN_GARBAGE)) {
+		// Copying the pack isn't worth it, but the table is brought up
+		// to date.
+		int fd = lock();
+		lock_guard<std::mutex> guard(mutex);
+		copying = nullptr;
+		if (fd >= 0) {
+			if (!tail.empty()) {
+				write_index(live_entries(), scanned_end, segment_id);
+			}
+			close(fd);
+		}
+		return result;
+	}
+
+	// The entries are copied in the order they were written, which is
+	// usually the order in which they are searched.
+	sort(kept.begin(), kept.end(), [](const pair<string, LiveEntry> &a,
+	                                  const pair<string, LiveEntry> &b) {
+		return a.second.offset < b.second.offset;
+	});
+
+	// Otherwise, short searches could stop every compaction
+	bool must_finish = budget.far_exceeded(end - PACK_HEADER_SIZE, entries.size());
+
+	string tmp = path + ".XXXXXX";
+	int out = create_temp_file(tmp);
+	if (out < 0) {
+		lock_guard<std::mutex> guard(mutex);
+		copying = nullptr;
+		return PruneResult();
+	}
+
+	uint64_t id = new_pack_id();
+	char header[PACK_HEADER_SIZE];
+	memcpy(header, PACK_MAGIC, MAGIC_SIZE);
+	put_le(header + MAGIC_SIZE, id, 8);
+	bool ok = write_all(out, header, sizeof(header));
+
+	unordered_map<string, LiveEntry> moved;
+	uint64_t pos = PACK_HEADER_SIZE;
+	for (const auto &entry : kept) {
+		if (!ok || (stopping && !must_finish)) {
+			ok = false;
+			break;
+		}
+		ok = write_all(out, old + entry.second.offset, entry.second.size);
+		moved[entry.first] = LiveEntry { pos, entry.second.size, entry.second.last_use };
+		pos += entry.second.size;
+	}
+
+	int fd = ok ? lock() : -1;
+	lock_guard<std::mutex> guard(mutex);
+	copying = nullptr;
+
+	// The pack can only have been replaced if it was removed or broken
+	ok = ok && fd >= 0 && segment != nullptr && segment_id == old_id;
+
+	// The records that were appended in the meantime. They were all
+	// scanned by lock(), so they are complete.
+	for (uint64_t offset = end; ok && offset < scanned_end; ) {
+		const char *record = segment + offset;
+		uint64_t len = record_data_len(record);
+		uint64_t size = record_size(len);
+		if (len == 0) {
+			moved.erase(record_name(record));
+		} else {
+			ok = write_all(out, record, size);
+			moved[record_name(record)] = LiveEntry { pos, size, record_time(record) };
+			pos += size;
+		}
+		offset += size;
+	}
+
+	if (close(out) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+		unlink(tmp.c_str());
+		forget_temp_file(tmp);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return PruneResult();
+	}
+	forget_temp_file(tmp);
+
+	// Keep the uses that were recorded while the entries were copied
+	for (const auto &entry : live_entries()) {
+		auto it = moved.find(entry.first);
+		if (it != moved.end()) {
+			it->second.last_use = max(it->second.last_use, entry.second.last_use);
+		}
+	}
+
+	result.entries = moved.size();
+	result.bytes = 0;
+	for (const auto &entry : moved) {
+		result.bytes += entry.second.size;
+	}
+
+	write_index(moved, pos, id);
+	int new_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (new_fd >= 0) {
+		open_pack(new_fd);
+		close(new_fd);
+	}
+	close(fd);
+	return result;
+}
+
+void CachePack::reload()
+{
+	lock_guard<std::mutex> lock(mutex);
+	refresh();
+	release_mappings_locked();
+}
+
+void CachePack::release_mappings()
+{
+	lock_guard<std::mutex> lock(mutex);
+	release_mappings_locked();
+}
+
+void CachePack::release_mappings_locked()
+{
+	// Only the newest mappings of the pack and its table are still needed
+	auto unused = [this](const pair<void *, size_t> &mapping) {
+		const char *start = static_cast<const char *>(mapping.first);
+		if (start == segment || start == copying || (table != nullptr && start + INDEX_HEADER_SIZE == table)) {
+			return false;
+		}
+		munmap(mapping.first, mapping.second);
+		return true;
+	};
+	mappings.erase(remove_if(mappings.begin(), mappings.end(), unused), mappings.end());
+}
+
+CacheStats CachePack::stats()
+{
+	lock_guard<std::mutex> lock(mutex);
+
+	CacheStats stats;
+	for (const auto &entry : live_entries()) {
+		const LiveEntry &e = entry.second;
+		if (stats.entries == 0 || static_cast<time_t>(e.last_use) < stats.oldest) {
+			stats.oldest = e.last_use;
+		}
+		if (stats.entries == 0 || static_cast<time_t>(e.last_use) > stats.newest) {
+			stats.newest = e.last_use;
+		}
+		stats.entries++;
+		stats.bytes += e.size;
+	}
+	stats.records = tail.size();
+	stats.pack_bytes = segment_size;
+	return stats;
+}
+
+vector<string> CachePack::entry_names()
+{
+	lock_guard<std::mutex> lock(mutex);
+	refresh();
+
+	vector<string> names;
+	for (const auto &entry : live_entries()) {
+		names.push_back(entry.first);
+	}
+	return names;
+}
+
+static std::mutex pack_mutex;
+// by cache directory
+static map<string, unique_ptr<CachePack>> cache_packs;
+
+CachePack &get_cache_pack(const string &cache_directory)
+{
+	lock_guard<std::mutex> lock(pack_mutex);
+	unique_ptr<CachePack> &pack = cache_packs[cache_directory];
+	if (!pack) {
+		pack = make_unique<CachePack>(cache_directory);
+	}
+	return *pack;
+}
+
+void stop_pack_compaction()
+{
+	lock_guard<std::mutex> lock(pack_mutex);
+	for (auto &pack : cache_packs) {
+		pack.second->stop_background();
+	}
+}
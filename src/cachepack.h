@@ -0,0 +1,193 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef CACHEPACK_H
+#define CACHEPACK_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "cacheindex.h"
+
+// An entry found by CachePack::lookup()
+struct PackEntry {
+	// the content, valid as long as the CachePack exists
+	std::string_view data;
+	// position in the pack, changes when the entry is written again
+	uint64_t offset = 0;
+	time_t last_use = 0;
+};
+
+/** All cache entries in a single file.
+ *
+ * Instead of one file per PDF, the entries are appended to the pack file
+ * .pack in the cache directory. A hash table in .pack-index finds the newest
+ * version of each entry without reading the pack, and also keeps the last use
+ * of the entries. Entries that were appended after the hash table was written
+ * are found by reading their headers at the end of the pack. See the format in
+ * cachepack.cc.
+ *
+ * Replaced and evicted entries stay in the pack until compact() copies the
+ * live ones to a new pack. The pack is mapped into memory, so the entries of
+ * a whole corpus are read from one file, mostly in the order they were
+ * written.
+ */
+class CachePack {
+public:
+	explicit CachePack(const std::string &cache_directory);
+	// Stops a compacting thread
+	~CachePack();
+
+	CachePack(const CachePack &) = delete;
+	CachePack &operator=(const CachePack &) = delete;
+
+	/* Find the newest version of the entry `name`. Returns false if there
+	 * is none. */
+	bool lookup(const std::string &name, PackEntry &entry);
+
+	/* Lock the pack for append(). Other processes and threads wait until
+	 * the returned file descriptor is closed. Entries that were appended
+	 * in the meantime are visible to lookup() afterwards. Returns -1 on
+	 * failure. */
+	int lock();
+
+	/* Append a new version of the entry `name` to the pack, whose lock
+	 * is `fd`. */
+	bool append(int fd, const std::string &name, std::string_view data);
+
+	/* Record that the entry `name` was used */
+	void touch(const std::string &name);
+
+	/* Remove the entry `name` from the pack, e.g. because its PDF was
+	 * deleted. */
+	void remove(const std::string &name);
+
+	/* True if compact() would remove entries to fit into `budget`, or if
+	 * more than half of the pack is replaced entries. */
+	bool needs_compaction(const CacheBudget &budget);
+
+	/* Write a new pack with only the most recently used entries that fit
+	 * into `budget`. Other processes can append while the entries are
+	 * copied, only the records they appended meanwhile are copied with the
+	 * pack locked. */
+	PruneResult compact(const CacheBudget &budget);
+
+	/* Run compact() in a thread, while the search goes on. Does nothing if
+	 * another process compacts or prunes the cache directory already. The thread calls `removed` if
+	 * entries were removed. */
+	void compact_in_background(const CacheBudget &budget,
+	                           std::function<void()> removed = nullptr);
+
+	/* Make the thread of compact_in_background() give up and wait for
+	 * it. The pack stays as it was. A pack that is more than twice as
+	 * large as the budget is compacted anyway, like in
+	 * CacheIndex::stop_background(). */
+	void stop_background();
+
+	/* Map the records that other processes appended since the pack was
+	 * mapped and release the old mappings, see release_mappings(). */
+	void reload();
+
+	/* Unmap the versions of the pack and its table that were replaced by
+	 * a newer mapping. Entries returned by lookup() before are
+	 * invalidated, so this is only for processes that keep the pack
+	 * between documents, like the daemon or --watch, when no Cache is
+	 * open. */
+	void release_mappings();
+
+	CacheStats stats();
+
+	/* The names of all entries in the pack */
+	std::vector<std::string> entry_names();
+
+private:
+	struct LiveEntry;
+
+	bool open_pack(int fd);
+	bool refresh();
+	bool refresh(int fd);
+	void release_mappings_locked();
+	void scan_tail();
+	const char *find_slot(const std::string &name, uint64_t hash) const;
+	std::unordered_map<std::string, LiveEntry> live_entries() const;
+	void write_index(const std::unordered_map<std::string, LiveEntry> &entries,
+	                 uint64_t end, uint64_t id);
+	PruneResult compact_locked(const CacheBudget &budget);
+
+	std::string path;
+	std::string index_path;
+	// held while the pack is compacted
+	std::string lock_path;
+
+	// Protects everything below
+	std::mutex mutex;
+	// Every mapping stays valid until release_mappings(), because
+	// entries returned by lookup() point into them.
+	std::vector<std::pair<void *, size_t>> mappings;
+
+	// the newest mapping of the pack, nullptr if it is empty
+	const char *segment = nullptr;
+	size_t segment_size = 0;
+	// the length of the mapping, which is larger than the pack
+	size_t segment_mapped = 0;
+	uint64_t segment_id = 0;
+	dev_t segment_dev = 0;
+	ino_t segment_ino = 0;
+	// end of the last complete record in the pack
+	uint64_t scanned_end = 0;
+
+	// the hash table of the pack or nullptr
+	const char *table = nullptr;
+	uint64_t slots = 0;
+	uint64_t table_entries = 0;
+	uint64_t table_bytes = 0;
+	ino_t table_ino = 0;
+	// records after the part of the pack that the table covers
+	std::unordered_map<std::string, uint64_t> tail;
+	// the mapping that compact_locked() copies entries from
+	const char *copying = nullptr;
+
+	std::thread compactor;
+	// set by stop_background()
+	std::atomic<bool> stopping { false };
+};
+
+/* The pack of `cache_directory`, created on the first call for it */
+CachePack &get_cache_pack(const std::string &cache_directory);
+
+/* Stop the compacting threads of the packs, if there are any, see
+ * CachePack::stop_background() */
+void stop_pack_compaction();
+
+#endif /* CACHEPACK_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
@@ -0,0 +1,148 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "compress.h"
+
+#include <climits>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+#ifdef HAVE_ZSTD
+// zstd's default level is a good trade-off between speed and size for text
+static const int ZSTD_LEVEL = 3;
+#endif
+
+const char *compression_name(CacheCompression algorithm)
+{
+	switch (algorithm) {
+	case CacheCompression::NONE:
+		return "none";
+	case CacheCompression::LZ4:
+		return "lz4";
+	case CacheCompression::ZSTD:
+		return "zstd";
+	}
+	return "unknown";
+}
+
+bool compression_supported(CacheCompression algorithm)
+{
+	switch (algorithm) {
+	case CacheCompression::NONE:
+		return true;
+	case CacheCompression::LZ4:
+#ifdef HAVE_LZ4
+		return true;
+#else
+		return false;
+#endif
+	case CacheCompression::ZSTD:
+#ifdef HAVE_ZSTD
+		return true;
+#else
+		return false;
+#endif
+	}
+	return false;
+}
+
+bool compress_block(CacheCompression algorithm, string_view in, string &out)
+{
+	switch (algorithm) {
+	case CacheCompression::NONE:
+		out.assign(in.data(), in.size());
+		return true;
+
+	case CacheCompression::LZ4: {
+#ifdef HAVE_LZ4
+		if (in.size() > LZ4_MAX_INPUT_SIZE) {
+			return false;
+		}
+		out.resize(LZ4_compressBound(in.size()));
+		int n = LZ4_compress_default(in.data(), &out[0], in.size(), out.size());
+		if (n <= 0) {
+			return false;
+		}
+		out.resize(n);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	case CacheCompression::ZSTD: {
+#ifdef HAVE_ZSTD
+		out.resize(ZSTD_compressBound(in.size()));
+		size_t n = ZSTD_compress(&out[0], out.size(), in.data(), in.size(), ZSTD_LEVEL);
+		if (ZSTD_isError(n)) {
+			return false;
+		}
+		out.resize(n);
+		return true;
+#else
+		return false;
+#endif
+	}
+	}
+	return false;
+}
+
+bool decompress_block(CacheCompression algorithm, string_view in, size_t size, string &out)
+{
+	switch (algorithm) {
+	case CacheCompression::NONE:
+		if (in.size() != size) {
+			return false;
+		}
+		out.assign(in.data(), in.size());
+		return true;
+
+	case CacheCompression::LZ4: {
+#ifdef HAVE_LZ4
+		if (in.size() > INT_MAX || size > INT_MAX) {
+			return false;
+		}
+		out.resize(size);
+		int n = LZ4_decompress_safe(in.data(), &out[0], in.size(), size);
+		return n >= 0 && static_cast<size_t>(n) == size;
+#else
+		return false;
+#endif
+	}
+
+	case CacheCompression::ZSTD: {
+#ifdef HAVE_ZSTD
+		out.resize(size);
+		size_t n = ZSTD_decompress(&out[0], size, in.data(), in.size());
+		return !ZSTD_isError(n) && n == size;
+#else
+		return false;
+#endif
+	}
+	}
+	return false;
+}
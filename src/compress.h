@@ -0,0 +1,55 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <string>
+#include <string_view>
+
+#include "pdfgrep.h"
+
+/* Name of the algorithm as accepted by --cache-compression */
+const char *compression_name(CacheCompression algorithm);
+
+/* False if pdfgrep was compiled without the library for `algorithm` */
+bool compression_supported(CacheCompression algorithm);
+
+/** Compress `in` with `algorithm` and write the result to `out`.
+ *
+ * Each call produces an independent block, so that every page of the cache can
+ * be decompressed on its own. Returns false if the algorithm isn't supported
+ * or fails.
+ */
+bool compress_block(CacheCompression algorithm, std::string_view in, std::string &out);
+
+/** Decompress a block written by compress_block() to `out`.
+ *
+ * `size` is the size of the uncompressed data. Returns false if the block is
+ * invalid or doesn't decompress to exactly `size` bytes.
+ */
+bool decompress_block(CacheCompression algorithm, std::string_view in, size_t size,
+                      std::string &out);
+
+#endif /* COMPRESS_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
@@ -0,0 +1,956 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "daemon.h"
+#include "cache.h"
+#include "cacheindex.h"
+#include "extract.h"
+#include "output.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cpp/poppler-document.h>
+
+extern char **environ;
+
+using namespace std;
+
+/* The protocol
+ *
+ * pdfgrep --client connects to the socket in the cache directory and sends
+ * one request: the length of the rest as 32 bit little endian, followed by
+ * NUL-terminated strings: REQUEST_MAGIC, the working directory, the number of
+ * environment variables, the environment and the arguments (including the
+ * name of the program). The length is sent together with the standard input,
+ * output and error of the client (SCM_RIGHTS).
+ *
+ * The daemon forks for each request. The child takes over the file descriptors
+ * and the environment of the client and runs pdfgrep with its arguments, so
+ * the output is the same as without the daemon. When the child exits, the
+ * daemon sends its exit status as a single byte. If the client goes away
+ * before that, the child is terminated.
+ *
+ * Nothing a child does changes the daemon, except for one thing: it writes the
+ * paths of the documents that it opened, NUL-terminated, to a pipe. The daemon
+ * loads them in a thread after the request, so that the next one finds them
+ * open.
+ */
+static const char *REQUEST_MAGIC = "pdfgrep-request-1";
+static const char *SOCKET_FILE = ".socket";
+static const uint32_t MAX_REQUEST_SIZE = 16 << 20;
+
+// How many documents the daemon keeps open
+static const size_t MAX_DOCUMENTS = 64;
+// How long a client may take to send its request
+static const int REQUEST_TIMEOUT = 5; // seconds
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t written = write(fd, buf, len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += written;
+		len -= written;
+	}
+	return true;
+}
+
+static bool read_all(int fd, char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+// True if `a` and `b` are the same version of a file
+static bool same_file(const struct stat &a, const struct stat &b)
+{
+	return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size
+#ifdef __APPLE__
+		&& a.st_mtimespec.tv_sec == b.st_mtimespec.tv_sec
+		&& a.st_mtimespec.tv_nsec == b.st_mtimespec.tv_nsec
+		&& a.st_ctimespec.tv_sec == b.st_ctimespec.tv_sec
+		&& a.st_ctimespec.tv_nsec == b.st_ctimespec.tv_nsec;
+#else
+		&& a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec
+		&& a.st_ctim.tv_sec == b.st_ctim.tv_sec && a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+#endif
+}
+
+// True if the other end of the connection `conn` runs as the same user as we
+// do. Requests run with the rights of the daemon.
+static bool same_user(int conn)
+{
+#if defined(__linux__)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		return false;
+	}
+	return cred.uid == getuid();
+#elif defined(HAVE_GETPEEREID)
+	uid_t uid;
+	gid_t gid;
+	if (getpeereid(conn, &uid, &gid) != 0) {
+		return false;
+	}
+	return uid == getuid();
+#else
+	// Only the mode of the socket keeps others out
+	(void) conn;
+	return true;
+#endif
+}
+
+static int connect_socket(const string &path)
+{
+	struct sockaddr_un addr = {};
+	if (path.size() >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		return -1;
+	}
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+	if (connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+		int saved_errno = errno;
+		close(sock);
+		errno = saved_errno;
+		return -1;
+	}
+	return sock;
+}
+
+// The daemon and its children have different working directories, and the
+// same file may be given in different ways
+static string absolute_path(const string &path)
+{
+	char *resolved = realpath(path.c_str(), nullptr);
+	if (resolved == nullptr) {
+		return path;
+	}
+	string absolute(resolved);
+	free(resolved);
+	return absolute;
+}
+
+namespace {
+
+// Only documents without a password are kept
+bool default_password(const Options &opts)
+{
+	return opts.passwords.size() == 1 && opts.passwords[0].empty();
+}
+
+/* The documents that the daemon keeps open. The children take them from their
+ * copy of the store and report the documents they used. */
+class OpenDocuments : public DocumentStore {
+public:
+	unique_ptr<poppler::document> take(const Options &opts, const string &path) override;
+	void loaded(const Options &opts, const string &path) override;
+
+	~OpenDocuments();
+
+	// In a child: report the used documents to the daemon through `fd`
+	void set_feedback(int fd) { feedback = fd; }
+
+	/* In the daemon: keep the document at `path` (see absolute_path())
+	 * open. It is loaded by a thread, and the least recently used one is
+	 * closed if there are too many. */
+	void load_later(const string &path);
+
+	/* In the daemon: hold the lock on the documents during fork(), so that
+	 * the child gets them in a consistent state. Both processes call
+	 * after_fork(). */
+	void before_fork() { mutex.lock(); }
+	void after_fork() { mutex.unlock(); }
+
+private:
+	struct Document {
+		string path;
+		struct stat st;
+		unique_ptr<poppler::document> doc;
+	};
+
+	void load_documents();
+	void load(const string &path);
+	// Needs the mutex
+	void report(const string &path);
+
+	std::mutex mutex;
+	// the most recently used first
+	list<Document> documents;
+	int feedback = -1;
+
+	// The documents that load_documents() loads, it stops once `stopping`
+	// is set. Children don't use these.
+	std::thread loader;
+	std::mutex queue_mutex;
+	condition_variable queue_changed;
+	list<string> queue;
+	bool stopping = false;
+};
+
+OpenDocuments::~OpenDocuments()
+{
+	if (!loader.joinable()) {
+		return;
+	}
+	{
+		lock_guard<std::mutex> lock(queue_mutex);
+		stopping = true;
+	}
+	queue_changed.notify_one();
+	loader.join();
+}
+
+unique_ptr<poppler::document> OpenDocuments::take(const Options &opts, const string &path)
+{
+	struct stat st;
+	if (!default_password(opts) || stat(path.c_str(), &st) != 0) {
+		return nullptr;
+	}
+
+	string absolute = absolute_path(path);
+	lock_guard<std::mutex> lock(mutex);
+	for (auto it = documents.begin(); it != documents.end(); ++it) {
+		if (it->path == absolute && same_file(it->st, st)) {
+			unique_ptr<poppler::document> doc = std::move(it->doc);
+			documents.erase(it);
+			report(absolute);
+			return doc;
+		}
+	}
+	return nullptr;
+}
+
+void OpenDocuments::loaded(const Options &opts, const string &path)
+{
+	// With --cache, the pages are cached afterwards, and the next search
+	// doesn't need the document.
+	if (!default_password(opts) || opts.use_cache) {
+		return;
+	}
+
+	string absolute = absolute_path(path);
+	lock_guard<std::mutex> lock(mutex);
+	report(absolute);
+}
+
+void OpenDocuments::report(const string &path)
+{
+	// The path is relative if realpath() failed
+	if (feedback >= 0 && path[0] == '/') {
+		write_all(feedback, path.c_str(), path.size() + 1);
+	}
+}
+
+void OpenDocuments::load_later(const string &path)
+{
+	{
+		lock_guard<std::mutex> lock(queue_mutex);
+		queue.push_back(path);
+	}
+	if (!loader.joinable()) {
+		loader = thread(&OpenDocuments::load_documents, this);
+	} else {
+		queue_changed.notify_one();
+	}
+}
+
+void OpenDocuments::load_documents()
+{
+	while (true) {
+		string path;
+		{
+			unique_lock<std::mutex> lock(queue_mutex);
+			queue_changed.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (stopping) {
+				return;
+			}
+			path = std::move(queue.front());
+			queue.pop_front();
+		}
+		load(path);
+	}
+}
+
+void OpenDocuments::load(const string &path)
+{
+	struct stat st;
+	bool exists = stat(path.c_str(), &st) == 0;
+
+	{
+		lock_guard<std::mutex> lock(mutex);
+		for (auto it = documents.begin(); it != documents.end(); ++it) {
+			if (it->path != path) {
+				continue;
+			}
+			if (exists && same_file(it->st, st)) {
+				documents.splice(documents.begin(), documents, it);
+				return;
+			}
+			documents.erase(it);
+			break;
+		}
+	}
+
+	if (!exists) {
+		return;
+	}
+
+	// Without the lock, so that requests don't wait for the document.
+	// A child that is forked meanwhile doesn't know about it.
+	unique_ptr<poppler::document> doc(poppler::document::load_from_file(path, "", ""));
+	if (doc == nullptr || doc->is_locked()) {
+		return;
+	}
+
+	lock_guard<std::mutex> lock(mutex);
+	documents.push_front(Document { path, st, std::move(doc) });
+	if (documents.size() > MAX_DOCUMENTS) {
+		documents.pop_back();
+	}
+}
+
+struct Request {
+	string cwd;
+	vector<string> env;
+	vector<string> args;
+	// standard input, output and error of the client
+	int fds[3] = { -1, -1, -1 };
+
+	void close_fds() {
+		for (int &fd : fds) {
+			if (fd >= 0) {
+				close(fd);
+				fd = -1;
+			}
+		}
+	}
+};
+
+// A connection whose request wasn't read completely yet
+struct Connection {
+	int conn;
+	Request request;
+	// the fds of the request that were received
+	int received;
+	// the length and then the body of the request, as far as they were read
+	string data;
+	chrono::steady_clock::time_point deadline;
+};
+
+// A request whose child is still running
+struct Running {
+	pid_t pid;
+	// the connection to the client, -1 if the client went away
+	int client;
+	// the read end of the pipe of the child
+	int feedback;
+	// what the child wrote to the pipe
+	string used;
+	chrono::steady_clock::time_point start;
+	string command;
+};
+
+class Daemon {
+public:
+	Daemon(const Options &opts, RequestHandler handler) : opts(opts), handler(handler) {}
+
+	int run();
+
+private:
+	void accept_connection();
+	enum class ReadState { MORE, DONE, FAILED };
+	ReadState read_request(Connection &connection);
+	bool parse_request(const string &body, Request &request);
+	void start(int conn, Request &request);
+	[[noreturn]] void run_request(Request &request, int feedback);
+	void finish(Running &running);
+
+	const Options &opts;
+	RequestHandler handler;
+	OpenDocuments documents;
+	int listener = -1;
+	vector<Connection> connections;
+	vector<Running> running;
+};
+
+// Written to by the handler of SIGINT and SIGTERM, to wake up poll()
+int stop_pipe[2] = { -1, -1 };
+
+void handle_stop(int)
+{
+	int saved_errno = errno;
+	if (write(stop_pipe[1], "x", 1) < 0) {
+		// The pipe is full, so poll() wakes up anyway
+	}
+	errno = saved_errno;
+}
+
+// A child is terminated when its client goes away. It may be writing to the
+// cache directory.
+void handle_terminate(int sig)
+{
+	remove_temp_files();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+} // namespace
+
+void Daemon::accept_connection()
+{
+	int conn = accept(listener, nullptr, nullptr);
+	if (conn < 0) {
+		return;
+	}
+	fcntl(conn, F_SETFD, FD_CLOEXEC);
+	if (!same_user(conn)) {
+		err() << "Rejected a connection of another user" << endl;
+		close(conn);
+		return;
+	}
+
+	connections.push_back(Connection { conn, Request(), 0, string(),
+	                                   chrono::steady_clock::now()
+	                                   + chrono::seconds(REQUEST_TIMEOUT) });
+}
+
+Daemon::ReadState Daemon::read_request(Connection &connection)
+{
+	// The length of the request comes first, and the file descriptors are
+	// sent with it
+	string &data = connection.data;
+	auto length = [&data]() {
+		uint32_t len = 0;
+		for (int i = 3; i >= 0; i--) {
+			len = (len << 8) | static_cast<unsigned char>(data[i]);
+		}
+		return size_t(len);
+	};
+
+	char buf[65536];
+	size_t want = data.size() < 4 ? 4 - data.size()
+		: min(4 + length() - data.size(), sizeof(buf));
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = { buf, want };
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t n = recvmsg(connection.conn, &msg, MSG_DONTWAIT);
+	if (n < 0) {
+		return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK
+			? ReadState::MORE : ReadState::FAILED;
+	}
+
+	Request &request = connection.request;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != nullptr;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < count; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+			if (connection.received < 3) {
+				request.fds[connection.received++] = fd;
+			} else {
+				close(fd);
+			}
+		}
+	}
+	// Other daemons connect without a request to see if this one is
+	// running
+	if (n == 0 || (msg.msg_flags & MSG_CTRUNC)) {
+		return ReadState::FAILED;
+	}
+
+	data.append(buf, n);
+	if (data.size() >= 4 && length() > MAX_REQUEST_SIZE) {
+		return ReadState::FAILED;
+	}
+	if (data.size() < 4 || data.size() < 4 + length()) {
+		return ReadState::MORE;
+	}
+	if (connection.received < 3 || !parse_request(data.substr(4), request)) {
+		return ReadState::FAILED;
+	}
+	return ReadState::DONE;
+}
+
+bool Daemon::parse_request(const string &body, Request &request)
+{
+	if (body.empty() || body.back() != '\0') {
+		return false;
+	}
+
+	vector<string> fields;
+	for (size_t start = 0, end; start < body.size(); start = end + 1) {
+		end = body.find('\0', start);
+		fields.push_back(body.substr(start, end - start));
+	}
+
+	if (fields.size() < 3 || fields[0] != REQUEST_MAGIC) {
+		return false;
+	}
+	request.cwd = fields[1];
+	size_t env_count = strtoul(fields[2].c_str(), nullptr, 10);
+	if (env_count > fields.size() - 3) {
+		return false;
+	}
+	request.env.assign(fields.begin() + 3, fields.begin() + 3 + env_count);
+	request.args.assign(fields.begin() + 3 + env_count, fields.end());
+	return !request.args.empty();
+}
+
+void Daemon::start(int conn, Request &request)
+{
+	int pipefd[2];
+	if (pipe(pipefd) != 0) {
+		err() << "pipe: " << strerror(errno) << endl;
+		close(conn);
+		return;
+	}
+	fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+
+	// The child should see what other processes added to the cache
+	reload_cache_state(opts.cache_directory);
+
+	cout.flush();
+	cerr.flush();
+	documents.before_fork();
+	pid_t pid = fork();
+	documents.after_fork();
+	if (pid == 0) {
+		close(pipefd[0]);
+		close(conn);
+		run_request(request, pipefd[1]);
+	}
+
+	close(pipefd[1]);
+	if (pid < 0) {
+		err() << "fork: " << strerror(errno) << endl;
+		close(pipefd[0]);
+		close(conn);
+		return;
+	}
+
+	string command;
+	for (size_t i = 1; i < request.args.size(); i++) {
+		command += (i > 1 ? " " : "") + request.args[i];
+	}
+	running.push_back(Running { pid, conn, pipefd[0], string(), chrono::steady_clock::now(),
+	                            command });
+}
+
+void Daemon::run_request(Request &request, int feedback)
+{
+	signal(SIGINT, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	struct sigaction action = {};
+	action.sa_handler = handle_terminate;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGTERM, &action, nullptr);
+
+	close(listener);
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	for (Connection &other : connections) {
+		close(other.conn);
+		other.request.close_fds();
+	}
+	for (const Running &other : running) {
+		close(other.feedback);
+		if (other.client >= 0) {
+			close(other.client);
+		}
+	}
+
+	// The file descriptors of the daemon are open, so the received ones
+	// are all above 2.
+	for (int i = 0; i < 3; i++) {
+		dup2(request.fds[i], i);
+	}
+	request.close_fds();
+	documents.set_feedback(feedback);
+
+	if (chdir(request.cwd.c_str()) != 0) {
+		err() << request.cwd << ": " << strerror(errno) << endl;
+		exit(EXIT_ERROR);
+	}
+
+	// The environment of the client decides about the locale, the colors
+	// and the cache.
+	static vector<char *> env;
+	for (string &var : request.env) {
+		env.push_back(&var[0]);
+	}
+	env.push_back(nullptr);
+	environ = env.data();
+
+	vector<char *> argv;
+	for (string &arg : request.args) {
+		argv.push_back(&arg[0]);
+	}
+	argv.push_back(nullptr);
+
+#ifdef __GLIBC__
+	// Makes glibc initialize getopt() again
+	optind = 0;
+#else
+	optind = 1;
+#endif
+	exit(handler(static_cast<int>(request.args.size()), argv.data(), true));
+}
+
+void Daemon::finish(Running &request)
+{
+	int status;
+	while (waitpid(request.pid, &status, 0) < 0 && errno == EINTR) {
+	}
+	char code = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_ERROR;
+
+	if (request.client >= 0) {
+		write_all(request.client, &code, 1);
+		close(request.client);
+	}
+	close(request.feedback);
+
+	if (opts.debug) {
+		auto elapsed = chrono::duration_cast<chrono::microseconds>(
+			chrono::steady_clock::now() - request.start);
+		ostringstream time;
+		time.setf(ios::fixed);
+		time.precision(1);
+		time << elapsed.count() / 1000.0;
+		err() << "request '" << request.command << "': exit status " << int(code)
+		      << ", " << time.str() << " ms" << endl;
+	}
+
+	for (size_t start = 0, end; start < request.used.size(); start = end + 1) {
+		end = request.used.find('\0', start);
+		if (end == string::npos) {
+			break;
+		}
+		documents.load_later(request.used.substr(start, end - start));
+	}
+}
+
+int Daemon::run()
+{
+	string path = opts.cache_directory + SOCKET_FILE;
+	struct sockaddr_un addr = {};
+	if (path.size() >= sizeof(addr.sun_path)) {
+		err() << "Socket path too long: " << path << endl;
+		return EXIT_ERROR;
+	}
+
+	int other = connect_socket(path);
+	if (other >= 0) {
+		close(other);
+		err() << "A daemon is already running on " << path << endl;
+		return EXIT_ERROR;
+	}
+
+	// Children take their standard file descriptors from the clients
+	for (int fd = 0; fd < 3; fd++) {
+		if (fcntl(fd, F_GETFD) < 0 && open("/dev/null", O_RDWR) < 0) {
+			return EXIT_ERROR;
+		}
+	}
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) {
+		err() << "socket: " << strerror(errno) << endl;
+		return EXIT_ERROR;
+	}
+	fcntl(listener, F_SETFD, FD_CLOEXEC);
+
+	// A socket that is left over from a daemon that was killed
+	unlink(path.c_str());
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	// Only our own user may connect, see also same_user()
+	if (bind(listener, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0
+	    || chmod(path.c_str(), S_IRUSR | S_IWUSR) != 0
+	    || listen(listener, SOMAXCONN) != 0) {
+		err() << path << ": " << strerror(errno) << endl;
+		close(listener);
+		return EXIT_ERROR;
+	}
+
+	if (pipe(stop_pipe) != 0) {
+		err() << "pipe: " << strerror(errno) << endl;
+		close(listener);
+		unlink(path.c_str());
+		return EXIT_ERROR;
+	}
+	struct sigaction action = {};
+	action.sa_handler = handle_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+	// Clients may go away before they get their answer
+	signal(SIGPIPE, SIG_IGN);
+
+	set_document_store(&documents);
+	reload_cache_state(opts.cache_directory);
+	cout << "Listening on " << path << endl;
+
+	bool stop = false;
+	while (!stop) {
+		vector<struct pollfd> fds;
+		fds.push_back({ listener, POLLIN, 0 });
+		fds.push_back({ stop_pipe[0], POLLIN, 0 });
+		for (const Running &request : running) {
+			fds.push_back({ request.feedback, POLLIN, 0 });
+			// The client doesn't send anything after the request,
+			// so the connection is only readable when it is closed.
+			fds.push_back({ request.client, POLLIN, 0 });
+		}
+		size_t first_connection = fds.size();
+		auto now = chrono::steady_clock::now();
+		int timeout = -1;
+		for (const Connection &connection : connections) {
+			fds.push_back({ connection.conn, POLLIN, 0 });
+			auto left = chrono::duration_cast<chrono::milliseconds>(
+				connection.deadline - now).count() + 1;
+			if (timeout < 0 || left < timeout) {
+				timeout = max(static_cast<int>(left), 0);
+			}
+		}
+
+		int ret = poll(fds.data(), fds.size(), timeout);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err() << "poll: " << strerror(errno) << endl;
+			break;
+		}
+
+		if (fds[1].revents != 0) {
+			stop = true;
+		}
+
+		for (size_t i = 0; i < running.size(); i++) {
+			Running &request = running[i];
+			if (fds[2 * i + 3].revents != 0 && request.client >= 0) {
+				kill(request.pid, SIGTERM);
+				close(request.client);
+				request.client = -1;
+			}
+
+			if (fds[2 * i + 2].revents != 0) {
+				char buf[4096];
+				ssize_t n = read(request.feedback, buf, sizeof(buf));
+				if (n > 0) {
+					request.used.append(buf, n);
+				} else if (n == 0 || errno != EINTR) {
+					// The child exited
+					finish(request);
+					request.pid = 0;
+				}
+			}
+		}
+		running.erase(remove_if(running.begin(), running.end(),
+		                        [](const Running &r) { return r.pid == 0; }),
+		              running.end());
+
+		// Clients that are too slow with their request are dropped
+		now = chrono::steady_clock::now();
+		vector<Connection> complete;
+		for (size_t i = 0; i < connections.size(); i++) {
+			Connection &connection = connections[i];
+			ReadState state = ReadState::MORE;
+			if (fds[first_connection + i].revents != 0) {
+				state = read_request(connection);
+			}
+			if (state == ReadState::MORE && now >= connection.deadline) {
+				state = ReadState::FAILED;
+			}
+
+			if (state == ReadState::DONE) {
+				complete.push_back(std::move(connection));
+			} else if (state == ReadState::FAILED) {
+				close(connection.conn);
+				connection.request.close_fds();
+			}
+			if (state != ReadState::MORE) {
+				connection.conn = -1;
+			}
+		}
+		connections.erase(remove_if(connections.begin(), connections.end(),
+		                            [](const Connection &c) { return c.conn < 0; }),
+		                  connections.end());
+		for (Connection &connection : complete) {
+			if (!stop) {
+				start(connection.conn, connection.request);
+			} else {
+				close(connection.conn);
+			}
+			connection.request.close_fds();
+		}
+
+		if (fds[0].revents != 0 && !stop) {
+			accept_connection();
+		}
+	}
+
+	for (Connection &connection : connections) {
+		close(connection.conn);
+		connection.request.close_fds();
+	}
+	unlink(path.c_str());
+	close(listener);
+	return EXIT_SUCCESS;
+}
+
+int run_daemon(const Options &opts, RequestHandler handler)
+{
+	return Daemon(opts, handler).run();
+}
+
+int run_client(const Options &opts, const vector<string> &args)
+{
+	string path = opts.cache_directory + SOCKET_FILE;
+	int sock = connect_socket(path);
+	if (sock < 0) {
+		if (opts.debug) {
+			err() << "no daemon on " << path << " (" << strerror(errno)
+			      << "), searching without it" << endl;
+		}
+		return -1;
+	}
+
+	char *cwd = getcwd(nullptr, 0);
+	if (cwd == nullptr) {
+		err() << "getcwd: " << strerror(errno) << endl;
+		close(sock);
+		return -1;
+	}
+
+	size_t env_count = 0;
+	string body = string(REQUEST_MAGIC) + '\0' + cwd + '\0';
+	free(cwd);
+	for (char **var = environ; *var != nullptr; var++) {
+		env_count++;
+	}
+	body += to_string(env_count) + '\0';
+	for (char **var = environ; *var != nullptr; var++) {
+		body += string(*var) + '\0';
+	}
+	for (const string &arg : args) {
+		body += arg + '\0';
+	}
+
+	char header[4];
+	for (int i = 0; i < 4; i++) {
+		header[i] = static_cast<char>((body.size() >> (8 * i)) & 0xff);
+	}
+
+	// Closed standard file descriptors are replaced with /dev/null
+	int fds[3];
+	for (int i = 0; i < 3; i++) {
+		fds[i] = fcntl(i, F_GETFD) >= 0 ? i : open("/dev/null", O_RDWR | O_CLOEXEC);
+	}
+
+	char control[CMSG_SPACE(sizeof(fds))] = {};
+	struct iovec iov = { header, sizeof(header) };
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	// Don't get killed by SIGPIPE if the daemon goes away
+	signal(SIGPIPE, SIG_IGN);
+	bool sent = sendmsg(sock, &msg, 0) == sizeof(header)
+		&& write_all(sock, body.data(), body.size());
+
+	for (int i = 0; i < 3; i++) {
+		if (fds[i] != i && fds[i] >= 0) {
+			close(fds[i]);
+		}
+	}
+
+	char status;
+	if (!sent || !read_all(sock, &status, 1)) {
+		err() << "The daemon on " << path << " didn't answer" << endl;
+		close(sock);
+		return EXIT_ERROR;
+	}
+	close(sock);
+	return static_cast<unsigned char>(status);
+}
@@ -0,0 +1,56 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <string>
+#include <vector>
+
+#include "pdfgrep.h"
+
+/* Runs pdfgrep with the arguments of a request, like main(). `in_daemon` is
+ * true, so that --daemon and --client in the arguments don't start another
+ * daemon or connect to this one. */
+typedef int (*RequestHandler)(int argc, char **argv, bool in_daemon);
+
+/** Answer the requests of pdfgrep --client on a socket (--daemon)
+ *
+ * Each request is run by a child of the daemon with `handler`, which inherits
+ * the state of the daemon: loaded libraries, the manifest and the pack of the
+ * cache in `opts.cache_directory`, and the documents that previous requests
+ * had to load. The results go straight to the output of the client.
+ *
+ * Runs until it gets SIGINT or SIGTERM and returns the exit status.
+ */
+int run_daemon(const Options &opts, RequestHandler handler);
+
+/** Let the daemon run pdfgrep with `args` (--client)
+ *
+ * The daemon writes to the standard output and error of this process. Returns
+ * the exit status of the search, or -1 if no daemon is running.
+ */
+int run_client(const Options &opts, const std::vector<std::string> &args);
+
+#endif /* DAEMON_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
@@ -0,0 +1,216 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "extract.h"
+#include "output.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+
+#include <cpp/poppler-page.h>
+
+using namespace std;
+
+// How many pages per thread may be extracted ahead of the page that is
+// currently searched
+static const size_t PAGES_AHEAD_PER_THREAD = 4;
+
+static string ustring_to_string(const poppler::ustring& str) {
+	poppler::byte_array arr = str.to_utf8();
+	if (arr.empty()) {
+		return string();
+	} else {
+		return string(arr.data(), arr.size());
+	}
+}
+
+static DocumentStore *document_store = nullptr;
+
+void set_document_store(DocumentStore *store)
+{
+	document_store = store;
+}
+
+unique_ptr<poppler::document> open_document(const Options &opts, const string &path)
+{
+	unique_ptr<poppler::document> doc;
+
+	if (opts.passwords.empty()) {
+		err() << "Internal error, password vector empty!" << endl;
+		abort();
+	}
+
+	if (document_store != nullptr) {
+		doc = document_store->take(opts, path);
+		if (doc != nullptr) {
+			return doc;
+		}
+	}
+
+	for (string const &password : opts.passwords) {
+		// FIXME This logic doesn't seem to make sens. What if only the
+		// first password is correct?
+		doc = unique_ptr<poppler::document>(
+			poppler::document::load_from_file(path, string(password),
+							  string(password))
+			);
+	}
+
+	if (doc == nullptr || doc->is_locked()) {
+		return nullptr;
+	}
+
+	if (document_store != nullptr) {
+		document_store->loaded(opts, path);
+	}
+	return doc;
+}
+
+bool extract_page(const poppler::document &doc, size_t pagenum, CachePage &cachepage)
+{
+	unique_ptr<poppler::page> page(doc.create_page(pagenum-1));
+
+	if (!page) {
+		return false;
+	}
+
+	poppler::byte_array text = page->text(page->page_rect(poppler::media_box)).to_utf8();
+
+	// newer versions of poppler generate spurious
+	// whitespace at the end of pages. Since in a pdf
+	// trailing whitespace text is visually identical to no
+	// text, we can just leave it out.
+	auto whitespace_start =
+		std::find_if(text.rbegin(),
+			     text.rend(), [](unsigned char ch) {
+				     return !std::isspace(ch);
+			     });
+	// Everything after this only refers to this copy of the text
+	cachepage.text.assign(text.begin(), whitespace_start.base());
+
+	// TODO Don't read label if we don't need it
+	cachepage.label = ustring_to_string(page->label());
+
+	return true;
+}
+
+PageExtractor::PageExtractor(const Options &opts, const string &path,
+                             unique_ptr<poppler::document> doc,
+                             vector<size_t> pages, unsigned nthreads)
+	: opts(opts), path(path), pages(std::move(pages)), window(nthreads * PAGES_AHEAD_PER_THREAD)
+{
+	slots.resize(this->pages.size());
+
+	threads.emplace_back(&PageExtractor::work, this, std::move(doc));
+	for (unsigned i = 1; i < nthreads; i++) {
+		threads.emplace_back(&PageExtractor::work, this, nullptr);
+	}
+}
+
+PageExtractor::~PageExtractor()
+{
+	stop();
+	for (auto &t : threads) {
+		t.join();
+	}
+}
+
+void PageExtractor::stop()
+{
+	lock_guard<std::mutex> lock(mutex);
+	stopped = true;
+	consumer_moved.notify_all();
+}
+
+bool PageExtractor::get(size_t pagenum, CachePage &page)
+{
+	// The pages are sorted
+	size_t i = lower_bound(pages.begin(), pages.end(), pagenum) - pages.begin();
+	if (i == pages.size() || pages[i] != pagenum) {
+		if (!own_doc) {
+			own_doc = open_document(opts, path);
+		}
+		return own_doc && extract_page(*own_doc, pagenum, page);
+	}
+
+	unique_lock<std::mutex> lock(mutex);
+
+	consumer_pos = i;
+	consumer_moved.notify_all();
+
+	page_done.wait(lock, [&] { return slots[i].state != SlotState::PENDING; });
+
+	bool ok = slots[i].state == SlotState::DONE;
+	page = std::move(slots[i].page);
+	slots[i].state = SlotState::TAKEN;
+	return ok;
+}
+
+void PageExtractor::finish(Cache &cache)
+{
+	stop();
+	for (auto &t : threads) {
+		t.join();
+	}
+	threads.clear();
+
+	for (size_t i = 0; i < slots.size(); i++) {
+		if (slots[i].state == SlotState::DONE) {
+			cache.set_page(pages[i], std::move(slots[i].page));
+		}
+	}
+}
+
+void PageExtractor::work(unique_ptr<poppler::document> doc)
+{
+	if (!doc) {
+		doc = open_document(opts, path);
+		if (!doc) {
+			// The first thread still has a document, so all pages
+			// are extracted anyway.
+			return;
+		}
+	}
+
+	unique_lock<std::mutex> lock(mutex);
+
+	while (true) {
+		consumer_moved.wait(lock, [this] {
+			return stopped || next_page >= pages.size()
+				|| next_page < consumer_pos + window;
+		});
+
+		if (stopped || next_page >= pages.size()) {
+			return;
+		}
+
+		size_t i = next_page++;
+
+		lock.unlock();
+		CachePage page;
+		bool ok = extract_page(*doc, pages[i], page);
+		lock.lock();
+
+		slots[i].page = std::move(page);
+		slots[i].state = ok ? SlotState::DONE : SlotState::FAILED;
+		page_done.notify_all();
+	}
+}
@@ -0,0 +1,142 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cpp/poppler-document.h>
+
+#include "pdfgrep.h"
+#include "cache.h"
+
+/** Documents that were loaded ahead of time, e.g. by the daemon.
+ *
+ * Both functions may be called by several threads at once.
+ */
+class DocumentStore {
+public:
+	virtual ~DocumentStore() = default;
+
+	/* Hand over the document at `path`, if the store has a current
+	 * version of it that was opened as `opts` say. Otherwise nullptr. */
+	virtual std::unique_ptr<poppler::document> take(const Options &opts, const std::string &path) = 0;
+
+	/* Called for each document that open_document() had to load from the
+	 * file */
+	virtual void loaded(const Options &opts, const std::string &path) = 0;
+};
+
+/* Let open_document() use `store`, or no store if it is nullptr */
+void set_document_store(DocumentStore *store);
+
+/** Open the PDF at `path`, trying all passwords from opts.
+ *
+ * Returns nullptr if the document can't be opened or is still locked.
+ */
+std::unique_ptr<poppler::document> open_document(const Options &opts, const std::string &path);
+
+/** Extract text and label of page `pagenum` (starting at 1) from doc.
+ *
+ * Returns false if poppler couldn't read the page.
+ */
+bool extract_page(const poppler::document &doc, size_t pagenum, CachePage &page);
+
+/** Extracts a list of pages of one document on multiple threads.
+ *
+ * poppler documents can't be used by more than one thread at a time, so every
+ * thread opens its own copy of the document. The pages are handed out to the
+ * threads one by one, but no thread gets more than a few pages ahead of the
+ * page that the consumer is waiting for.
+ */
+class PageExtractor {
+public:
+	/* `doc` is used by the first thread, the others open `path` themselves */
+	PageExtractor(const Options &opts, const std::string &path,
+	              std::unique_ptr<poppler::document> doc,
+	              std::vector<size_t> pages, unsigned threads);
+	// Stops and waits for all threads
+	~PageExtractor();
+
+	PageExtractor(const PageExtractor &) = delete;
+	PageExtractor &operator=(const PageExtractor &) = delete;
+
+	/* Wait until page `pagenum` is extracted and move it to `page`.
+	 *
+	 * Must be called with increasing page numbers. A page that isn't in
+	 * `pages` (e.g. a cached page that turned out to be unreadable) is
+	 * extracted right away, on the calling thread. Returns false if the
+	 * page couldn't be read.
+	 */
+	bool get(size_t pagenum, CachePage &page);
+
+	/* Tell all threads to stop after their current page */
+	void stop();
+
+	/* Stop, wait for all threads and move the pages that were extracted,
+	 * but not yet taken with get(), to `cache`. */
+	void finish(Cache &cache);
+
+private:
+	enum class SlotState { PENDING, DONE, FAILED, TAKEN };
+
+	struct Slot {
+		SlotState state = SlotState::PENDING;
+		CachePage page;
+	};
+
+	void work(std::unique_ptr<poppler::document> doc);
+
+	const Options &opts;
+	// for the pages that get() has to extract itself, opened when the
+	// first of them is needed
+	std::unique_ptr<poppler::document> own_doc;
+	const std::string path;
+	const std::vector<size_t> pages;
+	std::vector<Slot> slots;
+
+	std::mutex mutex;
+	// signaled when a slot is done
+	std::condition_variable page_done;
+	// signaled when the consumer moves on or the extractor is stopped
+	std::condition_variable consumer_moved;
+
+	// next entry of `pages` that no thread has started yet
+	size_t next_page = 0;
+	// the entry of `pages` the consumer waits for
+	size_t consumer_pos = 0;
+	// how far the threads may run ahead of consumer_pos
+	size_t window;
+	bool stopped = false;
+
+	std::vector<std::thread> threads;
+};
+
+#endif /* EXTRACT_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
@@ -0,0 +1,123 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "hash.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <gcrypt.h>
+
+using namespace std;
+
+// Size of the blocks in which files are read
+static const size_t READ_BLOCK_SIZE = 1 << 20;
+
+// A running checksum with either algorithm
+class Hasher {
+public:
+	explicit Hasher(CacheHash algorithm) : algorithm(algorithm) {
+		if (algorithm == CacheHash::SHA1) {
+			gcry_md_open(&sha1, GCRY_MD_SHA1, 0);
+		}
+	}
+
+	~Hasher() {
+		if (algorithm == CacheHash::SHA1) {
+			gcry_md_close(sha1);
+		}
+	}
+
+	Hasher(const Hasher &) = delete;
+	Hasher &operator=(const Hasher &) = delete;
+
+	void update(const unsigned char *data, size_t len) {
+		if (algorithm == CacheHash::SHA1) {
+			gcry_md_write(sha1, data, len);
+		} else {
+			xxh64.update(data, len);
+		}
+	}
+
+	vector<unsigned char> digest() {
+		if (algorithm == CacheHash::SHA1) {
+			const unsigned char *sum = gcry_md_read(sha1, GCRY_MD_SHA1);
+			return vector<unsigned char>(sum, sum + gcry_md_get_algo_dlen(GCRY_MD_SHA1));
+		}
+
+		uint64_t sum = xxh64.digest();
+		vector<unsigned char> bytes;
+		for (int shift = 56; shift >= 0; shift -= 8) {
+			bytes.push_back((sum >> shift) & 0xff);
+		}
+		return bytes;
+	}
+
+private:
+	CacheHash algorithm;
+	gcry_md_hd_t sha1 = nullptr;
+	Xxh64 xxh64;
+};
+
+static int hash_read(int fd, Hasher &hasher)
+{
+	vector<unsigned char> block(READ_BLOCK_SIZE);
+
+	while (true) {
+		ssize_t n = read(fd, block.data(), block.size());
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return -1;
+		}
+		if (n == 0) {
+			return 0;
+		}
+		hasher.update(block.data(), n);
+	}
+}
+
+int hash_file(int fd, CacheHash algorithm, string &digest)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	Hasher hasher(algorithm);
+
+	if (hash_read(fd, hasher) != 0) {
+		return -1;
+	}
+
+	// This nibble order is unusual, but the names of existing cache files
+	// depend on it.
+	const char translate[] = "0123456789abcdef";
+	digest.clear();
+	for (unsigned char c : hasher.digest()) {
+		digest += translate[c & 0xf];
+		digest += translate[(c >> 4) & 0xf];
+	}
+	return 0;
+}
@@ -0,0 +1,161 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "pdfgrep.h"
+
+/** Compute the checksum of the file open as `fd` with the given algorithm and
+ * write it to `digest` as a hex string.
+ *
+ * The file is read and hashed in blocks, so it is never held in memory as a
+ * whole. Returns -1 if the file can't be read and 0 on success.
+ */
+int hash_file(int fd, CacheHash algorithm, std::string &digest);
+
+/* XXH64 by Yann Collet, see https://github.com/Cyan4973/xxHash. It is not a
+ * cryptographic hash, but much faster than SHA-1, and good enough to tell
+ * apart the PDFs in a cache or to detect corrupted cache files.
+ */
+class Xxh64 {
+public:
+	Xxh64() {
+		acc[0] = PRIME1 + PRIME2;
+		acc[1] = PRIME2;
+		acc[2] = 0;
+		acc[3] = -PRIME1;
+	}
+
+	void update(const unsigned char *data, size_t len) {
+		total_len += len;
+
+		if (buffered + len < 32) {
+			memcpy(buffer + buffered, data, len);
+			buffered += len;
+			return;
+		}
+
+		if (buffered > 0) {
+			size_t fill = 32 - buffered;
+			memcpy(buffer + buffered, data, fill);
+			consume(buffer);
+			data += fill;
+			len -= fill;
+			buffered = 0;
+		}
+
+		for (; len >= 32; data += 32, len -= 32) {
+			consume(data);
+		}
+
+		memcpy(buffer, data, len);
+		buffered = len;
+	}
+
+	uint64_t digest() const {
+		uint64_t h;
+
+		if (total_len >= 32) {
+			h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+			for (uint64_t a : acc) {
+				h ^= round(0, a);
+				h = h * PRIME1 + PRIME4;
+			}
+		} else {
+			h = PRIME5;
+		}
+
+		h += total_len;
+
+		const unsigned char *p = buffer;
+		size_t len = buffered;
+
+		for (; len >= 8; p += 8, len -= 8) {
+			h ^= round(0, read64(p));
+			h = rotl(h, 27) * PRIME1 + PRIME4;
+		}
+		if (len >= 4) {
+			h ^= read32(p) * PRIME1;
+			h = rotl(h, 23) * PRIME2 + PRIME3;
+			p += 4;
+			len -= 4;
+		}
+		for (; len > 0; p++, len--) {
+			h ^= *p * PRIME5;
+			h = rotl(h, 11) * PRIME1;
+		}
+
+		h ^= h >> 33;
+		h *= PRIME2;
+		h ^= h >> 29;
+		h *= PRIME3;
+		h ^= h >> 32;
+		return h;
+	}
+
+private:
+	static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+	static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+	static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+	static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+	static const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+	static uint64_t rotl(uint64_t x, int r) {
+		return (x << r) | (x >> (64 - r));
+	}
+
+	static uint64_t round(uint64_t acc, uint64_t input) {
+		acc += input * PRIME2;
+		return rotl(acc, 31) * PRIME1;
+	}
+
+	// little endian, independent of the machine
+	static uint64_t read64(const unsigned char *p) {
+		return read32(p) | (read32(p + 4) << 32);
+	}
+
+	static uint64_t read32(const unsigned char *p) {
+		return uint64_t(p[0]) | (uint64_t(p[1]) << 8)
+			| (uint64_t(p[2]) << 16) | (uint64_t(p[3]) << 24);
+	}
+
+	void consume(const unsigned char *stripe) {
+		for (int i = 0; i < 4; i++) {
+			acc[i] = round(acc[i], read64(stripe + 8 * i));
+		}
+	}
+
+	uint64_t acc[4];
+	unsigned char buffer[32];
+	size_t buffered = 0;
+	uint64_t total_len = 0;
+};
+
+#endif /* HASH_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
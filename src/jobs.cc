@@ -0,0 +1,148 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "jobs.h"
+#include "output.h"
+
+#include <iostream>
+
+using namespace std;
+
+// How many jobs per worker may be queued or wait for their output to be
+// printed, before add() blocks. This bounds the memory needed for buffered
+// output, if one job takes much longer than the following ones.
+static const size_t JOBS_PER_THREAD = 16;
+
+JobPool::JobPool(unsigned threads)
+	: max_jobs(threads * JOBS_PER_THREAD)
+{
+	for (unsigned i = 0; i < threads; i++) {
+		workers.emplace_back(&JobPool::work, this);
+	}
+}
+
+JobPool::~JobPool()
+{
+	{
+		lock_guard<std::mutex> lock(mutex);
+		shutdown = true;
+	}
+	job_added.notify_all();
+
+	for (auto &t : workers) {
+		t.join();
+	}
+}
+
+unsigned JobPool::hardware_threads()
+{
+	unsigned n = thread::hardware_concurrency();
+	return n == 0 ? 1 : n;
+}
+
+void JobPool::add(function<void()> job)
+{
+	unique_lock<std::mutex> lock(mutex);
+
+	job_printed.wait(lock, [this] { return stopped || jobs.size() + unprinted < max_jobs; });
+	if (stopped) {
+		return;
+	}
+
+	jobs.emplace_back(new Job);
+	jobs.back()->run = std::move(job);
+
+	job_added.notify_one();
+}
+
+void JobPool::wait()
+{
+	unique_lock<std::mutex> lock(mutex);
+	job_printed.wait(lock, [this] { return jobs.empty() && unprinted == 0; });
+}
+
+void JobPool::stop()
+{
+	lock_guard<std::mutex> lock(mutex);
+	stopped = true;
+	jobs.erase(jobs.begin() + next_job, jobs.end());
+	job_printed.notify_all();
+}
+
+void JobPool::work()
+{
+	unique_lock<std::mutex> lock(mutex);
+
+	while (true) {
+		job_added.wait(lock, [this] { return shutdown || next_job < jobs.size(); });
+		if (next_job >= jobs.size()) {
+			// shutdown and nothing left to do
+			return;
+		}
+
+		Job *job = jobs[next_job++].get();
+
+		lock.unlock();
+		redirect_output(&job->out, &job->err);
+		job->run();
+		redirect_output(nullptr, nullptr);
+		lock.lock();
+
+		job->done = true;
+		print_finished_jobs(lock);
+	}
+}
+
+// Must be called with the mutex held. It is released while writing.
+void JobPool::print_finished_jobs(unique_lock<std::mutex> &lock)
+{
+	while (!jobs.empty() && jobs.front()->done) {
+		to_print.push_back(std::move(jobs.front()));
+		jobs.pop_front();
+		next_job--;
+		unprinted++;
+	}
+
+	// Only one worker writes at a time, which keeps the order. The others
+	// leave their finished jobs to it and carry on.
+	if (printing) {
+		return;
+	}
+	printing = true;
+
+	while (!to_print.empty()) {
+		deque<unique_ptr<Job>> batch;
+		batch.swap(to_print);
+		size_t batch_size = batch.size();
+
+		lock.unlock();
+		for (const auto &job : batch) {
+			write_stderr(job->err.str());
+			out() << job->out.str();
+		}
+		batch.clear();
+		lock.lock();
+
+		unprinted -= batch_size;
+		job_printed.notify_all();
+	}
+
+	printing = false;
+}
@@ -0,0 +1,106 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+/** A pool of worker threads for --jobs.
+ *
+ * Everything a job prints with out() and err() is buffered and only written to
+ * stdout and stderr after the job has finished. The output of different jobs is
+ * never mixed and always printed in the order in which the jobs were added, so
+ * it looks exactly like the output of a sequential run. (Within one job, the
+ * messages to stderr are printed before the output to stdout, though.)
+ */
+class JobPool {
+public:
+	explicit JobPool(unsigned threads);
+	~JobPool();
+
+	JobPool(const JobPool &) = delete;
+	JobPool &operator=(const JobPool &) = delete;
+
+	// Queue a job. This blocks if too many jobs are waiting to be started
+	// or waiting for their output to be printed.
+	void add(std::function<void()> job);
+
+	// Wait until all jobs are done and their output has been printed.
+	void wait();
+
+	// Drop all jobs that haven't been started yet and ignore all jobs
+	// added from now on. Jobs that are already running are finished
+	// normally.
+	void stop();
+
+	// Number of threads that the machine can run concurrently (at least 1)
+	static unsigned hardware_threads();
+
+private:
+	struct Job {
+		std::function<void()> run;
+		std::ostringstream out;
+		std::ostringstream err;
+		bool done = false;
+	};
+
+	void work();
+	void print_finished_jobs(std::unique_lock<std::mutex> &lock);
+
+	std::mutex mutex;
+	// signaled when a new job is available or the pool is shutting down
+	std::condition_variable job_added;
+	// signaled when a job was printed
+	std::condition_variable job_printed;
+
+	// All jobs that aren't finished or wait for their turn to be printed,
+	// in the order they were added.
+	std::deque<std::unique_ptr<Job>> jobs;
+	// Index (into jobs) of the first job that no worker has started yet
+	size_t next_job = 0;
+	// Finished jobs, in order, that the printing worker hasn't taken yet
+	std::deque<std::unique_ptr<Job>> to_print;
+	// true while a worker writes the output of finished jobs. The mutex
+	// isn't held while writing, so that a slow reader of stdout doesn't
+	// block the other workers.
+	bool printing = false;
+	// Number of jobs in to_print or being written
+	size_t unprinted = 0;
+	// Maximum number of jobs in `jobs` and unprinted
+	size_t max_jobs;
+	bool stopped = false;
+	bool shutdown = false;
+
+	std::vector<std::thread> workers;
+};
+
+#endif /* JOBS_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
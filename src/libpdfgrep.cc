@@ -0,0 +1,232 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "libpdfgrep.h"
+
+#include <climits>
+#include <sstream>
+
+#include "pdfgrep.h"
+#include "output.h"
+#include "regengine.h"
+#include "search.h"
+#include "cache.h"
+#include "extract.h"
+#include "trigram.h"
+
+using namespace std;
+
+namespace pdfgrep {
+
+/* While it exists, the messages that the current thread prints with err() go
+ * to a callback instead of stderr, without the "pdfgrep: " and the newline.
+ * Nothing is printed to stdout. */
+class MessageRedirect
+{
+public:
+	explicit MessageRedirect(function<void(const string &)> on_message)
+		: buf(std::move(on_message)), stream(&buf), discard(nullptr)
+	{
+		redirect_output(&discard, &stream);
+	}
+
+	~MessageRedirect()
+	{
+		stream.flush();
+		redirect_output(nullptr, nullptr);
+	}
+
+	MessageRedirect(const MessageRedirect &) = delete;
+	MessageRedirect &operator=(const MessageRedirect &) = delete;
+
+private:
+	// A message ends when the stream is flushed, e.g. by endl
+	class Buf : public stringbuf
+	{
+	public:
+		explicit Buf(function<void(const string &)> on_message)
+			: on_message(std::move(on_message)) {}
+
+	protected:
+		int sync() override
+		{
+			string message = str();
+			str("");
+			const string prefix = "pdfgrep: ";
+			if (message.compare(0, prefix.size(), prefix) == 0) {
+				message.erase(0, prefix.size());
+			}
+			while (!message.empty() && message.back() == '\n') {
+				message.pop_back();
+			}
+			if (!message.empty() && on_message) {
+				on_message(message);
+			}
+			return 0;
+		}
+
+	private:
+		function<void(const string &)> on_message;
+	};
+
+	Buf buf;
+	ostream stream;
+	// an ostream without buffer drops everything
+	ostream discard;
+};
+
+bool has_pcre()
+{
+#ifdef HAVE_LIBPCRE
+	return true;
+#else
+	return false;
+#endif
+}
+
+static unique_ptr<Regengine> compile(const string &pattern, Syntax syntax, bool ignore_case)
+{
+	try {
+		switch (syntax) {
+		case Syntax::PCRE:
+#ifdef HAVE_LIBPCRE
+			return make_unique<PCRERegex>(pattern, ignore_case);
+#else
+			throw Error("libpdfgrep was built without PCRE support");
+#endif
+		case Syntax::FIXED:
+			return make_unique<FixedString>(pattern, ignore_case);
+		case Syntax::EXTENDED:
+			break;
+		}
+		return make_unique<PosixRegex>(pattern, ignore_case);
+	} catch (const PatternError &e) {
+		throw Error(e.what());
+	}
+}
+
+Pattern::Pattern(const string &pattern, Syntax syntax, bool ignore_case)
+	: re(compile(pattern, syntax, ignore_case)),
+	  query(make_unique<TrigramQuery>(re->trigram_query()))
+{
+}
+
+Pattern::Pattern(const vector<string> &patterns, Syntax syntax, bool ignore_case)
+{
+	auto list = make_unique<PatternList>();
+	for (const string &p : patterns) {
+		list->add_pattern(compile(p, syntax, ignore_case));
+	}
+	re = std::move(list);
+	query = make_unique<TrigramQuery>(re->trigram_query());
+}
+
+Pattern::~Pattern() = default;
+Pattern::Pattern(Pattern &&other) noexcept = default;
+Pattern &Pattern::operator=(Pattern &&other) noexcept = default;
+
+size_t search(const string &path, const Pattern &pattern, const MatchCallback &on_match,
+              const SearchOptions &options)
+{
+	MessageRedirect warnings(options.on_warning);
+
+	// Everything that the search depends on is in here, so concurrent
+	// searches don't share anything but the cache.
+	Options opts;
+	opts.passwords.push_back(options.password);
+
+	IntervalContainer pages;
+	if (options.first_page > 1 || options.last_page > 0) {
+		size_t last = options.last_page > 0 ? options.last_page : INT_MAX;
+		pages.addInterval(Interval(static_cast<int>(options.first_page),
+		                           static_cast<int>(min(last, size_t(INT_MAX)))));
+	}
+
+	unique_ptr<Cache> cache;
+	if (!options.cache_directory.empty()) {
+		opts.use_cache = true;
+		opts.cache_directory = options.cache_directory;
+		if (opts.cache_directory.back() != '/') {
+			opts.cache_directory += '/';
+		}
+		if (!pattern.query->is_all()) {
+			opts.filter_query = pattern.query.get();
+		}
+
+		string cache_file;
+		if (cache_file_name(opts.cache_directory, path, opts.cache_hash, cache_file) != 0) {
+			throw Error("Could not compute checksum for " + path);
+		}
+		cache = open_cache(opts, cache_file);
+	}
+
+	// If all pages are cached, the PDF doesn't have to be parsed at all
+	unique_ptr<poppler::document> doc;
+	if (!cache || !cache->is_complete(pages)) {
+		doc = open_document(opts, path);
+		if (doc == nullptr) {
+			throw Error("Could not open " + path);
+		}
+	}
+
+	size_t count = 0;
+	search_pages(opts, std::move(doc), cache.get(), path, *pattern.re, pages,
+	             options.max_count,
+	             [&](const SearchedPage &page) {
+		             for (const PageMatch &pm : page.matches) {
+			             Match match { page.pagenum, page.label, page.text,
+			                           pm.start, pm.end };
+			             count++;
+			             if (!on_match(match)) {
+				             return false;
+			             }
+			             if (options.max_count > 0 && count >= options.max_count) {
+				             return false;
+			             }
+		             }
+		             return true;
+	             },
+	             [&](size_t pagenum) {
+		             if (options.on_page_error) {
+			             options.on_page_error(pagenum);
+		             }
+	             });
+
+	return count;
+}
+
+string default_cache_directory()
+{
+	string reason;
+	string dir;
+	int ret;
+	{
+		MessageRedirect messages([&](const string &message) {
+			reason = message;
+		});
+		ret = find_cache_directory(dir);
+	}
+	if (ret != 0) {
+		throw Error(reason.empty() ? "Could not create the cache directory" : reason);
+	}
+	return dir;
+}
+
+} // namespace pdfgrep
@@ -0,0 +1,169 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+
+#ifndef LIBPDFGREP_H
+#define LIBPDFGREP_H
+
+/** libpdfgrep: the search of pdfgrep for other programs
+ *
+ * Instead of printing the matches, search() passes each of them to a callback:
+ *
+ *     pdfgrep::Pattern pattern("foo(bar)?");
+ *     pdfgrep::search("doc.pdf", pattern, [](const pdfgrep::Match &m) {
+ *             std::cout << m.page << ": " << m.text.substr(m.start, m.end - m.start) << "\n";
+ *             return true;
+ *     });
+ *
+ * Nothing is written to stdout or stderr and nothing exits the process; errors
+ * are thrown as pdfgrep::Error and warnings, e.g. about the cache, are passed
+ * to SearchOptions::on_warning. Any number of threads can search at the same
+ * time, also with the same Pattern.
+ *
+ * This header is installed with --enable-library, so it doesn't include the
+ * internal headers of pdfgrep. Only its symbols are global in libpdfgrep.a.
+ * Link the library with `pkg-config --libs libpdfgrep`.
+ */
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Regengine;
+struct TrigramQuery;
+
+#ifdef __GNUC__
+#pragma GCC visibility push(default)
+#endif
+
+namespace pdfgrep {
+
+// Thrown if a pattern is invalid or a document can't be searched
+class Error : public std::runtime_error
+{
+public:
+	using std::runtime_error::runtime_error;
+};
+
+enum class Syntax {
+	// POSIX extended regular expressions, the default of pdfgrep
+	EXTENDED,
+	// Perl compatible regular expressions (--pcre), see has_pcre()
+	PCRE,
+	// fixed strings (--fixed-strings)
+	FIXED
+};
+
+// True if libpdfgrep was built with PCRE support
+bool has_pcre();
+
+struct Match {
+	// the number of the page, starting at 1
+	size_t page;
+	// the label of the page, as printed by --page-number=label
+	std::string_view label;
+	// the text of the page. Only valid until the callback returns.
+	std::string_view text;
+	// the match is text.substr(start, end - start)
+	size_t start;
+	size_t end;
+};
+
+struct SearchOptions {
+	// for encrypted documents
+	std::string password;
+	// only search these pages. 0 for the last page of the document.
+	size_t first_page = 1;
+	size_t last_page = 0;
+	// stop after this many matches in the document, 0 for all of them
+	size_t max_count = 0;
+	/* keep the text of the pages in this directory, like --cache. Empty
+	 * for no cache. See default_cache_directory().
+	 *
+	 * Documents whose pages are all cached aren't even opened. The cache
+	 * is shared with pdfgrep. */
+	std::string cache_directory;
+	// called with the number of each page that can't be read. Such pages
+	// are skipped.
+	std::function<void(size_t page)> on_page_error;
+	// called with each warning that pdfgrep would print, e.g. if the
+	// cache can't be written. Warnings are dropped if this is empty.
+	std::function<void(const std::string &message)> on_warning;
+};
+
+// Called for each match, in order. Return false to stop the search.
+typedef std::function<bool(const Match &match)> MatchCallback;
+
+/** A compiled pattern.
+ *
+ * Compile it once and search as many documents with it as you like.
+ */
+class Pattern
+{
+public:
+	/* Throws Error if the pattern is invalid */
+	explicit Pattern(const std::string &pattern, Syntax syntax = Syntax::EXTENDED,
+	                 bool ignore_case = false);
+	/* Matches wherever one of `patterns` matches, like several --regexp */
+	explicit Pattern(const std::vector<std::string> &patterns,
+	                 Syntax syntax = Syntax::EXTENDED, bool ignore_case = false);
+	~Pattern();
+
+	Pattern(Pattern &&other) noexcept;
+	Pattern &operator=(Pattern &&other) noexcept;
+
+private:
+	friend size_t search(const std::string &path, const Pattern &pattern,
+	                     const MatchCallback &on_match, const SearchOptions &options);
+
+	std::unique_ptr<Regengine> re;
+	// what pages with a match have in common, for the Bloom filters of the
+	// cache
+	std::unique_ptr<TrigramQuery> query;
+};
+
+/** Search the PDF at `path` for `pattern`.
+ *
+ * Returns the number of matches. Throws Error if the document can't be opened
+ * or its password is wrong.
+ */
+size_t search(const std::string &path, const Pattern &pattern,
+              const MatchCallback &on_match,
+              const SearchOptions &options = SearchOptions());
+
+/* The cache directory that pdfgrep --cache uses. It is created, if necessary.
+ * Throws Error with the reason if that isn't possible. */
+std::string default_cache_directory();
+
+} // namespace pdfgrep
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
+
+#endif /* LIBPDFGREP_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
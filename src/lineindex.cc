@@ -0,0 +1,55 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "lineindex.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+LineIndex::LineIndex(string_view text, std::pmr::memory_resource *memory)
+	: newlines(memory)
+{
+	// memchr is vectorized by the C library, so this is the fastest way to
+	// find all newlines
+	const char *begin = text.data();
+	const char *end = begin + text.size();
+
+	for (const char *p = begin; p < end; p++) {
+		p = static_cast<const char *>(memchr(p, '\n', end - p));
+		if (p == nullptr) {
+			break;
+		}
+		newlines.push_back(p - begin);
+	}
+}
+
+size_t LineIndex::find(size_t pos) const
+{
+	auto it = lower_bound(newlines.begin(), newlines.end(), pos);
+	return it == newlines.end() ? string::npos : *it;
+}
+
+size_t LineIndex::rfind(size_t pos) const
+{
+	auto it = upper_bound(newlines.begin(), newlines.end(), pos);
+	return it == newlines.begin() ? string::npos : *(it - 1);
+}
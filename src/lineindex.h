@@ -0,0 +1,61 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef LINEINDEX_H
+#define LINEINDEX_H
+
+#include <cstddef>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/** The positions of the newlines in the text of a page.
+ *
+ * Grouping the matches into lines and printing context needs the line
+ * boundaries around each match. Instead of searching the text for them again
+ * for every match, the text is scanned once and the boundaries are looked up
+ * with a binary search.
+ */
+class LineIndex {
+public:
+	// An index of a text without newlines
+	LineIndex() {}
+	// The index is allocated from `memory`, e.g. a PageArena
+	explicit LineIndex(std::string_view text,
+	                   std::pmr::memory_resource *memory = std::pmr::get_default_resource());
+
+	/* Position of the first newline at or after `pos`, like
+	 * text.find('\n', pos) */
+	size_t find(size_t pos) const;
+
+	/* Position of the last newline at or before `pos`, like
+	 * text.rfind('\n', pos) */
+	size_t rfind(size_t pos) const;
+
+private:
+	std::pmr::vector<size_t> newlines;
+};
+
+#endif /* LINEINDEX_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
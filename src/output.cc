@@ -24,10 +24,114 @@
 #include <cstring>
 #include <cctype>
 #include <iostream>
+#include <sstream>
 #include <algorithm>
+#include <mutex>
 
 using namespace std;
 
+// Streams that out() and err() write to in the current thread. nullptr means
+// stdout and stderr. See redirect_output().
+static thread_local ostream *out_stream = nullptr;
+static thread_local ostream *err_stream = nullptr;
+
+// Serializes writes to stderr from different threads
+static mutex stderr_mutex;
+// see set_status_line(), needs the mutex
+static string status_line;
+
+// Needs the mutex
+static void write_stderr_locked(const string &str) {
+	if (!status_line.empty() && !str.empty()) {
+		cerr << "\r\033[K" << str << status_line;
+	} else {
+		cerr << str;
+	}
+	cerr.flush();
+}
+
+// Collects a message and writes it to stderr in one piece, when it is flushed,
+// e.g. by endl. This way, messages from different threads don't get mixed up.
+class MessageBuf : public stringbuf {
+protected:
+	int sync() override {
+		lock_guard<mutex> lock(stderr_mutex);
+		write_stderr_locked(str());
+		str("");
+		return 0;
+	}
+};
+
+static thread_local MessageBuf message_buf;
+static thread_local ostream message_stream(&message_buf);
+
+// The buffer of stdout. Writing through std::cout means a call into stdio for
+// every character, and endl flushes every line. This collects the output and
+// writes it in large blocks: when the buffer is full, when pdfgrep exits, and
+// with --line-buffered also after each line.
+//
+// Only one thread may write to it at a time.
+class OutputBuf : public streambuf {
+public:
+	OutputBuf() {
+		buffer.reserve(BUFFER_SIZE);
+	}
+
+	~OutputBuf() override {
+		flush();
+	}
+
+	void set_line_buffered(bool line_buffered) {
+		this->line_buffered = line_buffered;
+	}
+
+protected:
+	// There is no put area, so that every write ends up in one of these
+	// two functions and newlines can't slip by.
+	int_type overflow(int_type c) override {
+		if (traits_type::eq_int_type(c, traits_type::eof())) {
+			return traits_type::not_eof(c);
+		}
+		buffer.push_back(traits_type::to_char_type(c));
+		if (buffer.size() >= BUFFER_SIZE || (line_buffered && c == '\n')) {
+			flush();
+		}
+		return c;
+	}
+
+	streamsize xsputn(const char *s, streamsize n) override {
+		buffer.append(s, n);
+		if (buffer.size() >= BUFFER_SIZE
+		    || (line_buffered && memchr(s, '\n', n) != nullptr)) {
+			flush();
+		}
+		return n;
+	}
+
+	int sync() override {
+		flush();
+		return 0;
+	}
+
+private:
+	static const size_t BUFFER_SIZE = 64 * 1024;
+
+	void flush() {
+		if (!buffer.empty()) {
+			// std::cout writes to stdout, too
+			fwrite(buffer.data(), 1, buffer.size(), stdout);
+			buffer.clear();
+		}
+		fflush(stdout);
+	}
+
+	string buffer;
+	bool line_buffered = false;
+};
+
+static OutputBuf stdout_buf;
+static ostream stdout_stream(&stdout_buf);
+
 static bool is_valid_color(const char* colorcode) {
 	return colorcode != nullptr && strcmp(colorcode, "") != 0;
 }
@@ -64,92 +168,281 @@ std::ostream& nocolor(std::ostream &out) {
 }
 
 struct substr {
-	const std::string &str;
+	std::string_view str;
 	const size_t begin;
 	const size_t end;
-	substr(const std::string &str, size_t begin, size_t end)
+	substr(std::string_view str, size_t begin, size_t end)
 		:str(str), begin(begin), end(end)
 	{}
 };
 
 std::ostream& operator<<(ostream &out, const substr &s) {
-	auto iend = s.str.begin() + s.end;
-
-	for (auto i = s.str.begin() + s.begin; i != iend; i++) {
-		out << *i;
-	}
-	return out;
+	return out.write(s.str.data() + s.begin, s.end - s.begin);
 }
 
 void print_only_match(const struct context &context, const struct match &match)
 {
 	line_prefix(context, false);
 
-	cout << color(context.out.color, context.out.colors.highlight)
-	     << substr(match.string, match.start, match.end)
+	out() << color(context.out.color, context.out.colors.highlight)
+	      << substr(match.string, match.start, match.end)
 	     << nocolor
-	     << endl;
+	     << '\n';
 }
 
 ostream& err() {
-	return cerr << "pdfgrep: ";
+	if (err_stream != nullptr) {
+		return *err_stream << "pdfgrep: ";
+	}
+	return message_stream << "pdfgrep: ";
+}
+
+ostream& out() {
+	if (out_stream != nullptr) {
+		return *out_stream;
+	}
+	return stdout_stream;
+}
+
+void set_line_buffered(bool line_buffered) {
+	stdout_buf.set_line_buffered(line_buffered);
+}
+
+void redirect_output(ostream *out, ostream *err) {
+	out_stream = out;
+	err_stream = err;
+}
+
+void write_stderr(const string &str) {
+	lock_guard<mutex> lock(stderr_mutex);
+	write_stderr_locked(str);
+}
+
+void set_status_line(const string &line) {
+	lock_guard<mutex> lock(stderr_mutex);
+	cerr << "\r\033[K" << line;
+	cerr.flush();
+	status_line = line;
 }
 
 void print_only_filename(const Outconf& outconf, const std::string& filename) {
-	cout << color(outconf.color, outconf.colors.filename) << filename << nocolor;
+	out() << color(outconf.color, outconf.colors.filename) << filename << nocolor;
 
 	if (outconf.null_byte_sep) {
-		cout << '\0';
+		out() << '\0';
 	} else {
-		cout << endl;
+		out() << '\n';
 	}
 }
 
-std::ostream& line_prefix(const context& ctx, bool in_context) {
-	const Outconf outconf = ctx.out;
+// Appends everything that is written to it to a string. Unlike an
+// ostringstream, it keeps using the same string, so that a new prefix fits into
+// the memory of the previous one.
+class AppendBuf : public streambuf {
+public:
+	explicit AppendBuf(string &str) : str(str) {}
+
+protected:
+	int_type overflow(int_type c) override {
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			str.push_back(traits_type::to_char_type(c));
+		}
+		return traits_type::not_eof(c);
+	}
+
+	streamsize xsputn(const char *s, streamsize n) override {
+		str.append(s, n);
+		return n;
+	}
+
+private:
+	string &str;
+};
+
+// The last prefix that line_prefix() printed. All lines of a page have the
+// same prefix, so it is only built once per page.
+struct PrefixCache {
+	const Outconf *outconf = nullptr;
+	string filename;
+	size_t pagenum = 0;
+	string page_label;
+	bool in_context = false;
+	string prefix;
+};
+
+static thread_local PrefixCache prefix_cache;
+
+static void build_prefix(ostream &out, const context& ctx, bool in_context) {
+	const Outconf &outconf = ctx.out;
 
 	if (outconf.filename) {
-		cout << color(outconf.color, outconf.colors.filename)
-		     << ctx.filename << nocolor;
+		out << color(outconf.color, outconf.colors.filename)
+		    << ctx.filename << nocolor;
 
 		// Here, --null takes precedence over --match-prefix-separator
 		// in the sense, that if --null is given, the null byte is
 		// always printed after the filename instead of the separator.
 		if (outconf.null_byte_sep) {
-			cout << '\0';
+			out << '\0';
 		} else {
-			cout << color(outconf.color, outconf.colors.separator)
-			     << (in_context ? "-" : outconf.prefix_sep ) << nocolor;
+			out << color(outconf.color, outconf.colors.separator)
+			    << (in_context ? "-" : outconf.prefix_sep ) << nocolor;
 		}
 	}
 	if (outconf.pagenum) {
-		cout << color(outconf.color, outconf.colors.pagenum);
+		out << color(outconf.color, outconf.colors.pagenum);
 		if (outconf.pagenum_type == PagenumType::INDEX) {
-			cout << ctx.pagenum;
+			out << ctx.pagenum;
 		} else {
-			cout << ctx.page_label;
+			out << ctx.page_label;
 		}
-		cout << nocolor;
+		out << nocolor;
 
-		cout << color(outconf.color, outconf.colors.separator)
-		     << (in_context ? "-" : outconf.prefix_sep)
-		     << nocolor;
+		out << color(outconf.color, outconf.colors.separator)
+		    << (in_context ? "-" : outconf.prefix_sep)
+		    << nocolor;
+	}
+}
+
+// Returns the prefix of ctx's page that `build` writes, building it again only
+// if the page isn't the one that `cache` was built for
+static const string &cached_prefix(PrefixCache &cache, const context& ctx, bool in_context,
+                                   void (*build)(ostream &, const context &, bool)) {
+	if (cache.outconf != &ctx.out || cache.pagenum != ctx.pagenum
+	    || cache.in_context != in_context || cache.filename != ctx.filename
+	    || cache.page_label != ctx.page_label) {
+		cache.prefix.clear();
+		AppendBuf buf(cache.prefix);
+		ostream prefix(&buf);
+		build(prefix, ctx, in_context);
+
+		cache.outconf = &ctx.out;
+		cache.filename = ctx.filename;
+		cache.pagenum = ctx.pagenum;
+		cache.page_label = ctx.page_label;
+		cache.in_context = in_context;
 	}
 
+	return cache.prefix;
+}
+
+std::ostream& line_prefix(const context& ctx, bool in_context) {
+	return out() << cached_prefix(prefix_cache, ctx, in_context, build_prefix);
+}
+
+// Write `len` bytes at `str` as a JSON string. Invalid UTF-8 is replaced by
+// U+FFFD, so that the output stays valid JSON.
+static void write_json_string(ostream &out, const char *str, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *s = reinterpret_cast<const unsigned char *>(str);
+
+	out << '"';
+
+	// Bytes that can be copied as they are, are written in runs
+	size_t run = 0;
+	size_t i = 0;
+	while (i < len) {
+		unsigned char c = s[i];
+		size_t seq = 1;
+		bool valid = true;
+
+		if (c >= 0x80) {
+			unsigned char min = 0x80, max = 0xbf;
+			if (c >= 0xc2 && c <= 0xdf) {
+				seq = 2;
+			} else if (c >= 0xe0 && c <= 0xef) {
+				seq = 3;
+				// no overlong forms and no surrogates
+				min = c == 0xe0 ? 0xa0 : 0x80;
+				max = c == 0xed ? 0x9f : 0xbf;
+			} else if (c >= 0xf0 && c <= 0xf4) {
+				seq = 4;
+				// no overlong forms and nothing above U+10FFFF
+				min = c == 0xf0 ? 0x90 : 0x80;
+				max = c == 0xf4 ? 0x8f : 0xbf;
+			} else {
+				valid = false;
+			}
+
+			for (size_t j = 1; valid && j < seq; j++) {
+				valid = i + j < len && s[i+j] >= (j == 1 ? min : 0x80)
+					&& s[i+j] <= (j == 1 ? max : 0xbf);
+			}
+			if (valid) {
+				i += seq;
+				continue;
+			}
+		} else if (c >= 0x20 && c != '"' && c != '\\') {
+			i++;
+			continue;
+		}
+
+		out.write(str + run, i - run);
+		if (!valid) {
+			out << "\\ufffd";
+		} else if (c == '"' || c == '\\') {
+			out << '\\' << c;
+		} else if (c == '\n') {
+			out << "\\n";
+		} else if (c == '\t') {
+			out << "\\t";
+		} else if (c == '\r') {
+			out << "\\r";
+		} else {
+			const char escape[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+			out.write(escape, sizeof escape);
+		}
+		i++;
+		run = i;
+	}
+	out.write(str + run, len - run);
 
-	return cout;
+	out << '"';
+}
+
+static void build_json_prefix(ostream &out, const context& ctx, bool) {
+	out << "{\"file\":";
+	write_json_string(out, ctx.filename.data(), ctx.filename.size());
+	out << ",\"page\":" << ctx.pagenum << ",\"label\":";
+	write_json_string(out, ctx.page_label.data(), ctx.page_label.size());
+}
+
+// The same for the beginning of the JSON records, see build_json_prefix()
+static thread_local PrefixCache json_prefix_cache;
+
+void print_json_match(const context& context, const match& match) {
+	string_view str = match.string;
+
+	// An empty match can be on the newline at the end of its line, so the
+	// line starts after the newline before the match
+	auto line_start = match.start == 0 ? string::npos : context.lines->rfind(match.start - 1);
+	line_start = line_start == string::npos ? 0 : line_start + 1;
+	// Matches can span lines. The record has all of them.
+	auto line_end = context.lines->find(match.end);
+	if (line_end == string::npos) {
+		line_end = str.size();
+	}
+
+	ostream &out = ::out();
+	out << cached_prefix(json_prefix_cache, context, false, build_json_prefix)
+	    << ",\"start\":" << match.start << ",\"end\":" << match.end
+	    << ",\"match\":";
+	write_json_string(out, str.data() + match.start, match.end - match.start);
+	out << ",\"line_start\":" << line_start << ",\"line\":";
+	write_json_string(out, str.data() + line_start, line_end - line_start);
+	out << "}\n";
 }
 
 
 // Invariant: matches can't be empty
-void print_matches(const context& context, const std::vector<match>& matches) {
+void print_matches(const context& context, const std::pmr::vector<match>& matches) {
 	const match& first_match = matches.front();
 	const match& last_match = matches.back();
 
-	auto str = first_match.string;
+	string_view str = first_match.string;
 
-	auto a = str.rfind('\n', first_match.start);
-	auto b = str.find('\n', last_match.end);
+	auto a = context.lines->rfind(first_match.start);
+	auto b = context.lines->find(last_match.end);
 
 	// If a == -1, a gets 0 (beginning of string) and if it's a valid index
 	// to a newline, it now points to the character after that.
@@ -166,17 +459,17 @@ void print_matches(const context& context, const std::vector<match>& matches) {
 		// This can happen if the first match is empty (empty pattern)
 		// and first_match.start is on a newline character.
 		if (previous_end <= match.start) {
-			cout << substr(str, previous_end, match.start);
+			out() << substr(str, previous_end, match.start);
 		}
 
-		cout << color(context.out.color, context.out.colors.highlight)
-		     << substr(str, match.start, match.end)
+		out() << color(context.out.color, context.out.colors.highlight)
+		      << substr(str, match.start, match.end)
 		     << nocolor;
 
 		previous_end = match.end;
 	}
 
-	cout << substr(str, previous_end, b) << endl;
+	out() << substr(str, previous_end, b) << '\n';
 }
 
 void print_context_before(const context& context, const match& match, int lines) {
@@ -188,26 +481,29 @@ void print_context_before(const context& context, const match& match, int lines)
 		lines = context.out.context_before;
 	}
 
-	auto str = match.string;
-	auto line_begin = str.rfind('\n', match.start);
+	string_view str = match.string;
+	const LineIndex &index = *context.lines;
+	auto line_begin = index.rfind(match.start);
 
 	// we are at the first line
 	if (line_begin == string::npos) {
 		return;
 	}
 
-	vector<string> lines_to_output;
+	// Go back to the start of the first line to print
+	size_t start = 0;
+	int count = 0;
 
 	auto pos = line_begin;
-	while (lines --> 0) {
+	while (count < lines) {
+		count++;
 		if (pos == 0) {
-			lines_to_output.emplace_back("");
+			start = 0;
 			break;
 		}
-		auto newpos = str.rfind('\n', pos-1);
+		auto newpos = index.rfind(pos-1);
 
-		auto start_pos = newpos == string::npos ? 0 : newpos + 1;
-		lines_to_output.push_back(str.substr(start_pos, pos-start_pos));
+		start = newpos == string::npos ? 0 : newpos + 1;
 
 		if (newpos == string::npos) {
 			break;
@@ -216,8 +512,11 @@ void print_context_before(const context& context, const match& match, int lines)
 		pos = newpos;
 	}
 
-	for (auto l = lines_to_output.rbegin(); l != lines_to_output.rend(); ++l) {
-		line_prefix(context, true) << *l << endl;
+	// All of these lines end with a newline
+	for (int i = 0; i < count; i++) {
+		auto end = index.find(start);
+		line_prefix(context, true) << substr(str, start, end) << '\n';
+		start = end + 1;
 	}
 }
 
@@ -230,8 +529,9 @@ void print_context_after(const context& context, const match& match, int lines)
 		lines = context.out.context_after;
 	}
 
-	auto str = match.string;
-	auto line_end = str.find('\n', match.end);
+	string_view str = match.string;
+	const LineIndex &index = *context.lines;
+	auto line_end = index.find(match.end);
 
 	// we are at the first line
 	if (line_end == string::npos) {
@@ -243,10 +543,10 @@ void print_context_after(const context& context, const match& match, int lines)
 		if (pos == str.size()-1) {
 			break;
 		}
-		auto newpos = str.find('\n', pos+1);
+		auto newpos = index.find(pos+1);
 
 		auto end_pos = newpos == string::npos ? str.size() : newpos;
-		line_prefix(context, true) << str.substr(pos+1, end_pos-pos-1) << endl;
+		line_prefix(context, true) << substr(str, pos+1, end_pos) << '\n';
 
 		if (newpos == string::npos) {
 			break;
@@ -262,17 +562,17 @@ void print_context_between(const context& context, const match& match1, const ma
 		return;
 	}
 
-	auto str = match1.string;
+	const LineIndex &index = *context.lines;
 
-	auto pos_right = str.find('\n', match1.end);
-	auto pos_left = str.rfind('\n', match2.start);
+	auto pos_right = index.find(match1.end);
+	auto pos_left = index.rfind(match2.start);
 
 	// count the lines that we have to the right of match1
 	int lines_right = 0;
 	while (pos_right != string::npos && lines_right < context.out.context_after
 		&& pos_right < pos_left) {
 		lines_right++;
-		pos_right = str.find('\n', pos_right+1);
+		pos_right = index.find(pos_right+1);
 	}
 
 	// count the lines that we have to the left of match2
@@ -284,7 +584,7 @@ void print_context_between(const context& context, const match& match1, const ma
 			pos_left = string::npos;
 			break;
 		}
-		pos_left = str.rfind('\n', pos_left-1);
+		pos_left = index.rfind(pos_left-1);
 	}
 
 	print_context_after(context, match1, lines_right);
@@ -294,10 +594,10 @@ void print_context_between(const context& context, const match& match1, const ma
 	print_context_before(context, match2, lines_left);
 }
 
-void print_context_separator(const Outconf &out) {
+void print_context_separator(const Outconf &outconf) {
 	// TODO Add color here
 
-	if (out.context_mode) {
-		cout << "--" << endl;
+	if (outconf.context_mode) {
+		out() << "--\n";
 	}
 }
@@ -23,18 +23,27 @@
 
 #include <sys/types.h>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <memory_resource>
 #include "pdfgrep.h"
+#include "lineindex.h"
 
 struct context {
 	const std::string& filename;
 	size_t pagenum;
-	std::string page_label;
+	std::string_view page_label;
 
 	const Outconf& out;
+
+	// the newlines of the page's text, for printing matches and context.
+	// nullptr if there is no page.
+	const LineIndex *lines;
 };
 
 struct match {
-	const std::string string;
+	// the text of the page
+	std::string_view string;
 	size_t start;
 	size_t end;
 };
@@ -47,7 +56,11 @@ void print_only_match(const struct context &context, const struct match &match);
  * 'matches' must not be empty and all entries must begin and end in the same
  * line.
  */
-void print_matches(const context& context, const std::vector<match>& matches);
+void print_matches(const context& context, const std::pmr::vector<match>& matches);
+
+/* print a match as a JSON object on a line of its own (--json). It has the
+ * byte offsets of the match in the page text and the line(s) that contain it. */
+void print_json_match(const context& context, const match& match);
 
 /* print the filename, useful for --files-{with-match,without-matches} */
 void print_only_filename(const Outconf& outconf, const std::string& filename);
@@ -64,8 +77,32 @@ void print_context_separator(const Outconf &out);
 // C++ interface:
 
 // Print to stderr, with "pdfgrep: " as prefix;
+//
+// Each message is written to stderr as a whole when the stream is flushed
+// (e.g. with endl), so it is safe to call this from multiple threads.
 std::ostream& err();
 
+// Print to stdout (or wherever the current thread's output is redirected to)
+//
+// Output to stdout is buffered until pdfgrep exits, unless it is line
+// buffered.
+std::ostream& out();
+
+// Write each line to stdout as soon as it is complete (--line-buffered)
+void set_line_buffered(bool line_buffered);
+
+// Redirect everything that the current thread prints with out() and err() to
+// the given streams. nullptr restores stdout or stderr, respectively.
+void redirect_output(std::ostream *out, std::ostream *err);
+
+// Write str to stderr without mixing it with messages from other threads
+void write_stderr(const std::string &str);
+
+// Show `line` at the bottom of the terminal: it is cleared before anything
+// else is written to stderr and drawn again afterwards. An empty line removes
+// it.
+void set_status_line(const std::string &line);
+
 std::ostream& line_prefix(const context& context, bool in_context);
 
 #endif
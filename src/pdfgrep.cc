@@ -35,12 +35,16 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <climits>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
 #include <vector>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <locale>
-#include <gcrypt.h>
+#include <atomic>
 
 #include <cpp/poppler-document.h>
 #include <cpp/poppler-page.h>
@@ -50,6 +54,12 @@
 #ifdef HAVE_UNAC
 #include <unac.h>
 #endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include <memory>
 
@@ -59,12 +69,32 @@
 #include "regengine.h"
 #include "search.h"
 #include "cache.h"
+#include "cacheindex.h"
+#include "cachepack.h"
+#include "compress.h"
 #include "intervals.h"
+#include "jobs.h"
+#include "extract.h"
+#include "pipeline.h"
+#include "walk.h"
+#include "buildcache.h"
+#include "watch.h"
+#include "daemon.h"
+#include "trigram.h"
 
 using namespace std;
 
 /* set this to 1 if any match was found. Used for the exit status */
-bool found_something = false;
+atomic<bool> found_something(false);
+
+/* set if an error occured in one of the files given on the command line */
+static atomic<bool> search_error(false);
+
+/* worker threads for --jobs. nullptr if we search sequentially */
+static unique_ptr<JobPool> job_pool;
+
+/* the stages of --pipeline. nullptr if it isn't used */
+static unique_ptr<Pipeline> pipeline;
 
 
 // Options
@@ -82,6 +112,19 @@ enum {
 	CACHE_OPTION,
 	PAGE_RANGE_OPTION,
 	PAGENUM_OPTION,
+	PAGE_JOBS_OPTION,
+	PIPELINE_OPTION,
+	CACHE_HASH_OPTION,
+	CACHE_COMPRESSION_OPTION,
+	CACHE_STATS_OPTION,
+	CACHE_PRUNE_OPTION,
+	CACHE_STORE_OPTION,
+	BUILD_CACHE_OPTION,
+	WATCH_OPTION,
+	DAEMON_OPTION,
+	CLIENT_OPTION,
+	LINE_BUFFERED_OPTION,
+	JSON_OPTION,
 };
 
 struct option long_options[] =
@@ -107,11 +150,22 @@ struct option long_options[] =
 	{"debug", no_argument, nullptr, DEBUG_OPTION},
 	{"only-matching", no_argument, nullptr, 'o'},
 	{"null", no_argument, nullptr, 'Z'},
+	{"line-buffered", no_argument, nullptr, LINE_BUFFERED_OPTION},
+	{"json", no_argument, nullptr, JSON_OPTION},
 	{"match-prefix-separator", required_argument, nullptr, PREFIX_SEP_OPTION},
 	{"warn-empty", no_argument, nullptr, WARN_EMPTY_OPTION},
 	{"unac", no_argument, nullptr, UNAC_OPTION},
 	{"fixed-strings", no_argument, nullptr, 'F'},
 	{"cache", no_argument, nullptr, CACHE_OPTION},
+	{"cache-hash", required_argument, nullptr, CACHE_HASH_OPTION},
+	{"cache-compression", required_argument, nullptr, CACHE_COMPRESSION_OPTION},
+	{"cache-stats", no_argument, nullptr, CACHE_STATS_OPTION},
+	{"cache-prune", no_argument, nullptr, CACHE_PRUNE_OPTION},
+	{"cache-store", required_argument, nullptr, CACHE_STORE_OPTION},
+	{"build-cache", no_argument, nullptr, BUILD_CACHE_OPTION},
+	{"watch", no_argument, nullptr, WATCH_OPTION},
+	{"daemon", no_argument, nullptr, DAEMON_OPTION},
+	{"client", no_argument, nullptr, CLIENT_OPTION},
 	{"after-context", required_argument, nullptr, 'A'},
 	{"before-context", required_argument, nullptr, 'B'},
 	{"context", required_argument, nullptr, 'C'},
@@ -120,29 +174,12 @@ struct option long_options[] =
 	{"file", required_argument, nullptr, 'f'},
 	{"files-with-matches", no_argument, nullptr, 'l'},
 	{"files-without-match", no_argument, nullptr, 'L'},
+	{"jobs", required_argument, nullptr, 'j'},
+	{"page-jobs", required_argument, nullptr, PAGE_JOBS_OPTION},
+	{"pipeline", required_argument, nullptr, PIPELINE_OPTION},
 	{nullptr, 0, nullptr, 0}
 };
 
-#ifdef HAVE_UNAC
-/* convenience layer over libunac. */
-string simple_unac(const Options &opts, const string str)
-{
-	if (!opts.use_unac) {
-		return str;
-	}
-
-	char *res = NULL;
-	size_t reslen = 0;
-
-	if (unac_string("UTF-8", str.c_str(), str.size(), &res, &reslen) != 0) {
-		perror("pdfgrep: Failed to remove accents: ");
-		return str;
-	}
-
-	return res;
-}
-#endif
-
 /* parses a color pair like "foo=bar" to "foo" and "bar" */
 static void parse_env_color_pair(char* pair, char** name, char** value)
 {
@@ -249,7 +286,19 @@ static void print_help(char *self)
 	     << " -q, --quiet                    Suppress normal output" << endl
 	     << " -r, --recursive                Search directories recursively" << endl
 	     << " -R, --dereference-recursive    Likewise, but follow all symlinks" << endl
+	     << " -j, --jobs NUM                 Search NUM files in parallel" << endl
+	     << "     --page-jobs NUM            Extract NUM pages of a file in parallel" << endl
+	     << "     --pipeline L,E,M           Search in a pipeline with L loading, E extracting" << endl
+	     << "                                and M matching threads" << endl
+	     << "     --json                     Print each match as a JSON object" << endl
 	     << "     --cache                    Use cache for faster operation" << endl
+	     << "     --build-cache              Put all pages of each FILE into the cache" << endl
+	     << "                                without searching" << endl
+	     << "     --watch                    Build the cache of the PDFs in each directory" << endl
+	     << "                                and keep it current" << endl
+	     << "     --daemon                   Answer the searches of --client, keeping" << endl
+	     << "                                their state in memory" << endl
+	     << "     --client                   Let a running daemon do the search" << endl
 	     << "     --help                     Print this help" << endl
 	     << " -V, --version                  Show version information" << endl << endl
 	     << "The above list is only a selection of commonly used options. Please refer" << endl
@@ -268,6 +317,12 @@ static void print_version()
 	pcre2_config(PCRE2_CONFIG_VERSION, pcre_version.get());
 	cout << "Using libpcre2 version " << pcre_version.get() << endl;
 #endif
+#ifdef HAVE_LZ4
+	cout << "Using liblz4 version " << LZ4_versionString() << endl;
+#endif
+#ifdef HAVE_ZSTD
+	cout << "Using libzstd version " << ZSTD_versionString() << endl;
+#endif
 #ifdef PDFGREP_GIT_HEAD
 	cout << "Built from git-commit " << PDFGREP_GIT_HEAD << endl;
 #endif
@@ -280,19 +335,6 @@ static bool is_dir(const string &filename)
 	return stat(filename.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
 }
 
-static int sha1_file(const std::string &filename, unsigned char *sha1out)
-{
-	std::ifstream file(filename);
-	std::stringstream content;
-	if (!(content << file.rdbuf())) {
-		return -1;
-	}
-	std::string str(content.str());
-
-	gcry_md_hash_buffer( GCRY_MD_SHA1, sha1out, str.c_str(), str.size());
-	return 0;
-}
-
 /** Perform search in `path`
  *
  * - filename is the basename of the file without the directory part
@@ -308,124 +350,285 @@ static int do_search_in_document(const Options &opts, const string &path, const
 	}
 
 	unique_ptr<Cache> cache;
+	IntervalContainer pages = opts.page_range;
 
 	if (opts.use_cache) {
-		unsigned char sha1sum[20];
-		std::string cache_file(opts.cache_directory);
-		if (sha1_file(path, sha1sum) != 0) {
+		std::string cache_file;
+		if (cache_file_name(opts.cache_directory, path, opts.cache_hash, cache_file) != 0) {
 			err() << "Could not compute checksum for " << path << endl;
 			return 1;
 		}
-		char translate[] = "0123456789abcdef";
-		for (unsigned char c : sha1sum) {
-			cache_file += translate[c & 0xf];
-			cache_file += translate[(c >> 4 ) & 0xf];
+
+		// Pages without the trigrams of the pattern can't match
+		if (opts.trigram_index != nullptr
+		    && !opts.trigram_index->select_pages(cache_file, opts.page_range, pages)) {
+			DocumentReport(opts, path).finish();
+			return 0;
 		}
 
-		cache = make_unique<Cache>(cache_file);
+		cache = open_cache(opts, cache_file);
 	}
 
+	// If all pages are cached, the PDF doesn't have to be parsed at all
 	unique_ptr<poppler::document> doc;
-
-	if (opts.passwords.empty()) {
-		err() << "Internal error, password vector empty!" << endl;
-		abort();
-	}
-
-	for (string const &password : opts.passwords) {
-		// FIXME This logic doesn't seem to make sens. What if only the
-		// first password is correct?
-		doc = unique_ptr<poppler::document>(
-			poppler::document::load_from_file(path, string(password),
-							  string(password))
-			);
-	}
-
-	if (doc == nullptr || doc->is_locked()) {
-		err() << "Could not open " << path.c_str() << endl;
-		return 1;
+	if (!opts.use_cache || !cache->is_complete(pages)) {
+		doc = open_document(opts, path);
+		if (doc == nullptr) {
+			err() << "Could not open " << path.c_str() << endl;
+			return 1;
+		}
 	}
 
-	int matches = search_document(opts, std::move(doc), std::move(cache), path, re);
+	int matches = search_document(opts, std::move(doc), std::move(cache), path, re, pages);
 	if (matches > 0) {
 		found_something = true;
 		if (opts.quiet) {
-			exit(EXIT_SUCCESS); // FIXME: Handle this with return value
+			if (job_pool) {
+				// We can't exit from a worker thread. main() does
+				// that as soon as the running jobs are done.
+				job_pool->stop();
+			} else {
+				exit(EXIT_SUCCESS); // FIXME: Handle this with return value
+			}
 		}
 	}
 
 	return 0;
 }
 
-static int do_search_in_directory(const Options &opts, const string &filename, Regengine &re)
+/* Search `path` right away or, with --jobs or --pipeline, queue it for the
+ * worker threads.
+ *
+ * If `report_error` is true, errors are remembered in `search_error`.
+ */
+static void queue_search_in_document(const Options &opts, const string &path,
+                                     const string &filename, Regengine &re,
+                                     bool check_excludes, bool report_error)
 {
-	DIR *ptrDir = nullptr;
-
-	ptrDir = opendir(filename.c_str());
-	if (ptrDir == nullptr) {
-		err() << filename.c_str() << ": " << strerror(errno) << endl;
-		return 1;
+	if (pipeline) {
+		pipeline->add(path, filename, check_excludes, report_error);
+		return;
 	}
 
-	while(true) {
-		string path(filename);
-		errno = 0;
-		struct dirent *ptrDirent = readdir(ptrDir);    //not sorted, in order as `ls -f`
-		if (ptrDirent == nullptr) {
-			break;
+	if (!job_pool) {
+		if (do_search_in_document(opts, path, filename, re, check_excludes) != 0
+		    && report_error) {
+			search_error = true;
 		}
+		return;
+	}
 
-		if (strcmp(ptrDirent->d_name, ".") == 0 || strcmp(ptrDirent->d_name, "..") == 0) {
-			continue;
+	job_pool->add([&opts, path, filename, &re, check_excludes, report_error] {
+		if (do_search_in_document(opts, path, filename, re, check_excludes) != 0
+		    && report_error) {
+			search_error = true;
 		}
+	});
+}
 
-		path += "/";
-		path += ptrDirent->d_name;
+static int do_search_in_directory(const Options &opts, const string &filename, Regengine &re)
+{
+	// The directories are read by as many threads as files are searched
+	unsigned threads = max(opts.jobs, opts.pipeline_load);
 
-		struct stat st;
-		int statret;
+	DirWalker walker(opts, threads, [&](const string &path, const string &name) {
+		queue_search_in_document(opts, path, name, re, true, false);
+	});
 
-		if (opts.recursive == Recursion::FOLLOW_SYMLINKS) {
-			statret = stat(path.c_str(), &st);
-		} else {
-			statret = lstat(path.c_str(), &st);
-		}
+	return walker.walk(filename);
+}
 
-		if (statret != 0) {
-			err() << filename.c_str() << ": " << strerror(errno) << endl;
-			continue;
-		}
+static bool parse_int(const char *str, int *i)
+{
+	char *endptr;
+	errno = 0;
+	unsigned long int d = strtoul(str, &endptr, 10);
+	if (errno != 0 || (long)d > INT_MAX || (long)d < INT_MIN
+	    || *endptr != '\0') {
+		return false;
+	}
+
+	*i = d;
+	return true;
+}
 
-		if (S_ISLNK(st.st_mode)) {
-			continue;
+/* Parse the argument of --pipeline: the number of threads for the load,
+ * extract and match stages, separated by commas. 0 means one thread per CPU.
+ */
+static bool parse_pipeline(const char *str, Options &opts)
+{
+	int *stages[] = { &opts.pipeline_load, &opts.pipeline_extract, &opts.pipeline_match };
+	string arg(str);
+	size_t start = 0;
+
+	for (size_t i = 0; i < 3; i++) {
+		size_t end = arg.find(',', start);
+		if ((end == string::npos) != (i == 2)) {
+			return false;
 		}
 
-		if (S_ISDIR(st.st_mode)) {
-			do_search_in_directory(opts, path, re);
-		} else {
-			do_search_in_document(opts, path, ptrDirent->d_name, re);
+		string num = arg.substr(start, end == string::npos ? string::npos : end - start);
+		if (num.empty() || !parse_int(num.c_str(), stages[i]) || *stages[i] < 0) {
+			return false;
+		}
+		if (*stages[i] == 0) {
+			*stages[i] = JobPool::hardware_threads();
 		}
-	}
 
-	closedir(ptrDir);
+		start = end + 1;
+	}
 
-	return 0;
+	return true;
 }
 
-static bool parse_int(const char *str, int *i)
+/* Parse a size in bytes with an optional suffix K, M, G or T (powers of
+ * 1024) */
+static bool parse_size(const char *str, uint64_t &size)
 {
 	char *endptr;
 	errno = 0;
-	unsigned long int d = strtoul(str, &endptr, 10);
-	if (errno != 0 || (long)d > INT_MAX || (long)d < INT_MIN
-	    || *endptr != '\0') {
+	unsigned long long n = strtoull(str, &endptr, 10);
+	if (errno != 0 || endptr == str) {
 		return false;
 	}
 
-	*i = d;
+	const char *suffixes = "KMGT";
+	int shift = 0;
+	if (*endptr != '\0') {
+		const char *suffix = strchr(suffixes, toupper(*endptr));
+		if (suffix == nullptr || endptr[1] != '\0') {
+			return false;
+		}
+		shift = 10 * (suffix - suffixes + 1);
+	}
+
+	if (n > (UINT64_MAX >> shift)) {
+		return false;
+	}
+	size = static_cast<uint64_t>(n) << shift;
 	return true;
 }
 
+static string format_size(uint64_t size)
+{
+	const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+	double value = size;
+	size_t unit = 0;
+	while (value >= 1024 && unit < 4) {
+		value /= 1024;
+		unit++;
+	}
+
+	ostringstream str;
+	str << fixed << setprecision(unit == 0 ? 0 : 1) << value << ' ' << units[unit];
+	return str.str();
+}
+
+static string format_time(time_t t)
+{
+	char buf[64];
+	struct tm tm;
+	if (localtime_r(&t, &tm) == nullptr || strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &tm) == 0) {
+		return "?";
+	}
+	return buf;
+}
+
+// Default for PDFGREP_CACHE_SIZE
+static const uint64_t DEFAULT_CACHE_SIZE = uint64_t(1) << 30;
+
+/* The limits of the cache from the environment: PDFGREP_CACHE_SIZE is the
+ * total size, PDFGREP_CACHE_LIMIT the number of entries. */
+static CacheBudget get_cache_budget()
+{
+	CacheBudget budget;
+	budget.bytes = DEFAULT_CACHE_SIZE;
+
+	const char *size = getenv("PDFGREP_CACHE_SIZE");
+	if (size != nullptr && !parse_size(size, budget.bytes)) {
+		err() << "warning: Invalid PDFGREP_CACHE_SIZE '" << size << "'."
+		      << " Using " << format_size(DEFAULT_CACHE_SIZE) << "." << endl;
+		budget.bytes = DEFAULT_CACHE_SIZE;
+	}
+
+	const char *limit = getenv("PDFGREP_CACHE_LIMIT");
+	if (limit != nullptr) {
+		budget.entries = strtoul(limit, nullptr, 10);
+	}
+
+	return budget;
+}
+
+/* Exit with `status`. Old cache entries are removed in a thread while we
+ * search, which is stopped first, so that pdfgrep doesn't wait for it. A later
+ * run removes whatever is left. */
+[[noreturn]] static void quit(int status)
+{
+	stop_cache_pruning();
+	stop_pack_compaction();
+	exit(status);
+}
+
+enum class CacheCommand {
+	NONE,
+	STATS,
+	PRUNE
+};
+
+/* Run --cache-stats or --cache-prune. Returns the exit status. */
+static int run_cache_command(CacheCommand command, CacheStore store)
+{
+	string directory;
+	if (find_cache_directory(directory) != 0) {
+		err() << "Failed to initialize cache directory." << endl;
+		return EXIT_ERROR;
+	}
+
+	CacheBudget budget = get_cache_budget();
+	bool use_pack = store == CacheStore::PACK;
+
+	if (command == CacheCommand::PRUNE) {
+		PruneResult result = use_pack ? get_cache_pack(directory).compact(budget)
+		                              : get_cache_index(directory).prune(budget);
+		prune_manifest(directory);
+		cout << "Removed " << result.removed << " entries ("
+		     << format_size(result.removed_bytes) << "), "
+		     << result.entries << " entries (" << format_size(result.bytes)
+		     << ") left" << endl;
+		return EXIT_SUCCESS;
+	}
+
+	CacheStats stats = use_pack ? get_cache_pack(directory).stats()
+	                            : get_cache_index(directory).stats();
+	cout << "Cache directory: " << directory << endl
+	     << "Entries:         " << stats.entries;
+	if (budget.entries > 0) {
+		cout << " of " << budget.entries;
+	}
+	cout << endl
+	     << "Size:            " << format_size(stats.bytes)
+	     << " of " << format_size(budget.bytes) << endl;
+	if (stats.entries > 0) {
+		cout << "Least recent:    " << format_time(stats.oldest) << endl
+		     << "Most recent:     " << format_time(stats.newest) << endl;
+	}
+	if (use_pack) {
+		cout << "Pack file:       " << format_size(stats.pack_bytes) << endl
+		     << "Unindexed:       " << stats.records << endl;
+	} else {
+		cout << "Index records:   " << stats.records << endl;
+	}
+
+	TrigramIndex trigram_index(directory);
+	if (trigram_index.is_open()) {
+		TrigramIndexStats trigrams = trigram_index.stats();
+		cout << "Trigram index:   " << trigrams.documents << " files, "
+		     << trigrams.pages << " pages, " << trigrams.trigrams << " trigrams ("
+		     << format_size(trigrams.bytes) << ")" << endl;
+	}
+	return EXIT_SUCCESS;
+}
+
 bool read_pattern_file(string const &filename, vector<string> &patterns)
 {
 	ifstream file(filename);
@@ -458,11 +661,17 @@ static void handle_poppler_errors(const string &msg, void *_opts)
 }
 #endif
 
-int main(int argc, char** argv)
+/* The whole of pdfgrep, which the children of --daemon run for each request.
+ * Exits instead of returning most of the time. */
+static int pdfgrep(int argc, char** argv, bool in_daemon)
 {
 	Options options;
 	set_default_colors(options.outconf.colors);
 
+	// The arguments are forwarded to the daemon with --client, before
+	// getopt_long() reorders them
+	vector<string> args(argv, argv + argc);
+
 	try {
 		// Set locale to user-preference. If this locale is an UTF-8 locale, the
 		// regex-functions regcomp/regexec become unicode aware, which means
@@ -485,6 +694,7 @@ int main(int argc, char** argv)
 
 	// either -H or -h was set
 	bool explicit_filename_option = false;
+	bool line_buffered = false;
 
 	enum {
 		COLOR_ALWAYS,
@@ -495,9 +705,16 @@ int main(int argc, char** argv)
 	// patterns specified with --regex or --file
 	vector<string> patterns;
 	bool patterns_specified = false;
+	CacheCommand cache_command = CacheCommand::NONE;
+	// --build-cache or --watch was given
+	bool build = false;
+	bool watch = false;
+	bool daemon = false;
+	bool client = false;
+	bool jobs_specified = false;
 
 	while (true) {
-		int c = getopt_long(argc, argv, "icA:B:C:nrRhHVPpqm:FoZe:f:lL",
+		int c = getopt_long(argc, argv, "icA:B:C:nrRhHVPpqm:FoZe:f:lLj:",
 				long_options, nullptr);
 
 		if (c == -1) {
@@ -617,6 +834,76 @@ int main(int argc, char** argv)
 				options.use_cache = true;
 				break;
 
+			case CACHE_HASH_OPTION:
+				if (strcmp(optarg, "sha1") == 0) {
+					options.cache_hash = CacheHash::SHA1;
+				} else if (strcmp(optarg, "xxh64") == 0) {
+					options.cache_hash = CacheHash::XXH64;
+				} else {
+					err() << "Invalid argument '" << optarg << "' for --cache-hash. "
+					      << "Candidates are: sha1 or xxh64" << endl;
+					exit(EXIT_ERROR);
+				}
+				break;
+
+			case CACHE_STATS_OPTION:
+				cache_command = CacheCommand::STATS;
+				break;
+
+			case CACHE_PRUNE_OPTION:
+				cache_command = CacheCommand::PRUNE;
+				break;
+
+			case BUILD_CACHE_OPTION:
+				build = true;
+				options.use_cache = true;
+				break;
+
+			case WATCH_OPTION:
+				build = true;
+				watch = true;
+				options.use_cache = true;
+				break;
+
+			case DAEMON_OPTION:
+				daemon = true;
+				break;
+
+			case CLIENT_OPTION:
+				client = true;
+				break;
+
+			case CACHE_STORE_OPTION:
+				if (strcmp(optarg, "files") == 0) {
+					options.cache_store = CacheStore::FILES;
+				} else if (strcmp(optarg, "pack") == 0) {
+					options.cache_store = CacheStore::PACK;
+				} else {
+					err() << "Invalid argument '" << optarg << "' for --cache-store. "
+					      << "Candidates are: files or pack" << endl;
+					exit(EXIT_ERROR);
+				}
+				break;
+
+			case CACHE_COMPRESSION_OPTION:
+				if (strcmp(optarg, "none") == 0) {
+					options.cache_compression = CacheCompression::NONE;
+				} else if (strcmp(optarg, "lz4") == 0) {
+					options.cache_compression = CacheCompression::LZ4;
+				} else if (strcmp(optarg, "zstd") == 0) {
+					options.cache_compression = CacheCompression::ZSTD;
+				} else {
+					err() << "Invalid argument '" << optarg << "' for --cache-compression. "
+					      << "Candidates are: none, lz4 or zstd" << endl;
+					exit(EXIT_ERROR);
+				}
+				if (!compression_supported(options.cache_compression)) {
+					err() << compression_name(options.cache_compression)
+					      << " support disabled at compile time!" << endl;
+					exit(EXIT_ERROR);
+				}
+				break;
+
 			case 'o':
 				options.outconf.only_matching = true;
 				break;
@@ -633,6 +920,14 @@ int main(int argc, char** argv)
 				options.warn_empty = true;
 				break;
 
+			case LINE_BUFFERED_OPTION:
+				line_buffered = true;
+				break;
+
+			case JSON_OPTION:
+				options.outconf.json = true;
+				break;
+
 			case 'A':
 				if (!parse_int(optarg, &options.outconf.context_after)) {
 					err() << "Could not parse number: " << optarg << "." << endl;
@@ -691,6 +986,39 @@ int main(int argc, char** argv)
 				options.only_filenames = OnlyFilenames::WITHOUT_MATCH;
 				break;
 
+			case 'j':
+				jobs_specified = true;
+				if (!parse_int(optarg, &options.jobs)) {
+					err() << "Could not parse number: " << optarg << "." << endl;
+					exit(EXIT_ERROR);
+				} else if (options.jobs < 0) {
+					err() << "--jobs must be positive." << endl;
+					exit(EXIT_ERROR);
+				} else if (options.jobs == 0) {
+					options.jobs = JobPool::hardware_threads();
+				}
+				break;
+
+			case PAGE_JOBS_OPTION:
+				if (!parse_int(optarg, &options.page_jobs)) {
+					err() << "Could not parse number: " << optarg << "." << endl;
+					exit(EXIT_ERROR);
+				} else if (options.page_jobs < 0) {
+					err() << "--page-jobs must be positive." << endl;
+					exit(EXIT_ERROR);
+				} else if (options.page_jobs == 0) {
+					options.page_jobs = JobPool::hardware_threads();
+				}
+				break;
+
+			case PIPELINE_OPTION:
+				if (!parse_pipeline(optarg, options)) {
+					err() << "Invalid argument for --pipeline: " << optarg
+					      << ". Expected LOAD,EXTRACT,MATCH." << endl;
+					exit(EXIT_ERROR);
+				}
+				break;
+
 			/* In these two cases, getopt already prints an
 			 * error message
 			 */
@@ -703,9 +1031,55 @@ int main(int argc, char** argv)
 		}
 	}
 
+	// A request of a client may still contain --client, e.g. abbreviated
+	// as --cli. It is already running in the daemon.
+	if (in_daemon) {
+		daemon = false;
+		client = false;
+	}
+
+	if (daemon && client) {
+		err() << "--daemon and --client cannot be used together" << endl;
+		exit(EXIT_ERROR);
+	}
+
+	// The daemon and its clients find each other in the cache directory
+	if (daemon || client) {
+		if (find_cache_directory(options.cache_directory) != 0) {
+			err() << "Failed to initialize cache directory." << endl;
+			exit(EXIT_ERROR);
+		}
+	}
+
+	if (daemon) {
+		exit(run_daemon(options, pdfgrep));
+	}
+
+	if (client) {
+		// Everything up to "--" may be an option
+		auto end = find(args.begin() + 1, args.end(), "--");
+		args.erase(remove(args.begin() + 1, end, "--client"), end);
+
+		int status = run_client(options, args);
+		if (status >= 0) {
+			exit(status);
+		}
+		// Without a daemon, we search ourselves
+	}
+
+	// These don't search anything
+	if (cache_command != CacheCommand::NONE) {
+		exit(run_cache_command(cache_command, options.cache_store));
+	}
+
+	// --watch always watches whole directory trees
+	if (watch && options.recursive == Recursion::NONE) {
+		options.recursive = Recursion::DONT_FOLLOW_SYMLINKS;
+	}
+
 	int remaining_args = argc - optind;
 	int required_args = 0;
-	if (!patterns_specified) {
+	if (!patterns_specified && !build) {
 		required_args++;
 	}
 	if (options.recursive == Recursion::NONE) {
@@ -742,14 +1116,25 @@ int main(int argc, char** argv)
 		return make_unique<PosixRegex>(new_pattern, options.ignore_case);
 	};
 
-	if (patterns.empty()) {
-		re = make_regengine(argv[optind++]);
-	} else {
-		auto patt_list = std::make_unique<PatternList>();
-		for (auto const &p : patterns) {
-			patt_list->add_pattern(make_regengine(p));
+	try {
+		if (build) {
+			// --build-cache has no pattern
+		} else if (patterns.empty()) {
+			re = make_regengine(argv[optind++]);
+		} else {
+			auto patt_list = std::make_unique<PatternList>();
+			for (auto const &p : patterns) {
+				patt_list->add_pattern(make_regengine(p));
+			}
+			re = std::move(patt_list);
 		}
-		re = std::move(patt_list);
+	} catch (const PatternError &e) {
+		istringstream message(e.what());
+		string line;
+		while (getline(message, line)) {
+			err() << line << endl;
+		}
+		exit(EXIT_ERROR);
 	}
 
 #if POPPLER_VERSION_MAJOR > 0 || POPPLER_VERSION_MINOR >= 29
@@ -761,6 +1146,9 @@ int main(int argc, char** argv)
 		&& getenv("TERM") != nullptr
 		&& strcmp(getenv("TERM"), "dumb") != 0;
 
+	// Like stdio, write each line right away to a terminal
+	set_line_buffered(line_buffered || isatty(STDOUT_FILENO) != 0);
+
 	options.outconf.color =
 		use_colors == COLOR_ALWAYS
 		|| (use_colors == COLOR_AUTO && color_tty);
@@ -785,6 +1173,20 @@ int main(int argc, char** argv)
 		options.outconf.context_mode = false;
 	}
 
+	if (options.outconf.json && (options.count || options.pagecount
+				     || options.only_filenames != OnlyFilenames::NOPE)) {
+		err() << "--json can't be used together with --count, --page-count,"
+		      << " --files-with-matches or --files-without-match" << endl;
+		exit(EXIT_ERROR);
+	}
+
+	if (options.outconf.json && options.outconf.context_mode) {
+		err() << "warning: --json and context options can't be used together."
+		      << " Ignoring context option." << endl;
+
+		options.outconf.context_mode = false;
+	}
+
 	if (options.count && options.outconf.pagenum) {
 		err() << "warning: --count and --page-number can't be used together."
 		      << " Ignoring --page-number." << endl;
@@ -807,32 +1209,91 @@ int main(int argc, char** argv)
 
 	if (options.use_cache) {
 		if (find_cache_directory(options.cache_directory) != 0) {
+			if (build) {
+				err() << "Failed to initialize cache directory." << endl;
+				exit(EXIT_ERROR);
+			}
 			err() << "warning: Failed to initialize cache directory."
 			      << " no cache is used!" << endl;
 			options.use_cache = false;
 		} else {
-			char *limitstr = getenv("PDFGREP_CACHE_LIMIT");
-			unsigned int limit = (limitstr != nullptr) ? strtoul(limitstr, nullptr, 10) : 200;
-			limit_cachesize(options.cache_directory.c_str(), limit);
+			// Old entries are removed while we search
+			CacheBudget budget = get_cache_budget();
+			if (options.cache_store == CacheStore::PACK) {
+				CachePack &pack = get_cache_pack(options.cache_directory);
+				if (pack.needs_compaction(budget)) {
+					pack.compact_in_background(budget, [directory = options.cache_directory] {
+						prune_manifest(directory);
+					});
+				}
+			} else {
+				CacheIndex &index = get_cache_index(options.cache_directory);
+				if (index.needs_prune(budget)) {
+					index.prune_in_background(budget, [directory = options.cache_directory] {
+						prune_manifest(directory);
+					});
+				}
+			}
 		}
 	}
 
-	bool error = false;
+	// With a trigram index of the cache, only the pages that contain the
+	// trigrams of the pattern are searched, and the Bloom filters of the
+	// cached pages rule out more of them. Skipped pages would count as
+	// empty for --warn-empty, and --unac changes the text.
+	TrigramQuery query;
+	unique_ptr<TrigramIndex> trigram_index;
+	bool unac = false;
+#ifdef HAVE_UNAC
+	unac = options.use_unac;
+#endif
+	if (options.use_cache && !build && !options.warn_empty && !unac) {
+		query = re->trigram_query();
+		if (options.debug) {
+			err() << "trigram query: " << query.to_string() << endl;
+		}
+		if (!query.is_all()) {
+			options.filter_query = &query;
+		}
+
+		trigram_index = make_unique<TrigramIndex>(options.cache_directory);
+		if (trigram_index->is_open() && trigram_index->set_query(query)) {
+			options.trigram_index = trigram_index.get();
+			if (options.debug) {
+				err() << "trigram index: " << trigram_index->candidate_count()
+				      << " candidate pages" << endl;
+			}
+		}
+	}
+
+	if (build) {
+		// Building the cache is worth all cores by default
+		if (!jobs_specified) {
+			options.jobs = JobPool::hardware_threads();
+		}
+		vector<string> paths(argv + optind, argv + argc);
+		quit(watch ? watch_cache(options, paths) : build_cache(options, paths));
+	}
+
+	if (options.pipeline_load > 0) {
+		// The pipeline has its own threads for everything
+		pipeline = make_unique<Pipeline>(options, *re);
+	} else if (options.jobs > 1) {
+		job_pool = make_unique<JobPool>(options.jobs);
+	}
 
 	for (int i = optind; i < argc; i++) {
 		const string filename(argv[i]);
 
 		if (!is_dir(filename)) {
-			if (do_search_in_document(options, filename, filename, *re, false) != 0) {
-				error = true;
-			}
+			queue_search_in_document(options, filename, filename, *re, false, true);
 		} else if (options.recursive != Recursion::NONE) {
 			if (do_search_in_directory(options, filename, *re) != 0) {
-				error = true;
+				search_error = true;
 			}
 		} else {
 			err() << filename << " is a directory. Did you mean to use '--recursive'?" << endl;
-			error = true;
+			search_error = true;
 		}
 	}
 
@@ -840,13 +1301,50 @@ int main(int argc, char** argv)
 		do_search_in_directory(options, ".", *re);
 	}
 
-	if (error) {
-		exit(EXIT_ERROR);
+	if (pipeline) {
+		pipeline->finish();
+		if (options.debug) {
+			pipeline->print_stats();
+		}
+
+		if (pipeline->had_error()) {
+			search_error = true;
+		}
+		if (pipeline->found_match()) {
+			found_something = true;
+		}
+		pipeline.reset();
+
+		if (options.quiet && found_something) {
+			quit(EXIT_SUCCESS);
+		}
+	}
+
+	if (job_pool) {
+		job_pool->wait();
+		job_pool.reset();
+
+		if (options.quiet && found_something) {
+			quit(EXIT_SUCCESS);
+		}
+	}
+
+	if (options.debug && options.filter_query != nullptr) {
+		print_filter_stats();
+	}
+
+	if (search_error) {
+		quit(EXIT_ERROR);
 	} else if (found_something) {
-		exit(EXIT_SUCCESS);
+		quit(EXIT_SUCCESS);
 	} else {
-		exit(EXIT_NOT_FOUND);
+		quit(EXIT_NOT_FOUND);
 	}
 }
 
+int main(int argc, char** argv)
+{
+	return pdfgrep(argc, argv, false);
+}
+
 /* vim: set noet: */
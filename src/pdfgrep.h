@@ -61,6 +61,8 @@ struct Outconf {
 	bool color = false;
 	bool only_matching = false;
 	bool null_byte_sep = false;
+	// one JSON object per match instead of lines of text
+	bool json = false;
 	std::string prefix_sep = ":";
 
 	// true, if we need to print context separators between lines
@@ -71,12 +73,36 @@ struct Outconf {
 	Colorconf colors;
 };
 
+// checksum that identifies a PDF in the cache
+enum class CacheHash {
+	SHA1,
+	XXH64
+};
+
+// compression of the pages in the cache
+enum class CacheCompression {
+	NONE,
+	LZ4,
+	ZSTD
+};
+
+// where the cache keeps its entries
+enum class CacheStore {
+	// one file per PDF
+	FILES,
+	// all in one pack file
+	PACK
+};
+
 enum class OnlyFilenames {
 	NOPE,
 	WITH_MATCHES,
 	WITHOUT_MATCH
 };
 
+class TrigramIndex;
+struct TrigramQuery;
+
 struct Options {
 	bool ignore_case = false;
 	Recursion recursive = Recursion::NONE;
@@ -96,15 +122,26 @@ struct Options {
 	ExcludeList includes;
 	bool use_cache = false;
 	std::string cache_directory;
+	CacheHash cache_hash = CacheHash::SHA1;
+	CacheCompression cache_compression = CacheCompression::NONE;
+	CacheStore cache_store = CacheStore::FILES;
+	// narrows down the pages to search, nullptr if it isn't used
+	const TrigramIndex *trigram_index = nullptr;
+	// checked against the Bloom filters of cached pages, nullptr if it
+	// can't rule out any page
+	const TrigramQuery *filter_query = nullptr;
 	IntervalContainer page_range;
 	OnlyFilenames only_filenames = OnlyFilenames::NOPE;
+	// number of files to search in parallel
+	int jobs = 1;
+	// number of threads that extract the pages of a single file
+	int page_jobs = 1;
+	// threads per stage of --pipeline. 0 if it isn't used
+	int pipeline_load = 0;
+	int pipeline_extract = 0;
+	int pipeline_match = 0;
 };
 
-#ifdef HAVE_UNAC
-/* convenience layer over libunac */
-std::string simple_unac(const Options &opts, const std::string str);
-#endif
-
 #endif /* PDFGREP_H */
 
 /* Local Variables: */
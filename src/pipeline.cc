@@ -0,0 +1,433 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "pipeline.h"
+#include "cache.h"
+#include "extract.h"
+#include "output.h"
+#include "search.h"
+#include "trigram.h"
+
+#include <iostream>
+
+#include <cpp/poppler-document.h>
+
+using namespace std;
+
+// Capacity of the queues between the stages, per thread of the consuming
+// stage
+static const size_t QUEUE_SIZE_PER_THREAD = 8;
+
+// How many pages of a single document may be extracted, but not yet printed
+static const size_t MAX_PAGES_IN_FLIGHT = 64;
+
+struct PipelineFile {
+	size_t seq;
+	string path;
+	bool report_error;
+};
+
+struct PipelineDoc {
+	size_t seq;
+	string filename;
+	bool report_error;
+
+	// Non-empty if the document couldn't be loaded
+	string error_message;
+
+	// The pages to search. If `skipped` is true, none of them can match
+	// and the document isn't loaded at all.
+	IntervalContainer pages;
+	bool skipped = false;
+
+	// nullptr if all pages are in the cache
+	unique_ptr<poppler::document> doc;
+	unique_ptr<Cache> cache;
+
+	// set by the output stage if the remaining pages aren't needed
+	atomic<bool> cancelled { false };
+
+	// Pages with their matches, numbered in the order of the document
+	ReorderQueue<unique_ptr<PipelinePage>> results;
+
+	// Number of pages pushed by the extract stage but not yet taken by the
+	// output stage. Protected by Pipeline::mutex.
+	size_t in_flight = 0;
+};
+
+struct PipelinePage {
+	// The document of the page, only set between the extract and the
+	// match stage
+	shared_ptr<PipelineDoc> doc;
+
+	// Position of the page in PipelineDoc::results
+	size_t index;
+	// If true, this is not a page but marks the end of the document
+	bool last = false;
+
+	size_t pagenum = 0;
+	// false, if the page couldn't be read
+	bool ok = true;
+	// true if the page passed its Bloom filter, see page_may_match()
+	bool filtered = false;
+	CachePage page;
+
+	// Filled by the match stage. text is page.text or, with --unac, unac.
+	string_view text;
+	string unac;
+	vector<PageMatch> matches;
+};
+
+Pipeline::Pipeline(const Options &opts, const Regengine &re)
+	: opts(opts)
+	, re(re)
+	, files(opts.pipeline_load * QUEUE_SIZE_PER_THREAD)
+	, loaded(opts.pipeline_extract * QUEUE_SIZE_PER_THREAD)
+	, pages(opts.pipeline_match * QUEUE_SIZE_PER_THREAD)
+	, started(opts.pipeline_extract * 2)
+	, stopped(false)
+	, found(false)
+	, error(false)
+{
+	for (int i = 0; i < opts.pipeline_load; i++) {
+		load_threads.emplace_back(&Pipeline::load_stage, this);
+	}
+	for (int i = 0; i < opts.pipeline_extract; i++) {
+		extract_threads.emplace_back(&Pipeline::extract_stage, this);
+	}
+	for (int i = 0; i < opts.pipeline_match; i++) {
+		match_threads.emplace_back(&Pipeline::match_stage, this);
+	}
+	output_thread = thread(&Pipeline::output_stage, this);
+}
+
+Pipeline::~Pipeline()
+{
+	stop();
+	finish();
+}
+
+void Pipeline::add(const string &path, const string &filename,
+                   bool check_excludes, bool report_error)
+{
+	if (stopped) {
+		return;
+	}
+
+	if (check_excludes &&
+	    (!is_excluded(opts.includes, filename) || is_excluded(opts.excludes, filename))) {
+		return;
+	}
+
+	auto file = make_unique<PipelineFile>();
+	file->seq = file_count++;
+	file->path = path;
+	file->report_error = report_error;
+
+	files.push(std::move(file));
+}
+
+void Pipeline::finish()
+{
+	// Each stage is done, once the previous one is done and the queue
+	// in between is empty.
+	files.close();
+	for (auto &t : load_threads) {
+		t.join();
+	}
+	load_threads.clear();
+
+	loaded.close();
+	for (auto &t : extract_threads) {
+		t.join();
+	}
+	extract_threads.clear();
+
+	pages.close();
+	for (auto &t : match_threads) {
+		t.join();
+	}
+	match_threads.clear();
+
+	started.close();
+	if (output_thread.joinable()) {
+		output_thread.join();
+	}
+}
+
+void Pipeline::stop()
+{
+	stopped = true;
+
+	files.abort();
+	loaded.abort();
+	pages.abort();
+	started.abort();
+
+	lock_guard<std::mutex> lock(mutex);
+	if (current_output_doc) {
+		current_output_doc->results.abort();
+	}
+	page_taken.notify_all();
+}
+
+void Pipeline::print_stats()
+{
+	err() << "pipeline: " << opts.pipeline_load << " load, "
+	      << opts.pipeline_extract << " extract and "
+	      << opts.pipeline_match << " match threads" << endl;
+	err() << "pipeline: load queue: " << files.get_stats() << endl;
+	err() << "pipeline: extract queue: " << loaded.get_stats() << endl;
+	err() << "pipeline: match queue: " << pages.get_stats() << endl;
+	err() << "pipeline: output queue: " << result_stats << endl;
+}
+
+void Pipeline::load_stage()
+{
+	unique_ptr<PipelineFile> file;
+
+	while (files.pop(file)) {
+		auto doc = make_shared<PipelineDoc>();
+		doc->seq = file->seq;
+		doc->filename = file->path;
+		doc->report_error = file->report_error;
+		doc->pages = opts.page_range;
+
+		if (opts.use_cache) {
+			string cache_file;
+			if (cache_file_name(opts.cache_directory, file->path, opts.cache_hash,
+			                    cache_file) != 0) {
+				doc->error_message = "Could not compute checksum for " + file->path;
+			} else if (opts.trigram_index != nullptr
+			           && !opts.trigram_index->select_pages(cache_file, opts.page_range,
+			                                                doc->pages)) {
+				doc->skipped = true;
+			} else {
+				doc->cache = open_cache(opts, cache_file);
+			}
+		}
+
+		// If all pages are cached, the PDF doesn't have to be parsed
+		if (doc->error_message.empty() && !doc->skipped
+		    && (!opts.use_cache || !doc->cache->is_complete(doc->pages))) {
+			doc->doc = open_document(opts, file->path);
+			if (!doc->doc) {
+				doc->error_message = "Could not open " + file->path;
+			}
+		}
+
+		size_t seq = doc->seq;
+		if (!loaded.push(seq, std::move(doc))) {
+			return;
+		}
+	}
+}
+
+void Pipeline::extract_stage()
+{
+	shared_ptr<PipelineDoc> doc;
+
+	while (loaded.pop(doc)) {
+		if (!started.push(doc->seq, doc)) {
+			return;
+		}
+
+		extract_document(doc);
+
+		// We don't need the document anymore, but the output stage
+		// still holds a reference to it.
+		doc->doc.reset();
+		doc->cache.reset();
+	}
+}
+
+void Pipeline::extract_document(const shared_ptr<PipelineDoc> &doc)
+{
+	size_t index = 0;
+
+	if (doc->error_message.empty() && !doc->skipped) {
+		size_t doc_pages;
+		if (doc->doc) {
+			doc_pages = static_cast<size_t>(doc->doc->pages());
+			if (opts.use_cache) {
+				doc->cache->set_document_info(doc_pages, doc->doc->is_encrypted());
+			}
+		} else {
+			doc_pages = doc->cache->get_page_count();
+		}
+
+		for (size_t pagenum = 1; pagenum <= doc_pages && !doc->cancelled; pagenum++) {
+			if (!doc->pages.contains(pagenum)) {
+				continue;
+			}
+
+			bool filtered = false;
+			if (opts.use_cache && !page_may_match(opts, *doc->cache, pagenum, filtered)) {
+				continue;
+			}
+
+			auto page = make_unique<PipelinePage>();
+			page->index = index++;
+			page->pagenum = pagenum;
+			page->filtered = filtered;
+
+			// Unlike in search_pages(), the page is copied out of the
+			// cache, because the cache is dumped and closed before
+			// the other stages are done with the page.
+			if (!opts.use_cache || !doc->cache->get_page(pagenum, page->page)) {
+				// See search_document() for a missing doc
+				page->ok = doc->doc && extract_page(*doc->doc, pagenum, page->page);
+
+				if (page->ok && opts.use_cache) {
+					doc->cache->set_page(pagenum, page->page);
+				}
+			}
+
+			if (!push_page(doc, std::move(page))) {
+				break;
+			}
+		}
+
+		// Even if the search stopped early, the pages extracted so far
+		// are kept.
+		if (opts.use_cache) {
+			doc->cache->dump();
+		}
+	}
+
+	if (stopped) {
+		return;
+	}
+
+	auto end = make_unique<PipelinePage>();
+	end->index = index;
+	end->last = true;
+	push_page(doc, std::move(end));
+}
+
+bool Pipeline::push_page(shared_ptr<PipelineDoc> doc, unique_ptr<PipelinePage> page)
+{
+	{
+		unique_lock<std::mutex> lock(mutex);
+		// The end marker doesn't wait, so that the output stage can't
+		// miss the end of a document.
+		page_taken.wait(lock, [&] {
+			return stopped || page->last || doc->in_flight < MAX_PAGES_IN_FLIGHT;
+		});
+		doc->in_flight++;
+	}
+
+	page->doc = std::move(doc);
+	return pages.push(std::move(page));
+}
+
+void Pipeline::match_stage()
+{
+	const size_t limit = match_limit(opts);
+	unique_ptr<PipelinePage> page;
+
+	while (pages.pop(page)) {
+		if (!page->last && page->ok && !page->doc->cancelled) {
+			page->text = maybe_unac(opts, page->page.text, page->unac);
+			find_matches(re, page->text, limit, page->matches);
+			if (page->filtered && page->matches.empty()) {
+				count_filter_false_positive();
+			}
+		}
+
+		// The page must not keep its document alive, once it is in the
+		// document's own queue.
+		shared_ptr<PipelineDoc> doc = std::move(page->doc);
+		size_t index = page->index;
+		doc->results.push(index, std::move(page));
+	}
+}
+
+void Pipeline::output_stage()
+{
+	shared_ptr<PipelineDoc> doc;
+
+	while (started.pop(doc)) {
+		{
+			lock_guard<std::mutex> lock(mutex);
+			current_output_doc = doc;
+		}
+		if (stopped) {
+			return;
+		}
+
+		output_document(*doc);
+
+		lock_guard<std::mutex> lock(mutex);
+		result_stats.add(doc->results.get_stats());
+		current_output_doc.reset();
+	}
+}
+
+void Pipeline::output_document(PipelineDoc &doc)
+{
+	DocumentReport report(opts, doc.filename);
+	unique_ptr<PipelinePage> page;
+
+	while (doc.results.pop(page)) {
+		{
+			lock_guard<std::mutex> lock(mutex);
+			doc.in_flight--;
+			page_taken.notify_all();
+		}
+
+		if (page->last) {
+			break;
+		}
+		if (doc.cancelled) {
+			continue;
+		}
+
+		if (!page->ok) {
+			report.page_error(page->pagenum);
+			continue;
+		}
+
+		if (!report.add_page(page->pagenum, page->page.label, page->text, page->matches)) {
+			// The rest of the document isn't needed
+			doc.cancelled = true;
+		}
+	}
+
+	if (!page || !page->last) {
+		// The pipeline was stopped
+		return;
+	}
+
+	if (!doc.error_message.empty()) {
+		err() << doc.error_message << endl;
+		if (doc.report_error) {
+			error = true;
+		}
+		return;
+	}
+
+	if (report.finish() > 0) {
+		found = true;
+		if (opts.quiet) {
+			stop();
+		}
+	}
+}
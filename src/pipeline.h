@@ -0,0 +1,135 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pdfgrep.h"
+#include "regengine.h"
+#include "queue.h"
+
+struct PipelineFile;
+struct PipelineDoc;
+struct PipelinePage;
+
+/** Searches files in a pipeline of stages with their own threads (--pipeline)
+ *
+ * The stages are:
+ *
+ *  1. load:    compute the cache key, read the cache and open the PDF
+ *  2. extract: extract the text of each page (or get it from the cache)
+ *  3. match:   run the regex engine on each page
+ *  4. output:  print the results (a single thread)
+ *
+ * The stages are connected by bounded queues, so that a fast stage blocks
+ * instead of piling up work in front of a slower one. Documents are extracted
+ * and their results printed in the order in which they were added, so the
+ * output is the same as with a sequential search.
+ */
+class Pipeline {
+public:
+	Pipeline(const Options &opts, const Regengine &re);
+	// Stops all threads, see stop()
+	~Pipeline();
+
+	Pipeline(const Pipeline &) = delete;
+	Pipeline &operator=(const Pipeline &) = delete;
+
+	/* Queue a file. The arguments are the same as for
+	 * do_search_in_document(). If `report_error` is false, errors in this
+	 * file don't count for had_error().
+	 */
+	void add(const std::string &path, const std::string &filename,
+	         bool check_excludes, bool report_error);
+
+	/* Wait until all queued files are searched */
+	void finish();
+
+	/* Stop as soon as possible and drop the remaining work */
+	void stop();
+
+	bool found_match() const { return found; }
+	bool had_error() const { return error; }
+
+	/* Print statistics about the queues between the stages with err() */
+	void print_stats();
+
+private:
+	void load_stage();
+	void extract_stage();
+	void match_stage();
+	void output_stage();
+
+	void extract_document(const std::shared_ptr<PipelineDoc> &doc);
+	// Push a page from the extract to the match stage. Blocks while too many
+	// pages of this document are waiting for the output stage.
+	bool push_page(std::shared_ptr<PipelineDoc> doc, std::unique_ptr<PipelinePage> page);
+	void output_document(PipelineDoc &doc);
+
+	const Options &opts;
+	const Regengine &re;
+
+	// files to load
+	BoundedQueue<std::unique_ptr<PipelineFile>> files;
+	// loaded documents, in order, for the extract stage
+	ReorderQueue<std::shared_ptr<PipelineDoc>> loaded;
+	// extracted pages of all documents
+	BoundedQueue<std::unique_ptr<PipelinePage>> pages;
+	// documents whose extraction has started, in order, for the output
+	// stage
+	ReorderQueue<std::shared_ptr<PipelineDoc>> started;
+
+	// number of files added
+	size_t file_count = 0;
+
+	// Protects PipelineDoc::in_flight of all documents and
+	// current_output_doc
+	std::mutex mutex;
+	// signaled when the output stage takes a page or the pipeline stops
+	std::condition_variable page_taken;
+	// the document the output stage is working on
+	std::shared_ptr<PipelineDoc> current_output_doc;
+
+	// sum of the statistics of all documents' result queues
+	QueueStats result_stats;
+
+	std::atomic<bool> stopped;
+	std::atomic<bool> found;
+	std::atomic<bool> error;
+
+	std::vector<std::thread> load_threads;
+	std::vector<std::thread> extract_threads;
+	std::vector<std::thread> match_threads;
+	std::thread output_thread;
+};
+
+#endif /* PIPELINE_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
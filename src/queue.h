@@ -0,0 +1,239 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <ostream>
+
+// Statistics about the fill level of a queue, used to tune the pipeline
+struct QueueStats {
+	// number of items that went through the queue
+	unsigned long items = 0;
+	// sum of the queue sizes seen by all push() calls
+	unsigned long depth_sum = 0;
+	unsigned long max_depth = 0;
+	// how often a producer had to wait, because the queue was full
+	unsigned long full = 0;
+	// how often a consumer had to wait, because the queue was empty
+	unsigned long empty = 0;
+
+	void pushed(size_t depth) {
+		items++;
+		depth_sum += depth;
+		if (depth > max_depth) {
+			max_depth = depth;
+		}
+	}
+
+	void add(const QueueStats &other) {
+		items += other.items;
+		depth_sum += other.depth_sum;
+		if (other.max_depth > max_depth) {
+			max_depth = other.max_depth;
+		}
+		full += other.full;
+		empty += other.empty;
+	}
+};
+
+inline std::ostream &operator<<(std::ostream &out, const QueueStats &stats) {
+	double avg_depth = stats.items == 0 ? 0.0 : double(stats.depth_sum) / stats.items;
+
+	return out << stats.items << " items, average depth " << avg_depth
+		   << ", max depth " << stats.max_depth
+		   << ", full " << stats.full << " times"
+		   << ", empty " << stats.empty << " times";
+}
+
+/** A FIFO queue for multiple producers and consumers with a maximum size.
+ *
+ * push() blocks while the queue is full. This way, a fast stage of a pipeline
+ * can't run arbitrarily far ahead of a slow one.
+ */
+template <typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity)
+		: capacity(capacity)
+	{}
+
+	// Returns false if the queue was closed. The item is dropped in that
+	// case.
+	bool push(T item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!closed && items.size() >= capacity) {
+			stats.full++;
+			not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+		}
+		if (closed) {
+			return false;
+		}
+		items.push_back(std::move(item));
+		stats.pushed(items.size());
+		not_empty.notify_one();
+		return true;
+	}
+
+	// Returns false if the queue is closed and empty
+	bool pop(T &item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!closed && items.empty()) {
+			stats.empty++;
+			not_empty.wait(lock, [this] { return closed || !items.empty(); });
+		}
+		if (items.empty()) {
+			return false;
+		}
+		item = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	// No more items will be pushed. Consumers still get the remaining items.
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		not_empty.notify_all();
+		not_full.notify_all();
+	}
+
+	// Close the queue and drop all remaining items
+	void abort() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		items.clear();
+		not_empty.notify_all();
+		not_full.notify_all();
+	}
+
+	QueueStats get_stats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return stats;
+	}
+
+private:
+	const size_t capacity;
+	std::deque<T> items;
+	bool closed = false;
+	QueueStats stats;
+
+	std::mutex mutex;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+};
+
+/** A queue whose items are numbered and come out in the order of their numbers.
+ *
+ * Items can be pushed in any order, but pop() returns item 0, then item 1, and
+ * so on. If capacity is not 0, push() blocks until the item is less than
+ * `capacity` items ahead of the one that will be popped next. Thus, the item
+ * that the consumer waits for can always be pushed.
+ */
+template <typename T>
+class ReorderQueue {
+public:
+	explicit ReorderQueue(size_t capacity = 0)
+		: capacity(capacity)
+	{}
+
+	// Returns false if the queue was closed. The item is dropped in that
+	// case.
+	bool push(size_t seq, T item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!closed && !fits(seq)) {
+			stats.full++;
+			changed.wait(lock, [&] { return closed || fits(seq); });
+		}
+		if (closed) {
+			return false;
+		}
+		items.emplace(seq, std::move(item));
+		stats.pushed(items.size());
+		changed.notify_all();
+		return true;
+	}
+
+	// Returns false if the queue is closed and the next item isn't there.
+	bool pop(T &item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!closed && !next_available()) {
+			stats.empty++;
+			changed.wait(lock, [this] { return closed || next_available(); });
+		}
+		if (!next_available()) {
+			return false;
+		}
+		auto it = items.begin();
+		item = std::move(it->second);
+		items.erase(it);
+		next++;
+		changed.notify_all();
+		return true;
+	}
+
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		changed.notify_all();
+	}
+
+	void abort() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		items.clear();
+		changed.notify_all();
+	}
+
+	QueueStats get_stats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return stats;
+	}
+
+private:
+	bool fits(size_t seq) const {
+		return capacity == 0 || seq < next + capacity;
+	}
+
+	bool next_available() const {
+		return !items.empty() && items.begin()->first == next;
+	}
+
+	const size_t capacity;
+	std::map<size_t, T> items;
+	// the number of the next item to pop
+	size_t next = 0;
+	bool closed = false;
+	QueueStats stats;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+};
+
+#endif /* QUEUE_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
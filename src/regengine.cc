@@ -21,21 +21,21 @@
 #include "regengine.h"
 
 #include <regex.h>
+#include <strings.h>
+#include <cctype>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
-#include <iomanip>
 #include <string>
 #include <sstream>
 
 #include "output.h"
-#include "pdfgrep.h"
 
 using namespace std;
 
-bool PatternList::exec(const string &str, size_t offset, struct match &m) const
+bool PatternList::exec(string_view str, size_t offset, struct match &m) const
 {
 	struct match m_copy = m;
 
@@ -54,9 +54,23 @@ void PatternList::add_pattern(unique_ptr<Regengine> pattern) {
 	patterns.push_back(std::move(pattern));
 }
 
+TrigramQuery PatternList::trigram_query() const
+{
+	if (patterns.empty()) {
+		return TrigramQuery::all();
+	}
+
+	TrigramQuery query = patterns[0]->trigram_query();
+	for (size_t i = 1; i < patterns.size(); i++) {
+		query = TrigramQuery::either(std::move(query), patterns[i]->trigram_query());
+	}
+	return query;
+}
+
 // regex(3)
 
 PosixRegex::PosixRegex(const string &pattern, bool case_insensitive)
+	: pattern(pattern), case_insensitive(case_insensitive)
 {
 	int regex_flags = REG_EXTENDED | (case_insensitive ? REG_ICASE : 0);
 
@@ -74,20 +88,29 @@ PosixRegex::PosixRegex(const string &pattern, bool case_insensitive)
 	if (ret != 0) {
 		char err_msg[256];
 		regerror(ret, &this->regex, err_msg, 256);
-		err() << err_msg << endl;
-		exit(EXIT_ERROR);
+		throw PatternError(err_msg);
 	}
 }
 
-bool PosixRegex::exec(const string &str, size_t offset, struct match &m) const
+bool PosixRegex::exec(string_view str, size_t offset, struct match &m) const
 {
-	regmatch_t match[] = {{0, 0}};
 	const int nmatch = 1;
 
 	// If we aren't at the beginning of the page, ^ should not match.
 	int flags = offset == 0 ? 0 : REG_NOTBOL;
 
-	int ret = regexec(&this->regex, &str[offset], nmatch, match, flags);
+#ifdef REG_STARTEND
+	// The end of the text is passed in the match itself, so the text
+	// doesn't have to be null-terminated and regexec doesn't have to
+	// search for its end again on every call.
+	regmatch_t match[] = {{0, static_cast<regoff_t>(str.size() - offset)}};
+	int ret = regexec(&this->regex, str.data() + offset, nmatch, match,
+	                  flags | REG_STARTEND);
+#else
+	regmatch_t match[] = {{0, 0}};
+	const string text(str.substr(offset));
+	int ret = regexec(&this->regex, text.c_str(), nmatch, match, flags);
+#endif
 
 	if (ret != 0) {
 		return false;
@@ -104,12 +127,18 @@ PosixRegex::~PosixRegex()
 	regfree(&this->regex);
 }
 
+TrigramQuery PosixRegex::trigram_query() const
+{
+	return plan_regex(pattern, RegexSyntax::POSIX_EXTENDED, case_insensitive);
+}
+
 
 // pcre2(3)
 
 #ifdef HAVE_LIBPCRE
 
 PCRERegex::PCRERegex(const string &pattern, bool case_insensitive)
+	: pattern(pattern), case_insensitive(case_insensitive)
 {
 	int pcre_err;
 	PCRE2_SIZE pcre_err_ofs;
@@ -121,10 +150,9 @@ PCRERegex::PCRERegex(const string &pattern, bool case_insensitive)
 	if (this->regex == nullptr) {
 		PCRE2_UCHAR message[512]; // Actual size unknowable, longer messages get truncated
 		pcre2_get_error_message(pcre_err, message, sizeof message / sizeof *message);
-		err() << pattern << endl;
-		err() << setw(pcre_err_ofs+1) << "^" << endl;
-		err() << "Error compiling PCRE pattern: " << message << endl;
-		exit(EXIT_ERROR);
+		throw PatternError(pattern + "\n" + string(pcre_err_ofs, ' ') + "^\n"
+		                   + "Error compiling PCRE pattern: "
+		                   + reinterpret_cast<const char *>(message));
 	}
 }
 
@@ -133,7 +161,12 @@ PCRERegex::~PCRERegex()
 	pcre2_code_free(this->regex);
 }
 
-bool PCRERegex::exec(const string &str, size_t offset, struct match &m) const
+TrigramQuery PCRERegex::trigram_query() const
+{
+	return plan_regex(pattern, RegexSyntax::PCRE, case_insensitive);
+}
+
+bool PCRERegex::exec(string_view str, size_t offset, struct match &m) const
 {
 	pcre2_match_data *data;
 	PCRE2_SIZE *ov;
@@ -179,39 +212,70 @@ FixedString::FixedString(const string &pattern, bool case_insensitive)
 	}
 }
 
-bool FixedString::exec(const string &str, size_t offset, struct match &m) const
+// Like strcasestr, but `haystack` doesn't have to be null-terminated
+static size_t find_case_insensitive(string_view haystack, size_t offset, const string &needle)
 {
-	// We use C-style strings here, because of strcasestr
-	const char *str_begin = &str[offset];
+	if (needle.size() > haystack.size() - offset) {
+		return string::npos;
+	}
+
+	if (needle.empty()) {
+		return offset;
+	}
+
+	const char *begin = haystack.data();
+	const char *last = begin + haystack.size() - needle.size();
+	// Only positions with the first character of the needle are compared
+	const char lower = tolower(static_cast<unsigned char>(needle[0]));
+	const char upper = toupper(static_cast<unsigned char>(lower));
+
+	for (const char *p = begin + offset; p <= last; p++) {
+		if ((*p == lower || *p == upper)
+		    && strncasecmp(p, needle.c_str(), needle.size()) == 0) {
+			return p - begin;
+		}
+	}
 
+	return string::npos;
+}
+
+bool FixedString::exec(string_view str, size_t offset, struct match &m) const
+{
 	// FIXME Searching for multiple patterns is very inefficient, because we
 	// search the same thing over and over, until it becomes the next match.
 	// We should introduce some kind of caching here
 
-	const char *min_result = nullptr;
+	size_t min_result = string::npos;
 	const string *min_pattern;
 
 	for (const string &pattern : patterns) {
-		const char *result;
+		size_t result;
 		if (this->case_insensitive) {
-			result = strcasestr(str_begin, pattern.c_str());
+			result = find_case_insensitive(str, offset, pattern);
 		} else {
-			result = strstr(str_begin, pattern.c_str());
+			result = str.find(pattern, offset);
 		}
 
-		if (result != nullptr) {
-			if (min_result == nullptr || result < min_result) {
-				min_result = result;
-				min_pattern = &pattern;
-			}
+		if (result < min_result) {
+			min_result = result;
+			min_pattern = &pattern;
 		}
 	}
 
-	if (min_result != nullptr) {
-		m.start = offset + (min_result - str_begin);
+	if (min_result != string::npos) {
+		m.start = min_result;
 		m.end = m.start + (*min_pattern).size();
 		return true;
 	}
 
 	return false;
 }
+
+TrigramQuery FixedString::trigram_query() const
+{
+	TrigramQuery query = plan_literal(patterns[0], case_insensitive);
+	for (size_t i = 1; i < patterns.size(); i++) {
+		query = TrigramQuery::either(std::move(query), plan_literal(patterns[i], case_insensitive));
+	}
+	return query;
+}
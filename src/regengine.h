@@ -32,16 +32,31 @@
 #endif
 #include <vector>
 #include <string>
+#include <string_view>
 #include <memory>
+#include <stdexcept>
 
+#include "trigram.h"
 
 struct match;
 
+// Thrown by the constructors below if a pattern is invalid. The message may
+// have several lines.
+class PatternError : public std::runtime_error
+{
+public:
+	using std::runtime_error::runtime_error;
+};
+
 class Regengine
 {
 public:
-	// writes the match data to m. Returns true on success and false on failure
-	virtual bool exec(const std::string &str, size_t offset, struct match &m) const = 0;
+	// writes the match data to m. Returns true on success and false on failure.
+	// `str` doesn't have to be null-terminated, e.g. if it is a page in the
+	// mapped cache file.
+	virtual bool exec(std::string_view str, size_t offset, struct match &m) const = 0;
+	// What the pages with a match have in common, see trigram.h
+	virtual TrigramQuery trigram_query() const = 0;
 	virtual ~Regengine() {}
 };
 
@@ -55,7 +70,8 @@ class PatternList : public Regengine
 public:
 	PatternList() {}
 	~PatternList() {}
-	bool exec(const std::string &str, size_t offset, struct match &m) const override;
+	bool exec(std::string_view str, size_t offset, struct match &m) const override;
+	TrigramQuery trigram_query() const override;
 	void add_pattern(std::unique_ptr<Regengine> pattern);
 private:
 	std::vector<std::unique_ptr<Regengine>> patterns;
@@ -66,9 +82,12 @@ class PosixRegex : public Regengine
 public:
 	PosixRegex(const std::string &pattern, bool case_insensitive);
 	~PosixRegex();
-	bool exec(const std::string &str, size_t offset, struct match &m) const override;
+	bool exec(std::string_view str, size_t offset, struct match &m) const override;
+	TrigramQuery trigram_query() const override;
 private:
 	regex_t regex;
+	std::string pattern;
+	bool case_insensitive;
 };
 
 #ifdef HAVE_LIBPCRE
@@ -77,9 +96,12 @@ class PCRERegex : public Regengine
 public:
 	PCRERegex(const std::string &pattern, bool case_insensitive);
 	~PCRERegex();
-	bool exec(const std::string &str, size_t offset, struct match &m) const override;
+	bool exec(std::string_view str, size_t offset, struct match &m) const override;
+	TrigramQuery trigram_query() const override;
 private:
 	pcre2_code *regex;
+	std::string pattern;
+	bool case_insensitive;
 };
 #endif
 
@@ -87,7 +109,8 @@ class FixedString : public Regengine
 {
 public:
 	FixedString(const std::string &pattern, bool case_insensitive);
-	bool exec(const std::string &str, size_t offset, struct match &m) const override;
+	bool exec(std::string_view str, size_t offset, struct match &m) const override;
+	TrigramQuery trigram_query() const override;
 private:
 	std::vector<std::string> patterns;
 	bool case_insensitive;
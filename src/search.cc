@@ -20,152 +20,345 @@
 
 #include "search.h"
 #include "output.h"
+#include "extract.h"
+#include "trigram.h"
+#include "lineindex.h"
 
 #include <algorithm>
+#include <atomic>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #ifdef HAVE_UNAC
 #include <unac.h>
 #endif
-#include <cpp/poppler-page.h>
 
 
 using namespace std;
 
-struct SearchState {
-	bool document_empty = true;
-	// Total match count in the current PDF
-	int total_count = 0;
+// Statistics of the page filters for --debug
+static atomic<size_t> filtered_pages(0);
+static atomic<size_t> skipped_pages(0);
+static atomic<size_t> false_positives(0);
+
+// How the matches of a page are reported. report_page() is instantiated for
+// each mode, so that the loop over the matches doesn't check the options
+// again for every match. The mode is chosen once, by report_mode().
+enum class ReportMode {
+	// only whether there is a match: -q, -l and -L
+	EXISTS,
+	// only the number of matches: -c and -p
+	COUNT,
+	// each match on a line of its own: -o without context
+	ONLY_MATCHING,
+	// --json
+	JSON,
+	// the lines with matches and their context
+	LINES
 };
 
+static ReportMode report_mode(const Options &opts);
+
 // Returns the number of matches found
-static int search_page(const Options& opts,
-                       const string& page_text,
+template <ReportMode mode>
+static int report_page(const Options& opts,
+                       string_view text,
                        size_t pagenum,
-                       const string& page_label,
+                       string_view page_label,
                        const string& filename,
-                       const Regengine& re,
-                       SearchState& state);
-
-static string maybe_unac(const Options &opts, string str);
+                       const vector<PageMatch>& matches,
+                       SearchState& state,
+                       pmr::memory_resource *memory);
 
 static void handle_match(const Options& opts,
                          const string& filename,
                          size_t page,
-                         const string& page_label,
-                         vector<match>& line,
-                         vector<match>& last_line,
+                         string_view page_label,
+                         const LineIndex& lines,
+                         pmr::vector<match>& line,
+                         pmr::vector<match>& last_line,
                          const match& mt,
                          bool previous_matches);
 
 static void flush_line_matches(const Options& opts,
                                const string& filename,
                                size_t page,
-                               const string& page_label,
-                               vector<match>& line,
-                               vector<match>& last_line,
+                               string_view page_label,
+                               const LineIndex& lines,
+                               pmr::vector<match>& line,
+                               pmr::vector<match>& last_line,
                                bool previous_matches);
 
-static string ustring_to_string(const poppler::ustring& str) {
-	poppler::byte_array arr = str.to_utf8();
-	if (arr.empty()) {
-		return string();
+int search_document(const Options &opts, unique_ptr<poppler::document> doc,
+		    unique_ptr<Cache> cache, const string &filename,
+		    const Regengine &re, const IntervalContainer &range) {
+
+	DocumentReport report(opts, filename);
+
+	search_pages(opts, std::move(doc), cache.get(), filename, re, range, match_limit(opts),
+	             [&](const SearchedPage &page) {
+		             return report.add_page(page.pagenum, page.label, page.text, page.matches);
+	             },
+	             [&](size_t pagenum) { report.page_error(pagenum); });
+
+	return report.finish();
+}
+
+void search_pages(const Options &opts, unique_ptr<poppler::document> doc,
+                  Cache *cache, const string &filename,
+                  const Regengine &re, const IntervalContainer &range, size_t limit,
+                  const function<bool(const SearchedPage &)> &on_page,
+                  const function<void(size_t)> &on_error) {
+	size_t doc_pages;
+	if (doc) {
+		// doc->pages() returns an int, although it should be a size_t
+		doc_pages = static_cast<size_t>(doc->pages());
+		if (opts.use_cache) {
+			cache->set_document_info(doc_pages, doc->is_encrypted());
+		}
 	} else {
-		return string(arr.data(), arr.size());
+		// All pages are in the cache, see Cache::is_complete()
+		doc_pages = cache->get_page_count();
 	}
-}
 
-int search_document(const Options &opts, unique_ptr<poppler::document> doc,
-		    unique_ptr<Cache> cache, const string &filename,
-		    const Regengine &re) {
+	// With --page-jobs, the pages that aren't in the cache are extracted by
+	// multiple threads ahead of time. This loop then only takes them in
+	// order.
+	unique_ptr<PageExtractor> extractor;
+
+	if (opts.page_jobs > 1) {
+		vector<size_t> pages;
+		for (size_t pagenum = 1; pagenum <= doc_pages; pagenum++) {
+			if (range.contains(pagenum)
+			    && (!opts.use_cache || !cache->has_page(pagenum))) {
+				pages.push_back(pagenum);
+			}
+		}
 
-	SearchState state;
+		if (pages.size() > 1) {
+			unsigned threads = min(static_cast<size_t>(opts.page_jobs), pages.size());
+			extractor = make_unique<PageExtractor>(opts, filename, std::move(doc),
+			                                       std::move(pages), threads);
+		}
+	}
 
-	// doc->pages() returns an int, although it should be a size_t
-	auto doc_pages = static_cast<size_t>(doc->pages());
+	// These are reused for every page, so that their memory is only
+	// allocated once
+	vector<PageMatch> matches;
+	string unac_buffer;
+	CachePage extracted;
 
 	for (size_t pagenum = 1; pagenum <= doc_pages; pagenum++) {
-		if (!opts.page_range.contains(pagenum)) {
+		if (!range.contains(pagenum)) {
 			continue;
 		}
 
-		CachePage cachepage;
+		bool filtered = false;
+		if (opts.use_cache && !page_may_match(opts, *cache, pagenum, filtered)) {
+			continue;
+		}
 
-		if (!opts.use_cache || !cache->get_page(pagenum, cachepage)) {
-			unique_ptr<poppler::page> page(doc->create_page(pagenum-1));
+		// The text isn't copied: Cached pages are searched where they are
+		// in the cache, extracted pages where they were extracted to.
+		CachePageView page;
+
+		if (!opts.use_cache || !cache->get_page_view(pagenum, page)) {
+			bool ok;
+			if (extractor) {
+				ok = extractor->get(pagenum, extracted);
+			} else {
+				// Without doc, all pages were supposed to be cached, but
+				// this one couldn't be decompressed.
+				ok = doc && extract_page(*doc, pagenum, extracted);
+			}
 
-			if (!page) {
-				if (!opts.quiet) {
-					err() << "Could not search in page " << pagenum
-					      << " of " << filename << endl;
-				}
+			if (!ok) {
+				on_error(pagenum);
 				continue;
 			}
 
-			cachepage.text = ustring_to_string(page->text(page->page_rect(poppler::media_box)));
-			string& pagetext = cachepage.text;
+			// Update the rendering cache. It keeps the page until
+			// dump(), so the page is searched there.
+			if (opts.use_cache) {
+				cache->set_page(pagenum, std::move(extracted));
+				cache->get_page_view(pagenum, page);
+			} else {
+				page.text = extracted.text;
+				page.label = extracted.label;
+			}
+		}
 
-			// newer versions of poppler generate spurious
-			// whitespace at the end of pages. Since in a pdf
-			// trailing whitespace text is visually identical to no
-			// text, we can just remove it.
-			auto whitespace_start =
-				std::find_if(pagetext.rbegin(),
-					     pagetext.rend(), [](unsigned char ch) {
-						     return !std::isspace(ch);
-					     });
-			pagetext.erase(whitespace_start.base(), pagetext.end());
+		string_view text = maybe_unac(opts, page.text, unac_buffer);
 
+		matches.clear();
+		find_matches(re, text, limit, matches);
+		if (filtered && matches.empty()) {
+			count_filter_false_positive();
+		}
 
-			if (!pagetext.empty()) {
-				// there is text on this page, document can't be empty
-				state.document_empty = false;
-			}
+		if (!on_page(SearchedPage { pagenum, page.label, text, matches })) {
+			break;
+		}
+	}
 
-			// TODO Don't read label if we don't need it
-			cachepage.label = ustring_to_string(page->label());
+	// If we stopped early, the extraction threads can stop, too. The pages
+	// they extracted ahead are still worth caching.
+	if (extractor && opts.use_cache) {
+		extractor->finish(*cache);
+	}
+	extractor.reset();
 
-			// Update the rendering cache
-			if (opts.use_cache) {
-				cache->set_page(pagenum, cachepage);
-			}
-		}
+	// Save the cache for a later use
+	if (opts.use_cache) {
+		cache->dump();
+	}
+}
 
-		string& text = cachepage.text;
-		string& label = cachepage.label;
+bool page_may_match(const Options &opts, const Cache &cache, size_t pagenum, bool &filtered) {
+	filtered = false;
+	if (opts.filter_query == nullptr) {
+		return true;
+	}
 
-		if (!text.empty()) {
-			// there is text on this page, document can't be empty
-			state.document_empty = false;
-		}
+	string_view filter = cache.get_page_filter(pagenum);
+	if (filter.empty()) {
+		return true;
+	}
 
+	filtered = true;
+	filtered_pages++;
+	if (page_filter_matches(filter, *opts.filter_query)) {
+		return true;
+	}
+	skipped_pages++;
+	return false;
+}
 
-		int page_count = search_page(opts, text, pagenum, label, filename, re, state);
+void count_filter_false_positive() {
+	false_positives++;
+}
 
-		if (page_count > 0 && opts.quiet) {
-			break;
-		}
+void print_filter_stats() {
+	// Pages without a match that the filter let through anyway, among all
+	// pages without a match. This includes pages that have all trigrams
+	// of the pattern, but still don't match it.
+	size_t negatives = skipped_pages + false_positives;
+	ostringstream rate;
+	rate << fixed << setprecision(1)
+	     << (negatives > 0 ? 100.0 * false_positives / negatives : 0.0);
+	err() << "page filters: " << filtered_pages << " pages checked, "
+	      << skipped_pages << " skipped, " << false_positives
+	      << " passed without a match (" << rate.str() << "% false positives)" << endl;
+}
 
-		if (opts.only_filenames == OnlyFilenames::WITH_MATCHES
-		    && page_count > 0) {
-			if (!opts.quiet) {
-				print_only_filename(opts.outconf, filename);
-			}
-			break;
+size_t match_limit(const Options &opts) {
+	if (report_mode(opts) == ReportMode::EXISTS) {
+		return 1;
+	}
+	if (opts.max_count > 0) {
+		return opts.max_count;
+	}
+	return 0;
+}
+
+void find_matches(const Regengine &re, string_view text, size_t limit,
+                  vector<PageMatch> &matches) {
+	size_t index = 0;
+	struct match mt = { text, 0, 0 };
+
+	while (re.exec(text, index, mt)) {
+		matches.push_back(PageMatch { mt.start, mt.end });
+
+		if (limit > 0 && matches.size() >= limit) {
+			return;
 		}
-		if (page_count > 0 && opts.pagecount &&
-		    opts.only_filenames == OnlyFilenames::NOPE && !opts.quiet) {
-			line_prefix(context { filename, pagenum, label, opts.outconf }, false)
-				<< page_count << endl;
+
+		index = mt.end;
+
+		// prevent loop if match is empty
+		if (mt.start == mt.end) {
+			index++;
 		}
 
-		if (opts.max_count > 0 && state.total_count >= opts.max_count) {
+		if(index >= text.size()) {
 			break;
 		}
 	}
+}
+
+DocumentReport::DocumentReport(const Options &opts, const string &filename)
+	: opts(opts), filename(filename) {
+	switch (report_mode(opts)) {
+	case ReportMode::EXISTS:
+		report = report_page<ReportMode::EXISTS>;
+		break;
+	case ReportMode::COUNT:
+		report = report_page<ReportMode::COUNT>;
+		break;
+	case ReportMode::ONLY_MATCHING:
+		report = report_page<ReportMode::ONLY_MATCHING>;
+		break;
+	case ReportMode::JSON:
+		report = report_page<ReportMode::JSON>;
+		break;
+	case ReportMode::LINES:
+		report = report_page<ReportMode::LINES>;
+		break;
+	}
+}
+
+void DocumentReport::page_error(size_t pagenum) {
+	if (!opts.quiet) {
+		err() << "Could not search in page " << pagenum
+		      << " of " << filename << endl;
+	}
+}
+
+bool DocumentReport::add_page(size_t pagenum, string_view label, string_view text,
+                              const vector<PageMatch> &matches) {
+	if (!text.empty()) {
+		// there is text on this page, document can't be empty
+		state.document_empty = false;
+	}
 
+	int page_count = report(opts, text, pagenum, label, filename, matches, state, &arena);
+	arena.reset();
+
+	if (page_count > 0 && opts.quiet) {
+		return false;
+	}
+
+	if (opts.only_filenames == OnlyFilenames::WITH_MATCHES
+	    && page_count > 0) {
+		if (!opts.quiet) {
+			print_only_filename(opts.outconf, filename);
+		}
+		return false;
+	}
+
+	// One match is enough to leave out the file
+	if (opts.only_filenames == OnlyFilenames::WITHOUT_MATCH && page_count > 0) {
+		return false;
+	}
+	if (page_count > 0 && opts.pagecount &&
+	    opts.only_filenames == OnlyFilenames::NOPE && !opts.quiet) {
+		line_prefix(context { filename, pagenum, label, opts.outconf, nullptr }, false)
+			<< page_count << '\n';
+	}
+
+	if (opts.max_count > 0 && state.total_count >= opts.max_count) {
+		return false;
+	}
+
+	return true;
+}
+
+int DocumentReport::finish() {
 	if (opts.only_filenames == OnlyFilenames::WITHOUT_MATCH
 	    && state.total_count == 0
 	    && !opts.quiet) {
@@ -173,104 +366,121 @@ int search_document(const Options &opts, unique_ptr<poppler::document> doc,
 	}
 
 	if (opts.count && opts.only_filenames == OnlyFilenames::NOPE && !opts.quiet) {
-		line_prefix(context {filename, 0, "", opts.outconf}, false) << state.total_count << endl;
+		line_prefix(context {filename, 0, "", opts.outconf, nullptr}, false) << state.total_count << '\n';
 	}
 
 	if (opts.warn_empty && state.document_empty) {
 		err() << "File does not contain text: " << filename << endl;
 	}
 
-	// Save the cache for a later use
-	if (opts.use_cache) {
-		cache->dump();
-	}
-
 	return state.total_count;
 }
 
-static int search_page(const Options& opts,
-                       const string& page_text,
+static ReportMode report_mode(const Options &opts) {
+	if (opts.quiet || opts.only_filenames != OnlyFilenames::NOPE) {
+		return ReportMode::EXISTS;
+	}
+	if (opts.count || opts.pagecount) {
+		return ReportMode::COUNT;
+	}
+	if (opts.outconf.json) {
+		return ReportMode::JSON;
+	}
+	if (opts.outconf.only_matching && !opts.outconf.context_mode) {
+		return ReportMode::ONLY_MATCHING;
+	}
+	return ReportMode::LINES;
+}
+
+template <ReportMode mode>
+static int report_page(const Options& opts,
+                       string_view text,
                        size_t pagenum,
-                       const string& page_label,
+                       string_view page_label,
                        const string& filename,
-                       const Regengine& re,
-                       SearchState& state) {
-	// Count of matches just on this page
-	int page_count = 0;
-
-	// We need that in flush_line_matches to know if we need to print a
-	// context separator.
-	bool previous_matches = state.total_count > 0;
+                       const vector<PageMatch>& matches,
+                       SearchState& state,
+                       pmr::memory_resource *memory) {
+	// The matches that count, i.e. not those after --max-count
+	size_t count = matches.size();
+	if (opts.max_count > 0) {
+		count = min(count, static_cast<size_t>(max(opts.max_count - state.total_count, 1)));
+	}
 
-	string text = maybe_unac(opts, page_text);
+	if constexpr (mode == ReportMode::EXISTS) {
+		count = min(count, static_cast<size_t>(1));
+	}
 
-	size_t index = 0;
-	struct match mt = { text, 0, 0 };
+	if constexpr (mode == ReportMode::EXISTS || mode == ReportMode::COUNT) {
+		state.total_count += count;
+		return count;
+	}
 
-	// matches found in current line
-	vector<match> current;
+	if constexpr (mode == ReportMode::ONLY_MATCHING) {
+		const context cntxt = {filename, pagenum, page_label, opts.outconf, nullptr};
+		for (size_t i = 0; i < count; i++) {
+			print_only_match(cntxt, match { text, matches[i].start, matches[i].end });
+		}
+		state.total_count += count;
+		return count;
+	}
 
-	// last line that contained matches. We only have to store at most one
-	// match, but the ability to store 0 matches is crucial for the initial
-	// state.
-	vector<match> last_line;
+	if (count == 0) {
+		return 0;
+	}
 
-	while (re.exec(text, index, mt)) {
-		state.total_count++;
-		page_count++;
+	const LineIndex lines(text, memory);
 
-		if (opts.quiet || opts.only_filenames == OnlyFilenames::WITH_MATCHES) {
-			return page_count;
+	if constexpr (mode == ReportMode::JSON) {
+		const context cntxt = {filename, pagenum, page_label, opts.outconf, &lines};
+		for (size_t i = 0; i < count; i++) {
+			print_json_match(cntxt, match { text, matches[i].start, matches[i].end });
 		}
+		state.total_count += count;
+		return count;
+	}
 
-		handle_match(opts, filename, pagenum, page_label, current, last_line, mt, previous_matches);
-
-		if (opts.max_count > 0 && state.total_count >= opts.max_count) {
-			flush_line_matches(opts, filename, pagenum, page_label, current, last_line, previous_matches);
-			if (!last_line.empty() && !opts.count && !opts.pagecount) {
-				// Print final context after last match
-				struct context cntxt = {filename, pagenum, page_label, opts.outconf};
-				print_context_after(cntxt, *last_line.rbegin());
-			}
-			return page_count;
-		}
+	// We need that in flush_line_matches to know if we need to print a
+	// context separator.
+	bool previous_matches = state.total_count > 0;
 
-		index = mt.end;
+	// matches found in current line
+	pmr::vector<match> current(memory);
 
-		// prevent loop if match is empty
-		if (mt.start == mt.end) {
-			index++;
-		}
+	// last line that contained matches. We only have to store at most one
+	// match, but the ability to store 0 matches is crucial for the initial
+	// state.
+	pmr::vector<match> last_line(memory);
 
-		if(index >= text.size()) {
-			break;
-		}
+	for (size_t i = 0; i < count; i++) {
+		struct match mt = { text, matches[i].start, matches[i].end };
+		handle_match(opts, filename, pagenum, page_label, lines, current, last_line, mt,
+		             previous_matches);
 	}
+	state.total_count += count;
 
-	flush_line_matches(opts, filename, pagenum, page_label, current, last_line, previous_matches);
+	flush_line_matches(opts, filename, pagenum, page_label, lines, current, last_line,
+	                   previous_matches);
 
-	if (!last_line.empty() && !opts.count && !opts.pagecount) {
-		// Print final context after last match
-		struct context cntxt = {filename, pagenum, page_label, opts.outconf};
-		print_context_after(cntxt, *last_line.rbegin());
-	}
+	// Print final context after last match
+	struct context cntxt = {filename, pagenum, page_label, opts.outconf, &lines};
+	print_context_after(cntxt, *last_line.rbegin());
 
-	return page_count;
+	return count;
 }
 
 static void flush_line_matches(const Options& opts,
                                const string& filename,
                                size_t page,
-                               const string& page_label,
-                               vector<match>& line,
-                               vector<match>& last_line,
+                               string_view page_label,
+                               const LineIndex& lines,
+                               pmr::vector<match>& line,
+                               pmr::vector<match>& last_line,
                                bool previous_matches) {
 
-	struct context cntxt = {filename, page, page_label, opts.outconf};
+	struct context cntxt = {filename, page, page_label, opts.outconf, &lines};
 
-	// We don't want any output:
-	if (line.empty() || opts.count || opts.pagecount
-	    || opts.only_filenames != OnlyFilenames::NOPE) {
+	if (line.empty()) {
 		goto out;
 	}
 
@@ -303,9 +513,10 @@ out:
 static void handle_match(const Options& opts,
                          const string& filename,
                          size_t page,
-                         const string& page_label,
-                         vector<match>& line,
-                         vector<match>& last_line,
+                         string_view page_label,
+                         const LineIndex& lines,
+                         pmr::vector<match>& line,
+                         pmr::vector<match>& last_line,
                          const match& mt,
                          bool previous_matches) {
 	if (line.empty()) {
@@ -313,21 +524,47 @@ static void handle_match(const Options& opts,
 		return;
 	}
 	size_t end_last = line.back().end;
-	// TODO: Don't search whole string, just up to mt.start
-	auto next_newline = mt.string.find('\n', end_last);
+	auto next_newline = lines.find(end_last);
 	if (next_newline == string::npos || next_newline > mt.start) {
 		line.push_back(mt);
 	} else {
-		flush_line_matches(opts, filename, page, page_label, line, last_line, previous_matches);
+		flush_line_matches(opts, filename, page, page_label, lines, line, last_line,
+		                   previous_matches);
 		line.push_back(mt);
 	}
 }
 
-static string maybe_unac(const Options &opts, string str) {
 #ifdef HAVE_UNAC
-	return simple_unac(opts, str);
+/* convenience layer over libunac. */
+string simple_unac(const Options &opts, string_view str)
+{
+	if (!opts.use_unac) {
+		return string(str);
+	}
+
+	char *res = NULL;
+	size_t reslen = 0;
+
+	if (unac_string("UTF-8", str.data(), str.size(), &res, &reslen) != 0) {
+		perror("pdfgrep: Failed to remove accents: ");
+		return string(str);
+	}
+
+	string result(res, reslen);
+	free(res);
+	return result;
+}
+#endif
+
+string_view maybe_unac(const Options &opts, string_view page_text, string &buffer) {
+#ifdef HAVE_UNAC
+	if (opts.use_unac) {
+		buffer = simple_unac(opts, page_text);
+		return buffer;
+	}
 #else
 	(void) opts;
-	return str;
+	(void) buffer;
 #endif
+	return page_text;
 }
@@ -21,17 +21,129 @@
 #ifndef SEARCH_H
 #define SEARCH_H
 
+#include <functional>
 #include <memory>
+#include <string_view>
 #include <cpp/poppler-document.h>
 
 #include "pdfgrep.h"
 #include "regengine.h"
 #include "cache.h"
+#include "arena.h"
 
-// Returns the number of matches found in this document
+/* Returns the number of matches found in this document.
+ *
+ * Only the pages in `range` are searched, which is opts.page_range or a part
+ * of it (see TrigramIndex::select_pages()). `doc` may be nullptr if the cache
+ * contains all of them.
+ */
 int search_document(const Options &opts, std::unique_ptr<poppler::document> doc,
                     std::unique_ptr<Cache> cache, const std::string &filename,
-                    const Regengine &re);
+                    const Regengine &re, const IntervalContainer &range);
+
+// Position of a match in the (searchable) text of a page
+struct PageMatch {
+	size_t start;
+	size_t end;
+};
+
+// A page that search_pages() has searched
+struct SearchedPage {
+	size_t pagenum;
+	std::string_view label;
+	// the searched text, see maybe_unac()
+	std::string_view text;
+	const std::vector<PageMatch> &matches;
+};
+
+/* The search of search_document() without its output.
+ *
+ * `on_page` is called for each page in `range`, in order, unless the page
+ * filter rules it out. The search stops as soon as it returns false. Pages
+ * that can't be read are passed to `on_error` instead. Finds up to `limit`
+ * matches per page, unless limit is 0. `cache` is only used with
+ * opts.use_cache.
+ */
+void search_pages(const Options &opts, std::unique_ptr<poppler::document> doc,
+                  Cache *cache, const std::string &filename,
+                  const Regengine &re, const IntervalContainer &range, size_t limit,
+                  const std::function<bool(const SearchedPage &)> &on_page,
+                  const std::function<void(size_t)> &on_error);
+
+#ifdef HAVE_UNAC
+/* convenience layer over libunac */
+std::string simple_unac(const Options &opts, std::string_view str);
+#endif
+
+// Returns the text that is actually searched, i.e. page_text without accents
+// if --unac is given. Only then the text is copied, to `buffer`. Otherwise,
+// page_text itself is returned.
+std::string_view maybe_unac(const Options &opts, std::string_view page_text,
+                            std::string &buffer);
+
+/* Check the Bloom filter of a cached page against opts.filter_query. Returns
+ * false if the page can't match, so that it doesn't have to be read or
+ * searched at all. `filtered` is set if the page has a filter. */
+bool page_may_match(const Options &opts, const Cache &cache, size_t pagenum, bool &filtered);
+
+// Record that a page passed its filter, but didn't match, for --debug
+void count_filter_false_positive();
+
+// Print how many pages the filters skipped, for --debug
+void print_filter_stats();
+
+// Append the matches of `re` in `text` to `matches`. Stops after `limit`
+// matches, unless limit is 0.
+void find_matches(const Regengine &re, std::string_view text, size_t limit,
+                  std::vector<PageMatch> &matches);
+
+// How many matches per page are needed for the output selected by opts, or 0
+// if all of them are needed.
+size_t match_limit(const Options &opts);
+
+struct SearchState {
+	bool document_empty = true;
+	// Total match count in the current PDF
+	int total_count = 0;
+};
+
+/** Prints the results of the search in one document.
+ *
+ * The pages must be added in order. Their matches can be found beforehand (and
+ * on another thread) with find_matches().
+ */
+class DocumentReport {
+public:
+	DocumentReport(const Options &opts, const std::string &filename);
+
+	/* Print the matches of a page. `text` is the searched text of the page.
+	 *
+	 * Returns false, if the remaining pages don't need to be searched,
+	 * e.g. because of --max-count.
+	 */
+	bool add_page(size_t pagenum, std::string_view label, std::string_view text,
+	              const std::vector<PageMatch> &matches);
+
+	/* Report that page `pagenum` couldn't be read */
+	void page_error(size_t pagenum);
+
+	/* Print the summary for the whole document (e.g. --count) and return
+	 * the number of matches */
+	int finish();
+
+private:
+	const Options &opts;
+	const std::string &filename;
+	SearchState state;
+	// What report() needs for a page, reset after each page
+	PageArena arena;
+
+	// report_page() for the output that opts select
+	int (*report)(const Options &opts, std::string_view text, size_t pagenum,
+	              std::string_view label, const std::string &filename,
+	              const std::vector<PageMatch> &matches, SearchState &state,
+	              std::pmr::memory_resource *memory);
+};
 
 
 #endif /* SEARCH_H */
@@ -0,0 +1,1515 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "trigram.h"
+#include "cache.h"
+#include "cacheindex.h"
+#include "cachepack.h"
+#include "output.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <set>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+/* Format of the index
+ *
+ * The file starts with a header of HEADER_SIZE bytes:
+ *
+ *   "PGTRGM01"
+ *   u64  number of documents
+ *   u64  number of trigrams in the table
+ *   u64  number of pages in the index
+ *   u64  offset of the page bitmaps
+ *   u64  offset of the trigram table
+ *   u64  offset of the posting lists
+ *   u64  0
+ *
+ * It is followed by one record of DOC_SIZE bytes per document, sorted by the
+ * name of the cache entry:
+ *
+ *   u8   length of the name
+ *   40   name
+ *   7    padding
+ *   u64  offset of the page bitmap, relative to the bitmaps
+ *   u32  number of pages of the document
+ *   u32  0
+ *
+ * The page bitmap of a document has a bit for each page up to MAX_PAGE,
+ * which is set if the page is in the index. Pages of the document that
+ * aren't in it were not cached when the index was built.
+ *
+ * The table has an entry of TABLE_ENTRY_SIZE bytes for each trigram that
+ * occurs in any page, sorted by the trigram:
+ *
+ *   u32  trigram (the three bytes from the most significant one)
+ *   u32  number of pages that contain it
+ *   u64  offset of its posting list, relative to the posting lists
+ *
+ * A posting list holds the sorted numbers document << 16 | page of the pages
+ * that contain the trigram, as differences to the previous one, each stored
+ * as a LEB128 varint. The document is the position of its record.
+ *
+ * All numbers are little endian.
+ *
+ * --watch doesn't rebuild the whole index after changes. update() writes a
+ * second index of the same format, DELTA_FILE, with only the documents that
+ * the main index doesn't have, and build() replaces both once the delta gets
+ * too large. A document in the delta is looked up there.
+ */
+static const char INDEX_FILE[] = ".trigrams";
+static const char DELTA_FILE[] = ".trigrams-new";
+static const char MAGIC[] = "PGTRGM01";
+static const size_t HEADER_SIZE = 64;
+static const size_t DOC_SIZE = 64;
+static const size_t MAX_NAME_SIZE = 40;
+static const size_t TABLE_ENTRY_SIZE = 16;
+// The page number has 16 bits and the document 24
+static const uint64_t MAX_PAGE = 0xffff;
+static const uint64_t MAX_DOCUMENTS = 1 << 24;
+static const int PAGE_BITS = 16;
+static const int TRIGRAM_SHIFT = 40;
+
+// Sets of strings of the planner grow up to this size
+static const size_t MAX_EXACT = 16;
+
+// update() rebuilds the whole index instead of the delta, if the delta would
+// have more documents than this and than a part DELTA_FRACTION of the index.
+static const size_t MIN_DELTA_DOCUMENTS = 256;
+static const size_t DELTA_FRACTION = 32;
+
+// The build sorts this many postings in memory at a time
+static const size_t RUN_SIZE = 16 << 20;
+static const size_t RUN_BUFFER = 64 << 10;
+
+// An AND query stops intersecting with trigrams that are this many times more
+// frequent than the pages it has left, which only leaves more candidates.
+static const size_t SKIP_FACTOR = 64;
+static const size_t SKIP_MIN = 4096;
+
+static uint64_t get_le(const char *p, int bytes) {
+	uint64_t value = 0;
+	for (int i = bytes - 1; i >= 0; i--) {
+		value = (value << 8) | static_cast<unsigned char>(p[i]);
+	}
+	return value;
+}
+
+static void put_le(char *p, uint64_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		p[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+	}
+}
+
+static bool write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t written = write(fd, buf, len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += written;
+		len -= written;
+	}
+	return true;
+}
+
+// The index ignores the case of ASCII letters
+static inline unsigned char fold(unsigned char c) {
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// Append the distinct trigrams of `text` to `trigrams`
+static void text_trigrams(string_view text, vector<uint32_t> &trigrams) {
+	size_t start = trigrams.size();
+	uint32_t t = 0;
+	for (size_t i = 0; i < text.size(); i++) {
+		t = ((t << 8) | fold(text[i])) & 0xffffff;
+		if (i >= 2) {
+			trigrams.push_back(t);
+		}
+	}
+	sort(trigrams.begin() + start, trigrams.end());
+	trigrams.erase(unique(trigrams.begin() + start, trigrams.end()), trigrams.end());
+}
+
+/* Queries */
+
+TrigramQuery TrigramQuery::of_trigram(uint32_t trigram) {
+	TrigramQuery q;
+	q.kind = Kind::TRIGRAM;
+	q.trigram = trigram;
+	return q;
+}
+
+// Combine a and b with `kind` (AND or OR), flattening nested ones
+static TrigramQuery combine(TrigramQuery::Kind kind, TrigramQuery a, TrigramQuery b) {
+	TrigramQuery q;
+	q.kind = kind;
+	for (TrigramQuery *part : { &a, &b }) {
+		if (part->kind == kind) {
+			for (auto &child : part->children) {
+				q.children.push_back(std::move(child));
+			}
+		} else {
+			q.children.push_back(std::move(*part));
+		}
+	}
+	return q;
+}
+
+TrigramQuery TrigramQuery::both(TrigramQuery a, TrigramQuery b) {
+	if (a.is_all()) {
+		return b;
+	}
+	if (b.is_all()) {
+		return a;
+	}
+	return combine(Kind::AND, std::move(a), std::move(b));
+}
+
+TrigramQuery TrigramQuery::either(TrigramQuery a, TrigramQuery b) {
+	if (a.is_all() || b.is_all()) {
+		return all();
+	}
+	return combine(Kind::OR, std::move(a), std::move(b));
+}
+
+string TrigramQuery::to_string() const {
+	switch (kind) {
+	case Kind::ALL:
+		return "ALL";
+	case Kind::TRIGRAM: {
+		string s = "\"";
+		for (int shift = 16; shift >= 0; shift -= 8) {
+			unsigned char c = (trigram >> shift) & 0xff;
+			if (c < 0x20 || c == '"' || c == '\\') {
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\x%02x", c);
+				s += buf;
+			} else {
+				s += c;
+			}
+		}
+		return s + "\"";
+	}
+	default: {
+		string s;
+		for (const auto &child : children) {
+			if (!s.empty()) {
+				s += kind == Kind::AND ? " AND " : " OR ";
+			}
+			bool nested = child.kind == Kind::AND || child.kind == Kind::OR;
+			s += nested ? "(" + child.to_string() + ")" : child.to_string();
+		}
+		return s;
+	}
+	}
+}
+
+/* Page filters
+ *
+ * A filter starts with a byte that holds the number of hash functions,
+ * followed by the bits. Bit i is bit i % 8 of byte i / 8 of them. The
+ * positions of a trigram are derived from two halves of a 64 bit hash of it.
+ */
+
+// With 8 bits per trigram and 4 hash functions, about 2.4% of the trigrams
+// that a page doesn't have are reported anyway.
+static const size_t FILTER_BITS_PER_TRIGRAM = 8;
+static const unsigned FILTER_HASHES = 4;
+
+static uint64_t filter_hash(uint32_t trigram) {
+	uint64_t x = trigram;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+	return x ^ (x >> 31);
+}
+
+// Position of the bit number `i` of a trigram with `hash` among `bits`
+static inline uint64_t filter_position(uint64_t hash, unsigned i, uint64_t bits) {
+	uint32_t h = static_cast<uint32_t>(hash) + i * static_cast<uint32_t>((hash >> 32) | 1);
+	return (static_cast<uint64_t>(h) * bits) >> 32;
+}
+
+string build_page_filter(string_view text) {
+	vector<uint32_t> trigrams;
+	text_trigrams(text, trigrams);
+
+	string filter(1 + (trigrams.size() * FILTER_BITS_PER_TRIGRAM + 7) / 8, '\0');
+	filter[0] = static_cast<char>(FILTER_HASHES);
+	uint64_t bits = (filter.size() - 1) * 8;
+	for (uint32_t t : trigrams) {
+		uint64_t hash = filter_hash(t);
+		for (unsigned i = 0; i < FILTER_HASHES; i++) {
+			uint64_t pos = filter_position(hash, i, bits);
+			filter[1 + pos / 8] |= 1 << (pos % 8);
+		}
+	}
+	return filter;
+}
+
+static bool filter_contains(string_view filter, uint32_t trigram) {
+	uint64_t bits = (filter.size() - 1) * 8;
+	if (bits == 0) {
+		return false;
+	}
+
+	unsigned hashes = static_cast<unsigned char>(filter[0]);
+	uint64_t hash = filter_hash(trigram);
+	for (unsigned i = 0; i < hashes; i++) {
+		uint64_t pos = filter_position(hash, i, bits);
+		if (!(filter[1 + pos / 8] & (1 << (pos % 8)))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool page_filter_matches(string_view filter, const TrigramQuery &query) {
+	if (filter.empty()) {
+		return true;
+	}
+
+	switch (query.kind) {
+	case TrigramQuery::Kind::ALL:
+		return true;
+	case TrigramQuery::Kind::TRIGRAM:
+		return filter_contains(filter, query.trigram);
+	case TrigramQuery::Kind::AND:
+		for (const auto &child : query.children) {
+			if (!page_filter_matches(filter, child)) {
+				return false;
+			}
+		}
+		return true;
+	case TrigramQuery::Kind::OR:
+		for (const auto &child : query.children) {
+			if (page_filter_matches(filter, child)) {
+				return true;
+			}
+		}
+		return false;
+	}
+	return true;
+}
+
+/* The planner
+ *
+ * For every part of the pattern, the planner either knows the set of all
+ * strings that it matches, if there are few of them, or a query that its
+ * matches fulfill. Sets are combined into larger ones as long as possible,
+ * so that trigrams across the parts are found, too (e.g. "ab[cd]" is the set
+ * {abc, abd}). The strings are folded like the text in the index.
+ */
+
+namespace {
+
+struct PlanInfo {
+	// true if `strings` are all strings that the part can match
+	bool exact = false;
+	set<string> strings;
+	// otherwise, the query that its matches fulfill
+	TrigramQuery query;
+};
+
+class RegexPlanner {
+public:
+	RegexPlanner(const string &pattern, RegexSyntax syntax, bool case_insensitive)
+		: pattern(pattern), syntax(syntax), case_insensitive(case_insensitive),
+		  utf8(syntax == RegexSyntax::PCRE || MB_CUR_MAX > 1) {}
+
+	// Returns false if the pattern uses something the planner doesn't know
+	bool plan(TrigramQuery &query);
+
+private:
+	bool parse_alternation(PlanInfo &info);
+	bool parse_concatenation(PlanInfo &info);
+	bool parse_repetition(PlanInfo &info);
+	bool parse_interval(size_t &min, size_t &max);
+	bool parse_atom(PlanInfo &info);
+	bool parse_bracket(PlanInfo &info);
+	bool parse_escape(PlanInfo &info);
+	// The next character (one byte or a UTF-8 sequence)
+	string next_char();
+
+	PlanInfo character(const string &c) const;
+
+	const string &pattern;
+	size_t pos = 0;
+	RegexSyntax syntax;
+	bool case_insensitive;
+	bool utf8;
+};
+
+}
+
+static PlanInfo exact(set<string> strings) {
+	PlanInfo info;
+	info.exact = true;
+	info.strings = std::move(strings);
+	return info;
+}
+
+static PlanInfo empty_string() {
+	return exact({ "" });
+}
+
+// Anything, e.g. "." or "\w"
+static PlanInfo any() {
+	return PlanInfo();
+}
+
+static TrigramQuery string_query(const string &s) {
+	TrigramQuery q;
+	for (size_t i = 0; i + 3 <= s.size(); i++) {
+		uint32_t t = static_cast<unsigned char>(s[i]) << 16
+			| static_cast<unsigned char>(s[i + 1]) << 8
+			| static_cast<unsigned char>(s[i + 2]);
+		q = TrigramQuery::both(std::move(q), TrigramQuery::of_trigram(t));
+	}
+	return q;
+}
+
+static TrigramQuery to_query(const PlanInfo &info) {
+	if (!info.exact) {
+		return info.query;
+	}
+
+	TrigramQuery q;
+	bool first = true;
+	for (const string &s : info.strings) {
+		TrigramQuery sq = string_query(s);
+		q = first ? std::move(sq) : TrigramQuery::either(std::move(q), std::move(sq));
+		first = false;
+	}
+	return q;
+}
+
+// All concatenations of a string of a and one of b
+static set<string> product(const set<string> &a, const set<string> &b) {
+	set<string> strings;
+	for (const string &x : a) {
+		for (const string &y : b) {
+			strings.insert(x + y);
+		}
+	}
+	return strings;
+}
+
+static PlanInfo alternate(const PlanInfo &a, const PlanInfo &b) {
+	if (a.exact && b.exact && a.strings.size() + b.strings.size() <= MAX_EXACT) {
+		set<string> strings = a.strings;
+		strings.insert(b.strings.begin(), b.strings.end());
+		return exact(std::move(strings));
+	}
+
+	PlanInfo info;
+	info.query = TrigramQuery::either(to_query(a), to_query(b));
+	return info;
+}
+
+// x{min,max}, where max is SIZE_MAX for no limit
+static PlanInfo repeat(const PlanInfo &x, size_t min, size_t max) {
+	if (min == 0) {
+		if (max == 1 && x.exact && x.strings.size() < MAX_EXACT) {
+			PlanInfo info = x;
+			info.strings.insert("");
+			return info;
+		}
+		return any();
+	}
+
+	// Every match contains at least one match of x
+	PlanInfo info;
+	info.query = to_query(x);
+	return info;
+}
+
+bool RegexPlanner::plan(TrigramQuery &query)
+{
+	PlanInfo info;
+	if (!parse_alternation(info) || pos != pattern.size()) {
+		return false;
+	}
+	query = to_query(info);
+	return true;
+}
+
+bool RegexPlanner::parse_alternation(PlanInfo &info)
+{
+	if (!parse_concatenation(info)) {
+		return false;
+	}
+	while (pos < pattern.size() && pattern[pos] == '|') {
+		pos++;
+		PlanInfo next;
+		if (!parse_concatenation(next)) {
+			return false;
+		}
+		info = alternate(info, next);
+	}
+	return true;
+}
+
+bool RegexPlanner::parse_concatenation(PlanInfo &info)
+{
+	// The strings of the parts since the last one that isn't exact, which
+	// are combined as long as there are few of them, and the query of the
+	// parts before.
+	set<string> run = { "" };
+	TrigramQuery query;
+	bool is_exact = true;
+
+	while (pos < pattern.size() && pattern[pos] != '|' && pattern[pos] != ')') {
+		PlanInfo next;
+		if (!parse_repetition(next)) {
+			return false;
+		}
+
+		if (next.exact && run.size() * next.strings.size() <= MAX_EXACT) {
+			run = product(run, next.strings);
+			continue;
+		}
+
+		is_exact = false;
+		query = TrigramQuery::both(std::move(query), to_query(exact(run)));
+		if (next.exact) {
+			run = next.strings;
+		} else {
+			query = TrigramQuery::both(std::move(query), next.query);
+			run = { "" };
+		}
+	}
+
+	if (is_exact) {
+		info = exact(run);
+	} else {
+		info = PlanInfo();
+		info.query = TrigramQuery::both(std::move(query), to_query(exact(run)));
+	}
+	return true;
+}
+
+bool RegexPlanner::parse_repetition(PlanInfo &info)
+{
+	if (!parse_atom(info)) {
+		return false;
+	}
+
+	while (pos < pattern.size()) {
+		size_t min, max;
+		switch (pattern[pos]) {
+		case '*':
+			min = 0;
+			max = SIZE_MAX;
+			pos++;
+			break;
+		case '+':
+			min = 1;
+			max = SIZE_MAX;
+			pos++;
+			break;
+		case '?':
+			min = 0;
+			max = 1;
+			pos++;
+			break;
+		case '{':
+			if (!parse_interval(min, max)) {
+				return false;
+			}
+			break;
+		default:
+			return true;
+		}
+
+		info = repeat(info, min, max);
+
+		// lazy and possessive quantifiers
+		if (syntax == RegexSyntax::PCRE && pos < pattern.size()
+		    && (pattern[pos] == '?' || pattern[pos] == '+')) {
+			pos++;
+		}
+	}
+	return true;
+}
+
+// {n}, {n,} or {n,m}
+bool RegexPlanner::parse_interval(size_t &min, size_t &max)
+{
+	size_t end = pattern.find('}', pos);
+	if (end == string::npos) {
+		return false;
+	}
+
+	string spec = pattern.substr(pos + 1, end - pos - 1);
+	size_t comma = spec.find(',');
+	string low = spec.substr(0, comma);
+	if (low.empty() || low.find_first_not_of("0123456789") != string::npos
+	    || low.size() > 6) {
+		return false;
+	}
+	min = stoul(low);
+	max = min;
+	if (comma != string::npos) {
+		string high = spec.substr(comma + 1);
+		if (high.empty()) {
+			max = SIZE_MAX;
+		} else if (high.find_first_not_of("0123456789") != string::npos
+		           || high.size() > 6) {
+			return false;
+		} else {
+			max = stoul(high);
+		}
+	}
+
+	pos = end + 1;
+	return true;
+}
+
+string RegexPlanner::next_char()
+{
+	size_t len = 1;
+	unsigned char c = pattern[pos];
+	if (utf8 && c >= 0xc0) {
+		len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+	}
+	string result = pattern.substr(pos, len);
+	pos += result.size();
+	return result;
+}
+
+/* The info for a character of the pattern. With case-insensitive matching,
+ * non-ASCII letters may match other bytes, and so may some ASCII letters,
+ * e.g. "k" matches the Kelvin sign with PCRE and "s" the long s with glibc. */
+PlanInfo RegexPlanner::character(const string &c) const
+{
+	unsigned char first = c[0];
+	bool other_case = first >= 0x80 || (first != 0 && strchr("iks", fold(first)) != nullptr);
+	if (case_insensitive && other_case) {
+		return any();
+	}
+
+	string folded = c;
+	folded[0] = fold(first);
+	return exact({ folded });
+}
+
+bool RegexPlanner::parse_atom(PlanInfo &info)
+{
+	char c = pattern[pos];
+	switch (c) {
+	case '(':
+		pos++;
+		if (pos < pattern.size() && pattern[pos] == '?') {
+			// Only non-capturing groups, no lookarounds or flags
+			if (syntax != RegexSyntax::PCRE || pos + 1 >= pattern.size()
+			    || pattern[pos + 1] != ':') {
+				return false;
+			}
+			pos += 2;
+		}
+		if (!parse_alternation(info) || pos >= pattern.size() || pattern[pos] != ')') {
+			return false;
+		}
+		pos++;
+		return true;
+	case '.':
+		pos++;
+		info = any();
+		return true;
+	case '^':
+	case '$':
+		pos++;
+		info = empty_string();
+		return true;
+	case '[':
+		return parse_bracket(info);
+	case '\\':
+		return parse_escape(info);
+	case '*':
+	case '+':
+	case '?':
+	case '{':
+	case ')':
+		return false;
+	default:
+		info = character(next_char());
+		return true;
+	}
+}
+
+bool RegexPlanner::parse_escape(PlanInfo &info)
+{
+	pos++;
+	if (pos >= pattern.size()) {
+		return false;
+	}
+
+	const char *classes;
+	const char *anchors;
+	const char *escapes = "";
+	const char *chars = "";
+	if (syntax == RegexSyntax::PCRE) {
+		classes = "dDwWsShHvVNRX";
+		anchors = "bBAzZGK";
+		escapes = "tnrfea";
+		chars = "\t\n\r\f\x1b\a";
+	} else {
+		// GNU extensions
+		classes = "wWsS";
+		anchors = "bB<>`'";
+	}
+
+	unsigned char c = pattern[pos];
+	if (c != 0 && strchr(classes, c) != nullptr) {
+		pos++;
+		info = any();
+		return true;
+	}
+	if (c != 0 && strchr(anchors, c) != nullptr) {
+		pos++;
+		info = empty_string();
+		return true;
+	}
+	const char *escape = c != 0 ? strchr(escapes, c) : nullptr;
+	if (escape != nullptr) {
+		pos++;
+		info = character(string(1, chars[escape - escapes]));
+		return true;
+	}
+
+	// back references
+	if (c >= '1' && c <= '9') {
+		pos++;
+		if (syntax == RegexSyntax::PCRE && pos < pattern.size() && isdigit(pattern[pos])) {
+			// may be an octal escape
+			return false;
+		}
+		info = any();
+		return true;
+	}
+
+	if (isalnum(c)) {
+		return false;
+	}
+
+	// an escaped special character or any other character
+	info = character(next_char());
+	return true;
+}
+
+bool RegexPlanner::parse_bracket(PlanInfo &info)
+{
+	pos++;
+	bool negated = false;
+	if (pos < pattern.size() && pattern[pos] == '^') {
+		negated = true;
+		pos++;
+	}
+
+	// the characters of the bracket, unless there are too many of them
+	set<string> chars;
+	bool large = negated;
+	bool first = true;
+
+	while (true) {
+		if (pos >= pattern.size()) {
+			return false;
+		}
+		if (pattern[pos] == ']' && !first) {
+			pos++;
+			break;
+		}
+		first = false;
+
+		if (pattern.compare(pos, 2, "[:") == 0) {
+			size_t end = pattern.find(":]", pos + 2);
+			if (end == string::npos) {
+				return false;
+			}
+			pos = end + 2;
+			large = true;
+			continue;
+		}
+		if (pattern.compare(pos, 2, "[=") == 0 || pattern.compare(pos, 2, "[.") == 0) {
+			return false;
+		}
+
+		string c;
+		if (syntax == RegexSyntax::PCRE && pattern[pos] == '\\') {
+			pos++;
+			if (pos >= pattern.size()) {
+				return false;
+			}
+			if (isalnum(static_cast<unsigned char>(pattern[pos]))) {
+				// a class like \d or an escape like \n
+				pos++;
+				large = true;
+				continue;
+			}
+		}
+		c = next_char();
+
+		// a range
+		if (pos + 1 < pattern.size() && pattern[pos] == '-' && pattern[pos + 1] != ']') {
+			pos++;
+			if (pattern[pos] == '\\' || pattern[pos] == '[') {
+				return false;
+			}
+			string last = next_char();
+			if (c.size() != 1 || last.size() != 1) {
+				large = true;
+				continue;
+			}
+			unsigned char from = c[0];
+			unsigned char to = last[0];
+			if (to >= from && static_cast<size_t>(to - from) >= MAX_EXACT) {
+				large = true;
+				continue;
+			}
+			for (unsigned b = from; b <= to; b++) {
+				chars.insert(string(1, static_cast<char>(b)));
+			}
+			continue;
+		}
+
+		chars.insert(c);
+	}
+
+	if (large || chars.size() > MAX_EXACT) {
+		info = any();
+		return true;
+	}
+
+	info = exact({});
+	for (const string &c : chars) {
+		info = alternate(info, character(c));
+	}
+	return true;
+}
+
+TrigramQuery plan_regex(const string &pattern, RegexSyntax syntax, bool case_insensitive)
+{
+	TrigramQuery query;
+	RegexPlanner planner(pattern, syntax, case_insensitive);
+	if (!planner.plan(query)) {
+		return TrigramQuery::all();
+	}
+	return query;
+}
+
+TrigramQuery plan_literal(const string &literal, bool case_insensitive)
+{
+	// strcasestr() only ignores the case of single bytes
+	string folded;
+	for (char c : literal) {
+		if (case_insensitive && static_cast<unsigned char>(c) >= 0x80) {
+			// Split the literal there
+			TrigramQuery rest = plan_literal(literal.substr(folded.size() + 1), true);
+			return TrigramQuery::both(string_query(folded), rest);
+		}
+		folded += fold(c);
+	}
+	return string_query(folded);
+}
+
+/* Reading the index */
+
+TrigramIndex::TrigramIndex(const string &cache_directory)
+{
+	map_file(cache_directory + INDEX_FILE);
+	if (data != nullptr) {
+		delta.reset(new TrigramIndex());
+		delta->map_file(cache_directory + DELTA_FILE);
+		if (!delta->is_open()) {
+			delta.reset();
+		}
+	}
+}
+
+void TrigramIndex::map_file(const string &path)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < HEADER_SIZE) {
+		close(fd);
+		return;
+	}
+
+	void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return;
+	}
+	data = static_cast<const char *>(map);
+	size = st.st_size;
+
+	uint64_t documents = get_le(data + 8, 8);
+	uint64_t trigrams = get_le(data + 16, 8);
+	uint64_t bitmaps = get_le(data + 32, 8);
+	uint64_t table = get_le(data + 40, 8);
+	uint64_t lists = get_le(data + 48, 8);
+
+	if (memcmp(data, MAGIC, 8) != 0
+	    || documents > MAX_DOCUMENTS || bitmaps != HEADER_SIZE + documents * DOC_SIZE
+	    || bitmaps > lists || lists > table || table > size
+	    || trigrams > (size - table) / TABLE_ENTRY_SIZE) {
+		err() << "warning: " << path << " is damaged, not using it" << endl;
+		munmap(map, size);
+		data = nullptr;
+	}
+}
+
+TrigramIndex::~TrigramIndex()
+{
+	if (data != nullptr) {
+		munmap(const_cast<char *>(data), size);
+	}
+}
+
+TrigramIndexStats TrigramIndex::stats() const
+{
+	TrigramIndexStats stats;
+	if (data != nullptr) {
+		stats.documents = get_le(data + 8, 8);
+		stats.trigrams = get_le(data + 16, 8);
+		stats.pages = get_le(data + 24, 8);
+		stats.bytes = size;
+	}
+	// The trigrams of the delta are mostly in the index, too, and
+	// aren't counted
+	if (delta != nullptr) {
+		TrigramIndexStats more = delta->stats();
+		stats.documents += more.documents;
+		stats.pages += more.pages;
+		stats.bytes += more.bytes;
+	}
+	return stats;
+}
+
+bool TrigramIndex::find_document(const string &name, uint64_t &doc) const
+{
+	const char *docs = data + HEADER_SIZE;
+	uint64_t low = 0;
+	uint64_t high = get_le(data + 8, 8);
+
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+		const char *record = docs + mid * DOC_SIZE;
+		size_t len = min(static_cast<size_t>(static_cast<unsigned char>(record[0])), MAX_NAME_SIZE);
+		int cmp = string_view(record + 1, len).compare(name);
+		if (cmp == 0) {
+			doc = mid;
+			return true;
+		}
+		if (cmp < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return false;
+}
+
+const char *TrigramIndex::find_trigram(uint32_t trigram) const
+{
+	const char *table = data + get_le(data + 40, 8);
+	uint64_t low = 0;
+	uint64_t high = get_le(data + 16, 8);
+
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+		const char *entry = table + mid * TABLE_ENTRY_SIZE;
+		uint32_t t = get_le(entry, 4);
+		if (t == trigram) {
+			return entry;
+		}
+		if (t < trigram) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return nullptr;
+}
+
+void TrigramIndex::postings(uint32_t trigram, PageList &pages) const
+{
+	pages.clear();
+	const char *entry = find_trigram(trigram);
+	if (entry == nullptr) {
+		return;
+	}
+
+	uint64_t count = get_le(entry + 4, 4);
+	const char *p = data + get_le(data + 48, 8) + get_le(entry + 8, 8);
+	const char *end = data + get_le(data + 40, 8);
+	pages.reserve(count);
+
+	uint64_t value = 0;
+	while (pages.size() < count && p < end) {
+		uint64_t delta = 0;
+		int shift = 0;
+		while (p < end && shift < 64) {
+			unsigned char byte = *p++;
+			delta |= static_cast<uint64_t>(byte & 0x7f) << shift;
+			shift += 7;
+			if ((byte & 0x80) == 0) {
+				break;
+			}
+		}
+		value += delta;
+		pages.push_back(value);
+	}
+}
+
+size_t TrigramIndex::estimate(const TrigramQuery &query) const
+{
+	switch (query.kind) {
+	case TrigramQuery::Kind::ALL:
+		return SIZE_MAX;
+	case TrigramQuery::Kind::TRIGRAM: {
+		const char *entry = find_trigram(query.trigram);
+		return entry == nullptr ? 0 : get_le(entry + 4, 4);
+	}
+	case TrigramQuery::Kind::AND: {
+		size_t result = SIZE_MAX;
+		for (const auto &child : query.children) {
+			result = min(result, estimate(child));
+		}
+		return result;
+	}
+	case TrigramQuery::Kind::OR: {
+		size_t result = 0;
+		for (const auto &child : query.children) {
+			size_t e = estimate(child);
+			result = e > SIZE_MAX - result ? SIZE_MAX : result + e;
+		}
+		return result;
+	}
+	}
+	return SIZE_MAX;
+}
+
+bool TrigramIndex::evaluate(const TrigramQuery &query, PageList &pages) const
+{
+	PageList other, merged;
+
+	switch (query.kind) {
+	case TrigramQuery::Kind::ALL:
+		return false;
+
+	case TrigramQuery::Kind::TRIGRAM:
+		postings(query.trigram, pages);
+		return true;
+
+	case TrigramQuery::Kind::OR:
+		pages.clear();
+		for (const auto &child : query.children) {
+			if (!evaluate(child, other)) {
+				return false;
+			}
+			merged.clear();
+			set_union(pages.begin(), pages.end(), other.begin(), other.end(),
+			          back_inserter(merged));
+			pages.swap(merged);
+		}
+		return true;
+
+	case TrigramQuery::Kind::AND: {
+		// Start with the rarest part
+		vector<pair<size_t, const TrigramQuery *>> parts;
+		for (const auto &child : query.children) {
+			parts.emplace_back(estimate(child), &child);
+		}
+		sort(parts.begin(), parts.end(),
+		     [](const auto &a, const auto &b) { return a.first < b.first; });
+
+		bool restricted = false;
+		for (const auto &part : parts) {
+			if (restricted && (pages.empty()
+			                   || part.first / SKIP_FACTOR > pages.size() + SKIP_MIN)) {
+				break;
+			}
+			if (!evaluate(*part.second, restricted ? other : pages)) {
+				continue;
+			}
+			if (restricted) {
+				merged.clear();
+				set_intersection(pages.begin(), pages.end(), other.begin(), other.end(),
+				                 back_inserter(merged));
+				pages.swap(merged);
+			}
+			restricted = true;
+		}
+		return restricted;
+	}
+	}
+	return false;
+}
+
+bool TrigramIndex::set_query(const TrigramQuery &query)
+{
+	candidates.clear();
+	bool narrowed = data != nullptr && evaluate(query, candidates);
+	return narrowed && (delta == nullptr || delta->set_query(query));
+}
+
+size_t TrigramIndex::candidate_count() const
+{
+	return candidates.size() + (delta != nullptr ? delta->candidate_count() : 0);
+}
+
+bool TrigramIndex::select_pages(const string &cache_file, const IntervalContainer &range,
+                                IntervalContainer &pages) const
+{
+	string name = cache_file.substr(cache_file.rfind('/') + 1);
+	uint64_t doc;
+	if (delta != nullptr && delta->find_document(name, doc)) {
+		return delta->select_pages(cache_file, range, pages);
+	}
+	if (!find_document(name, doc)) {
+		pages = range;
+		return true;
+	}
+
+	const char *record = data + HEADER_SIZE + doc * DOC_SIZE;
+	uint64_t page_count = get_le(record + 56, 4);
+	uint64_t indexed_pages = min(page_count, MAX_PAGE);
+	const char *bitmap = data + get_le(data + 32, 8) + get_le(record + 48, 8);
+	if (bitmap + (indexed_pages + 7) / 8 > data + get_le(data + 48, 8)) {
+		pages = range;
+		return true;
+	}
+
+	auto candidate = lower_bound(candidates.begin(), candidates.end(), doc << PAGE_BITS);
+
+	pages = IntervalContainer();
+	bool found = false;
+	// the pages found last, which aren't added yet
+	uint64_t from = 0, to = 0;
+
+	for (uint64_t pagenum = 1; pagenum <= page_count; pagenum++) {
+		if (!range.contains(pagenum)) {
+			continue;
+		}
+
+		bool keep = true;
+		uint64_t bit = pagenum - 1;
+		if (pagenum <= indexed_pages && (bitmap[bit / 8] & (1 << (bit % 8)))) {
+			uint64_t key = doc << PAGE_BITS | pagenum;
+			while (candidate != candidates.end() && *candidate < key) {
+				++candidate;
+			}
+			keep = candidate != candidates.end() && *candidate == key;
+		}
+		if (!keep) {
+			continue;
+		}
+
+		if (found && to + 1 == pagenum) {
+			to = pagenum;
+			continue;
+		}
+		if (found) {
+			pages.addInterval(Interval(from, to));
+		}
+		from = to = pagenum;
+		found = true;
+	}
+
+	if (found) {
+		pages.addInterval(Interval(from, to));
+	}
+	return found;
+}
+
+/* Building the index */
+
+namespace {
+
+/* Sorts the keys trigram << 40 | document << 16 | page, in runs on disk if
+ * there are too many for memory */
+class KeySorter {
+public:
+	explicit KeySorter(const string &directory) : directory(directory) {}
+	~KeySorter();
+
+	bool add(uint64_t key);
+	// Call `emit` for each key in order
+	template<typename F> bool finish(F emit);
+
+private:
+	struct Run {
+		Run(int fd, uint64_t size) : fd(fd), size(size) {}
+
+		int fd;
+		uint64_t size;
+		uint64_t read = 0;
+		vector<uint64_t> buffer;
+		size_t pos = 0;
+
+		bool next(uint64_t &key);
+	};
+
+	bool write_run();
+
+	string directory;
+	vector<uint64_t> keys;
+	vector<Run> runs;
+};
+
+}
+
+KeySorter::~KeySorter()
+{
+	for (const Run &run : runs) {
+		close(run.fd);
+	}
+}
+
+bool KeySorter::add(uint64_t key)
+{
+	keys.push_back(key);
+	return keys.size() < RUN_SIZE || write_run();
+}
+
+bool KeySorter::write_run()
+{
+	sort(keys.begin(), keys.end());
+
+	// The runs are removed right away and only kept open
+	string tmp = directory + ".trigrams-run.XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	if (fd < 0) {
+		return false;
+	}
+	unlink(tmp.c_str());
+
+	string buf(keys.size() * 8, '\0');
+	for (size_t i = 0; i < keys.size(); i++) {
+		put_le(&buf[i * 8], keys[i], 8);
+	}
+	if (!write_all(fd, buf.data(), buf.size())) {
+		close(fd);
+		return false;
+	}
+
+	runs.emplace_back(fd, keys.size());
+	keys.clear();
+	return true;
+}
+
+bool KeySorter::Run::next(uint64_t &key)
+{
+	if (pos == buffer.size()) {
+		if (read == size) {
+			return false;
+		}
+		size_t n = min(static_cast<uint64_t>(RUN_BUFFER), size - read);
+		string buf(n * 8, '\0');
+		if (pread(fd, &buf[0], buf.size(), read * 8) != static_cast<ssize_t>(buf.size())) {
+			return false;
+		}
+		buffer.resize(n);
+		for (size_t i = 0; i < n; i++) {
+			buffer[i] = get_le(&buf[i * 8], 8);
+		}
+		read += n;
+		pos = 0;
+	}
+	key = buffer[pos++];
+	return true;
+}
+
+template<typename F> bool KeySorter::finish(F emit)
+{
+	if (runs.empty()) {
+		sort(keys.begin(), keys.end());
+		for (uint64_t key : keys) {
+			emit(key);
+		}
+		return true;
+	}
+
+	if (!keys.empty() && !write_run()) {
+		return false;
+	}
+
+	// Merge the runs
+	typedef pair<uint64_t, size_t> Head;
+	priority_queue<Head, vector<Head>, greater<Head>> heads;
+	for (size_t i = 0; i < runs.size(); i++) {
+		uint64_t key;
+		if (runs[i].next(key)) {
+			heads.emplace(key, i);
+		}
+	}
+
+	size_t done = 0;
+	while (!heads.empty()) {
+		Head head = heads.top();
+		heads.pop();
+		emit(head.first);
+		done++;
+
+		uint64_t key;
+		if (runs[head.second].next(key)) {
+			heads.emplace(key, head.second);
+		}
+	}
+
+	size_t total = 0;
+	for (const Run &run : runs) {
+		total += run.size;
+	}
+	return done == total;
+}
+
+namespace {
+
+// Writes a file sequentially through a buffer
+struct FileWriter {
+	explicit FileWriter(int fd) : fd(fd) {}
+
+	int fd;
+	string buffer;
+	uint64_t offset = 0;
+	bool ok = true;
+
+	void write(const char *data, size_t len) {
+		buffer.append(data, len);
+		offset += len;
+		if (buffer.size() >= RUN_BUFFER * 8) {
+			flush();
+		}
+	}
+
+	void flush() {
+		ok = ok && write_all(fd, buffer.data(), buffer.size());
+		buffer.clear();
+	}
+};
+
+}
+
+// The names of all entries in the cache store of `opts`, sorted
+static vector<string> store_entry_names(const Options &opts)
+{
+	vector<string> names = opts.cache_store == CacheStore::PACK
+		? get_cache_pack(opts.cache_directory).entry_names()
+		: get_cache_index(opts.cache_directory).entry_names();
+	sort(names.begin(), names.end());
+	return names;
+}
+
+bool TrigramIndex::build(const Options &opts, TrigramIndexStats &stats)
+{
+	if (!write_index(opts, store_entry_names(opts), INDEX_FILE, stats)) {
+		return false;
+	}
+	// The new index covers the delta
+	unlink((opts.cache_directory + DELTA_FILE).c_str());
+	return true;
+}
+
+bool TrigramIndex::update(const Options &opts, TrigramIndexStats &stats, bool &rebuilt)
+{
+	rebuilt = true;
+	TrigramIndex index(opts.cache_directory);
+	if (!index.is_open()) {
+		return build(opts, stats);
+	}
+
+	vector<string> added;
+	for (string &name : store_entry_names(opts)) {
+		uint64_t doc;
+		if (!index.find_document(name, doc)) {
+			added.push_back(std::move(name));
+		}
+	}
+
+	if (added.size() > max(MIN_DELTA_DOCUMENTS, index.stats().documents / DELTA_FRACTION)) {
+		return build(opts, stats);
+	}
+	rebuilt = false;
+	return write_index(opts, added, DELTA_FILE, stats);
+}
+
+/* Write the index of the entries `names`, which are sorted, to the file `file`
+ * in the cache directory */
+bool TrigramIndex::write_index(const Options &opts, const vector<string> &names,
+                               const string &file, TrigramIndexStats &stats)
+{
+	const string &directory = opts.cache_directory;
+	KeySorter sorter(directory);
+	string documents;
+	string bitmaps;
+	vector<uint32_t> trigrams;
+	stats = TrigramIndexStats();
+
+	for (const string &name : names) {
+		if (stats.documents == MAX_DOCUMENTS || name.size() > MAX_NAME_SIZE) {
+			break;
+		}
+
+		// Encrypted PDFs are always opened to check the password
+		unique_ptr<Cache> cache = open_cache(opts, directory + name);
+		uint64_t page_count = cache->get_page_count();
+		if (page_count == 0 || cache->is_encrypted()) {
+			continue;
+		}
+
+		uint64_t doc = stats.documents;
+		uint64_t indexed_pages = min(page_count, MAX_PAGE);
+		string bitmap((indexed_pages + 7) / 8, '\0');
+
+		for (uint64_t pagenum = 1; pagenum <= indexed_pages; pagenum++) {
+			CachePageView page;
+			if (!cache->get_page_view(pagenum, page)) {
+				continue;
+			}
+
+			trigrams.clear();
+			text_trigrams(page.text, trigrams);
+			for (uint32_t t : trigrams) {
+				if (!sorter.add(static_cast<uint64_t>(t) << TRIGRAM_SHIFT
+				                | doc << PAGE_BITS | pagenum)) {
+					err() << "Could not write to " << directory << ": "
+					      << strerror(errno) << endl;
+					return false;
+				}
+			}
+			bitmap[(pagenum - 1) / 8] |= 1 << ((pagenum - 1) % 8);
+			stats.pages++;
+		}
+
+		string record(DOC_SIZE, '\0');
+		record[0] = static_cast<char>(name.size());
+		name.copy(&record[1], name.size());
+		put_le(&record[48], bitmaps.size(), 8);
+		put_le(&record[56], page_count, 4);
+		documents += record;
+		bitmaps += bitmap;
+		stats.documents++;
+	}
+
+	string path = directory + file;
+	string tmp = path + ".XXXXXX";
+	int fd = create_temp_file(tmp);
+	if (fd < 0) {
+		err() << "Could not create " << tmp << ": " << strerror(errno) << endl;
+		return false;
+	}
+
+	FileWriter out(fd);
+	string header(HEADER_SIZE, '\0');
+	out.write(header.data(), header.size());
+	out.write(documents.data(), documents.size());
+	out.write(bitmaps.data(), bitmaps.size());
+	uint64_t lists = out.offset;
+
+	string table;
+	uint64_t current = UINT64_MAX;
+	uint64_t previous = 0;
+	uint64_t count = 0;
+	char entry[TABLE_ENTRY_SIZE] = {};
+
+	auto end_trigram = [&] {
+		if (count > 0) {
+			put_le(entry + 4, count, 4);
+			table.append(entry, TABLE_ENTRY_SIZE);
+		}
+	};
+
+	bool sorted = sorter.finish([&](uint64_t key) {
+		uint64_t trigram = key >> TRIGRAM_SHIFT;
+		uint64_t value = key & ((uint64_t(1) << TRIGRAM_SHIFT) - 1);
+		if (trigram != current) {
+			end_trigram();
+			current = trigram;
+			previous = 0;
+			count = 0;
+			put_le(entry, trigram, 4);
+			put_le(entry + 8, out.offset - lists, 8);
+		}
+
+		char varint[10];
+		size_t len = 0;
+		uint64_t delta = value - previous;
+		do {
+			varint[len++] = static_cast<char>((delta & 0x7f) | (delta >= 0x80 ? 0x80 : 0));
+			delta >>= 7;
+		} while (delta > 0);
+		out.write(varint, len);
+
+		previous = value;
+		count++;
+	});
+	end_trigram();
+
+	uint64_t table_offset = out.offset;
+	out.write(table.data(), table.size());
+	out.flush();
+	stats.trigrams = table.size() / TABLE_ENTRY_SIZE;
+	stats.bytes = out.offset;
+
+	memcpy(&header[0], MAGIC, 8);
+	put_le(&header[8], stats.documents, 8);
+	put_le(&header[16], stats.trigrams, 8);
+	put_le(&header[24], stats.pages, 8);
+	put_le(&header[32], HEADER_SIZE + documents.size(), 8);
+	put_le(&header[40], table_offset, 8);
+	put_le(&header[48], lists, 8);
+
+	bool ok = sorted && out.ok
+		&& pwrite(fd, header.data(), header.size(), 0) == static_cast<ssize_t>(header.size());
+	if (close(fd) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+		err() << "Could not write " << path << ": " << strerror(errno) << endl;
+		unlink(tmp.c_str());
+		forget_temp_file(tmp);
+		return false;
+	}
+	forget_temp_file(tmp);
+	return true;
+}
@@ -0,0 +1,173 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "intervals.h"
+#include "pdfgrep.h"
+
+/** A condition on the trigrams of a page, which every page that a pattern
+ * matches in fulfills.
+ *
+ * Trigrams are three consecutive bytes of the text, with ASCII letters in
+ * lower case. A page fulfills TRIGRAM if the trigram occurs in its text, AND
+ * if all children are fulfilled and OR if any of them is. ALL is fulfilled by
+ * every page, i.e. the pattern can't be narrowed down.
+ */
+struct TrigramQuery {
+	enum class Kind {
+		ALL,
+		TRIGRAM,
+		AND,
+		OR
+	};
+
+	Kind kind = Kind::ALL;
+	uint32_t trigram = 0;
+	std::vector<TrigramQuery> children;
+
+	static TrigramQuery all() { return TrigramQuery(); }
+	static TrigramQuery of_trigram(uint32_t trigram);
+	// Both are simplified, e.g. "a AND ALL" is "a"
+	static TrigramQuery both(TrigramQuery a, TrigramQuery b);
+	static TrigramQuery either(TrigramQuery a, TrigramQuery b);
+
+	bool is_all() const { return kind == Kind::ALL; }
+	// e.g. "abc" AND ("def" OR "xyz"), for --debug
+	std::string to_string() const;
+};
+
+// The regex dialects that plan_regex() understands
+enum class RegexSyntax {
+	POSIX_EXTENDED,
+	PCRE
+};
+
+/* The query for a regex. Constructs that the planner doesn't know, like
+ * lookarounds or inline flags, make it ALL. */
+TrigramQuery plan_regex(const std::string &pattern, RegexSyntax syntax, bool case_insensitive);
+
+/* The query for a fixed string */
+TrigramQuery plan_literal(const std::string &literal, bool case_insensitive);
+
+/** Bloom filters of the trigrams of a page.
+ *
+ * The cache stores one next to each page (see cache.cc), so that a page that
+ * lacks a trigram of the pattern can be skipped without reading its text. A
+ * filter can report trigrams that the page doesn't have, but never misses
+ * one. The filter of a page without trigrams has no bits and no trigram is in
+ * it. */
+std::string build_page_filter(std::string_view text);
+
+/* False if the page of `filter` can't fulfill `query`. An empty filter means
+ * that the page has none, which fulfills any query. */
+bool page_filter_matches(std::string_view filter, const TrigramQuery &query);
+
+struct TrigramIndexStats {
+	size_t documents = 0;
+	size_t pages = 0;
+	size_t trigrams = 0;
+	uint64_t bytes = 0;
+};
+
+/** The trigram index of the cache.
+ *
+ * The index is the file .trigrams in the cache directory (see the format in
+ * trigram.cc), which build() writes from all entries of a cache store. For
+ * every trigram, it lists the pages that contain it. The entries are named
+ * by the checksum of the PDF, so the index stays valid for the PDFs it
+ * covers, even if their entries are evicted from the cache later. PDFs and
+ * pages that were cached after the index was built simply aren't covered and
+ * are searched as usual.
+ *
+ * update() adds the PDFs that were cached since then without building the
+ * whole index again, see trigram.cc.
+ */
+class TrigramIndex {
+public:
+	// Maps the index of `cache_directory`, if there is one
+	explicit TrigramIndex(const std::string &cache_directory);
+	~TrigramIndex();
+
+	TrigramIndex(const TrigramIndex &) = delete;
+	TrigramIndex &operator=(const TrigramIndex &) = delete;
+
+	bool is_open() const { return data != nullptr; }
+
+	/* Find the pages that fulfill `query`. Returns false if it can't
+	 * narrow down the pages, e.g. because it is ALL. */
+	bool set_query(const TrigramQuery &query);
+
+	/* Set `pages` to the pages of the cache entry `cache_file` that have
+	 * to be searched: those in `range` that fulfill the query or aren't
+	 * covered by the index. Returns false if there are none, i.e. the PDF
+	 * can't contain a match. */
+	bool select_pages(const std::string &cache_file, const IntervalContainer &range,
+	                  IntervalContainer &pages) const;
+
+	// Number of pages that fulfill the query
+	size_t candidate_count() const;
+	TrigramIndexStats stats() const;
+
+	/* Write a new index of all entries in the cache store of `opts`. */
+	static bool build(const Options &opts, TrigramIndexStats &stats);
+
+	/* Add the entries that the index doesn't cover yet. This only indexes
+	 * them, unless there are so many that build() is cheaper in the long
+	 * run. `rebuilt` tells which one was done, and `stats` are those of
+	 * the new entries or of the whole new index. */
+	static bool update(const Options &opts, TrigramIndexStats &stats, bool &rebuilt);
+
+private:
+	TrigramIndex() {}
+
+	void map_file(const std::string &path);
+	static bool write_index(const Options &opts, const std::vector<std::string> &names,
+	                        const std::string &file, TrigramIndexStats &stats);
+
+	// Document number and page of a candidate, see trigram.cc
+	typedef std::vector<uint64_t> PageList;
+
+	bool find_document(const std::string &name, uint64_t &doc) const;
+	size_t estimate(const TrigramQuery &query) const;
+	bool evaluate(const TrigramQuery &query, PageList &pages) const;
+	void postings(uint32_t trigram, PageList &pages) const;
+	const char *find_trigram(uint32_t trigram) const;
+
+	const char *data = nullptr;
+	size_t size = 0;
+	PageList candidates;
+	// the index of the entries added by update(), if there is one
+	std::unique_ptr<TrigramIndex> delta;
+};
+
+#endif /* TRIGRAM_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
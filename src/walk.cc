@@ -0,0 +1,296 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#include "walk.h"
+#include "output.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// How many directories per thread may be read ahead of the walk
+static const size_t DIRS_AHEAD_PER_THREAD = 16;
+
+// An open directory, closed when the last reference is gone
+struct OpenDir {
+	explicit OpenDir(DIR *dir) : dir(dir) {}
+	~OpenDir() { closedir(dir); }
+
+	OpenDir(const OpenDir &) = delete;
+	OpenDir &operator=(const OpenDir &) = delete;
+
+	DIR *dir;
+};
+
+struct WalkEntry {
+	enum class Type { FILE, DIR, ERROR };
+
+	Type type;
+	std::string name;
+	// errno of the failed stat for Type::ERROR
+	int error = 0;
+	// the directory for Type::DIR
+	shared_ptr<WalkDir> dir;
+};
+
+struct WalkDir {
+	enum class State { PENDING, READING, DONE };
+
+	// Position in the walk: the indices of the entries leading to this
+	// directory. Comparing these lexicographically gives the order of the
+	// walk.
+	vector<unsigned> key;
+	string path;
+	// the parent directory to open this one with openat(), and the name
+	// relative to it. Without a parent, `path` is opened directly.
+	shared_ptr<OpenDir> parent;
+	string name;
+
+	State state = State::PENDING;
+	// errno if the directory couldn't be opened
+	int error = 0;
+	vector<WalkEntry> entries;
+};
+
+DirWalker::DirWalker(const Options &opts, unsigned nthreads, FileCallback on_file)
+	: follow_symlinks(opts.recursive == Recursion::FOLLOW_SYMLINKS)
+	, on_file(std::move(on_file))
+	, max_ahead(nthreads * DIRS_AHEAD_PER_THREAD)
+{
+	// With a single thread, the calling thread reads all directories
+	// itself.
+	if (nthreads > 1) {
+		for (unsigned i = 0; i < nthreads; i++) {
+			threads.emplace_back(&DirWalker::work, this);
+		}
+	}
+}
+
+DirWalker::~DirWalker()
+{
+	{
+		lock_guard<std::mutex> lock(mutex);
+		stopped = true;
+		scheduled.notify_all();
+	}
+
+	for (auto &t : threads) {
+		t.join();
+	}
+}
+
+int DirWalker::walk(const string &root)
+{
+	auto top = make_shared<WalkDir>();
+	top->path = root;
+	top->state = WalkDir::State::READING;
+	read_dir(*top);
+
+	if (top->error != 0) {
+		err() << root << ": " << strerror(top->error) << endl;
+		return 1;
+	}
+
+	// The directories from the root to the current one and the index of the
+	// next entry in each of them
+	vector<pair<shared_ptr<WalkDir>, size_t>> stack;
+	stack.emplace_back(top, 0);
+
+	while (!stack.empty()) {
+		WalkDir &dir = *stack.back().first;
+		size_t &index = stack.back().second;
+
+		if (index >= dir.entries.size()) {
+			stack.pop_back();
+			continue;
+		}
+
+		WalkEntry &entry = dir.entries[index++];
+
+		switch (entry.type) {
+		case WalkEntry::Type::ERROR:
+			err() << dir.path << ": " << strerror(entry.error) << endl;
+			break;
+		case WalkEntry::Type::FILE:
+			on_file(dir.path + "/" + entry.name, entry.name);
+			break;
+		case WalkEntry::Type::DIR: {
+			shared_ptr<WalkDir> subdir = std::move(entry.dir);
+			wait_for(subdir);
+
+			if (subdir->error != 0) {
+				err() << subdir->path << ": " << strerror(subdir->error) << endl;
+			} else {
+				// invalidates `dir` and `index`
+				stack.emplace_back(std::move(subdir), 0);
+			}
+			break;
+		}
+		}
+	}
+
+	return 0;
+}
+
+void DirWalker::wait_for(const shared_ptr<WalkDir> &dir)
+{
+	unique_lock<std::mutex> lock(mutex);
+
+	if (dir->state == WalkDir::State::PENDING) {
+		pending.erase(dir->key);
+		dir->state = WalkDir::State::READING;
+
+		lock.unlock();
+		read_dir(*dir);
+		lock.lock();
+		return;
+	}
+
+	dir_read.wait(lock, [&] { return dir->state == WalkDir::State::DONE; });
+
+	// The walk caught up with this directory
+	ahead--;
+	scheduled.notify_all();
+}
+
+void DirWalker::work()
+{
+	unique_lock<std::mutex> lock(mutex);
+
+	while (true) {
+		scheduled.wait(lock, [this] {
+			return stopped || (!pending.empty() && ahead < max_ahead);
+		});
+
+		if (stopped) {
+			return;
+		}
+
+		// Read the directory that the walk needs first
+		auto first = pending.begin();
+		shared_ptr<WalkDir> dir = std::move(first->second);
+		pending.erase(first);
+		dir->state = WalkDir::State::READING;
+		ahead++;
+
+		lock.unlock();
+		read_dir(*dir);
+		lock.lock();
+
+		dir_read.notify_all();
+	}
+}
+
+void DirWalker::read_dir(WalkDir &dir)
+{
+	const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (follow_symlinks ? 0 : O_NOFOLLOW);
+	int fd;
+
+	if (dir.parent) {
+		fd = openat(dirfd(dir.parent->dir), dir.name.c_str(), flags);
+		// The parent is closed as soon as all its subdirectories are open
+		dir.parent.reset();
+	} else {
+		fd = open(dir.path.c_str(), flags & ~O_NOFOLLOW);
+	}
+
+	DIR *d = fd < 0 ? nullptr : fdopendir(fd);
+	if (d == nullptr) {
+		dir.error = errno;
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+	vector<shared_ptr<WalkDir>> subdirs;
+
+	if (d != nullptr) {
+		auto open_dir = make_shared<OpenDir>(d);
+		struct dirent *ent;
+
+		while ((ent = readdir(d)) != nullptr) { // not sorted, in order as `ls -f`
+			const char *name = ent->d_name;
+			if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+				continue;
+			}
+
+			bool is_dir = false;
+
+#ifdef _DIRENT_HAVE_D_TYPE
+			unsigned char type = ent->d_type;
+#else
+			unsigned char type = DT_UNKNOWN;
+#endif
+			if (type == DT_LNK && !follow_symlinks) {
+				continue;
+			}
+
+			if (type == DT_UNKNOWN || type == DT_LNK) {
+				struct stat st;
+				int statflags = follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW;
+
+				if (fstatat(dirfd(d), name, &st, statflags) != 0) {
+					dir.entries.push_back(WalkEntry { WalkEntry::Type::ERROR, name, errno, nullptr });
+					continue;
+				}
+				if (S_ISLNK(st.st_mode)) {
+					continue;
+				}
+				is_dir = S_ISDIR(st.st_mode);
+			} else {
+				is_dir = type == DT_DIR;
+			}
+
+			if (!is_dir) {
+				dir.entries.push_back(WalkEntry { WalkEntry::Type::FILE, name, 0, nullptr });
+				continue;
+			}
+
+			auto subdir = make_shared<WalkDir>();
+			subdir->key = dir.key;
+			subdir->key.push_back(dir.entries.size());
+			subdir->path = dir.path + "/" + name;
+			subdir->parent = open_dir;
+			subdir->name = name;
+
+			dir.entries.push_back(WalkEntry { WalkEntry::Type::DIR, name, 0, subdir });
+			subdirs.push_back(std::move(subdir));
+		}
+	}
+
+	lock_guard<std::mutex> lock(mutex);
+	dir.state = WalkDir::State::DONE;
+
+	if (!threads.empty()) {
+		for (auto &subdir : subdirs) {
+			pending.emplace(subdir->key, subdir);
+		}
+		if (!subdirs.empty()) {
+			scheduled.notify_all();
+		}
+	}
+}
@@ -0,0 +1,100 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+#ifndef WALK_H
+#define WALK_H
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pdfgrep.h"
+
+struct WalkDir;
+
+/** Walks directory trees for --recursive and --dereference-recursive.
+ *
+ * The files are reported in the same order as by a recursive depth-first walk
+ * with readdir(), but the walk is iterative and directories are opened with
+ * openat() relative to their parent. The type of an entry is taken from
+ * dirent::d_type, so that only symlinks (with -R) and file systems without
+ * d_type need a stat call.
+ *
+ * With more than one thread, the worker threads read the directories that
+ * come next in the walk ahead of time, while the calling thread reports the
+ * files of the directories that are already read. Thus, the search of the
+ * first files can start before the walk is finished.
+ */
+class DirWalker {
+public:
+	// Called for each file with its path and its name without the
+	// directory part
+	typedef std::function<void(const std::string &path, const std::string &name)> FileCallback;
+
+	DirWalker(const Options &opts, unsigned threads, FileCallback on_file);
+	~DirWalker();
+
+	DirWalker(const DirWalker &) = delete;
+	DirWalker &operator=(const DirWalker &) = delete;
+
+	/* Report all files below the directory `root`. Errors are printed
+	 * with err(). Returns 1 if `root` can't be read and 0 otherwise.
+	 */
+	int walk(const std::string &root);
+
+private:
+	void work();
+	// Read the entries of a directory and schedule its subdirectories
+	void read_dir(WalkDir &dir);
+	// Wait until `dir` was read, or read it right away if no thread has
+	// started yet.
+	void wait_for(const std::shared_ptr<WalkDir> &dir);
+
+	const bool follow_symlinks;
+	FileCallback on_file;
+	// maximum number of directories read ahead of the walk
+	const size_t max_ahead;
+
+	std::mutex mutex;
+	// signaled when directories are scheduled or the walker stops
+	std::condition_variable scheduled;
+	// signaled when a directory was read
+	std::condition_variable dir_read;
+
+	// Directories that haven't been read yet, ordered by their position in
+	// the walk
+	std::map<std::vector<unsigned>, std::shared_ptr<WalkDir>> pending;
+	// number of directories read (or being read) ahead of the walk
+	size_t ahead = 0;
+	bool stopped = false;
+
+	std::vector<std::thread> threads;
+};
+
+#endif /* WALK_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
@@ -0,0 +1,477 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+
+#include "watch.h"
+#include "buildcache.h"
+#include "cache.h"
+#include "exclude.h"
+#include "jobs.h"
+#include "output.h"
+
+#include <iostream>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <utility>
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+// Changes are handled once no event arrived for this long, so that a series of
+// events, e.g. of a directory that is copied, ends up in one batch.
+static const chrono::milliseconds SETTLE_TIME(1000);
+// ... but they don't wait longer than this, if the events never stop
+static const chrono::seconds MAX_BATCH_DELAY(10);
+// The trigram index is rebuilt when there were no changes for this long
+static const chrono::seconds INDEX_DELAY(30);
+
+static const uint32_t WATCH_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM
+	| IN_CREATE | IN_DELETE | IN_ONLYDIR;
+
+namespace {
+
+class Watcher {
+public:
+	explicit Watcher(const Options &opts) : opts(opts) {}
+	~Watcher();
+
+	Watcher(const Watcher &) = delete;
+	Watcher &operator=(const Watcher &) = delete;
+
+	int run(const vector<string> &paths);
+
+private:
+	bool wanted(const string &name) const;
+	void add_tree(const string &dir, vector<string> &files);
+	void remove_tree(const string &dir);
+	void read_events();
+	void handle(const struct inotify_event &event);
+	void file_changed(const string &path);
+	void file_removed(const string &path);
+	void rescan();
+	void process();
+	void set_entry(const string &path, const string &cache_file);
+	void release(const string &cache_file);
+
+	const Options &opts;
+	int fd = -1;
+	vector<string> roots;
+	// the watched directories by their watch descriptor
+	map<int, string> dirs;
+	// the cache entry of each PDF, and how many PDFs have the same one
+	map<string, string> entries;
+	map<string, size_t> references;
+	// PDFs that changed or were removed since the last batch
+	set<string> changed;
+	set<string> removed;
+	// events were lost, so everything has to be checked again
+	bool overflow = false;
+	chrono::steady_clock::time_point first_pending;
+	// the cache changed since the trigram index was built
+	bool index_outdated = false;
+	chrono::steady_clock::time_point last_change;
+};
+
+}
+
+Watcher::~Watcher()
+{
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+bool Watcher::wanted(const string &name) const
+{
+	return is_excluded(opts.includes, name) && !is_excluded(opts.excludes, name);
+}
+
+/* Watch `dir` and all directories below it, and add the PDFs in them to
+ * `files`. Directories that are watched already are read again. */
+void Watcher::add_tree(const string &dir, vector<string> &files)
+{
+	const bool follow_symlinks = opts.recursive == Recursion::FOLLOW_SYMLINKS;
+	int wd = inotify_add_watch(fd, dir.c_str(),
+	                           WATCH_EVENTS | (follow_symlinks ? 0 : IN_DONT_FOLLOW));
+	if (wd < 0) {
+		err() << "Could not watch " << dir << ": " << strerror(errno) << endl;
+		if (errno == ENOSPC) {
+			err() << "The limit of inotify watches is in "
+			      << "/proc/sys/fs/inotify/max_user_watches" << endl;
+		}
+		return;
+	}
+
+	// With --dereference-recursive, a directory may be reached through
+	// several symlinks. It is only read under its first path.
+	auto known = dirs.find(wd);
+	if (known != dirs.end() && known->second != dir) {
+		return;
+	}
+	dirs[wd] = dir;
+
+	DIR *d = opendir(dir.c_str());
+	if (d == nullptr) {
+		err() << "Could not open " << dir << ": " << strerror(errno) << endl;
+		return;
+	}
+
+	vector<string> subdirs;
+	struct dirent *ent;
+	while ((ent = readdir(d)) != nullptr) {
+		const char *name = ent->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+
+		string path = dir + "/" + name;
+		unsigned char type = ent->d_type;
+		if (type == DT_LNK && !follow_symlinks) {
+			continue;
+		}
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			struct stat st;
+			if ((follow_symlinks ? stat(path.c_str(), &st) : lstat(path.c_str(), &st)) != 0) {
+				continue;
+			}
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_DIR) {
+			subdirs.push_back(path);
+		} else if (type == DT_REG && wanted(name)) {
+			files.push_back(path);
+		}
+	}
+	closedir(d);
+
+	for (const string &subdir : subdirs) {
+		add_tree(subdir, files);
+	}
+}
+
+// Forget the directory `dir` that was moved away or deleted, and its PDFs
+void Watcher::remove_tree(const string &dir)
+{
+	const string prefix = dir + "/";
+
+	for (auto it = dirs.begin(); it != dirs.end(); ) {
+		if (it->second == dir || it->second.compare(0, prefix.size(), prefix) == 0) {
+			// A deleted directory has lost its watch already
+			inotify_rm_watch(fd, it->first);
+			it = dirs.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	for (const auto &entry : entries) {
+		if (entry.first.compare(0, prefix.size(), prefix) == 0) {
+			file_removed(entry.first);
+		}
+	}
+	for (auto it = changed.begin(); it != changed.end(); ) {
+		if (it->compare(0, prefix.size(), prefix) == 0) {
+			it = changed.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+void Watcher::file_changed(const string &path)
+{
+	changed.insert(path);
+	removed.erase(path);
+}
+
+void Watcher::file_removed(const string &path)
+{
+	removed.insert(path);
+	changed.erase(path);
+}
+
+void Watcher::read_events()
+{
+	alignas(struct inotify_event) char buf[64 * 1024];
+
+	ssize_t len = read(fd, buf, sizeof(buf));
+	if (len <= 0) {
+		return;
+	}
+
+	bool pending = overflow || !changed.empty() || !removed.empty();
+
+	for (ssize_t pos = 0; pos < len; ) {
+		const struct inotify_event *event = reinterpret_cast<struct inotify_event *>(buf + pos);
+		handle(*event);
+		pos += sizeof(struct inotify_event) + event->len;
+	}
+
+	if (!pending) {
+		first_pending = chrono::steady_clock::now();
+	}
+}
+
+void Watcher::handle(const struct inotify_event &event)
+{
+	if (event.mask & IN_Q_OVERFLOW) {
+		overflow = true;
+		return;
+	}
+
+	auto dir = dirs.find(event.wd);
+	if (dir == dirs.end()) {
+		return;
+	}
+	if (event.mask & IN_IGNORED) {
+		dirs.erase(dir);
+		return;
+	}
+	if (event.len == 0) {
+		return;
+	}
+
+	string name = event.name;
+	string path = dir->second + "/" + name;
+
+	if (event.mask & IN_ISDIR) {
+		if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+			// PDFs may have been put into the directory before its
+			// watch was added
+			vector<string> files;
+			add_tree(path, files);
+			for (const string &file : files) {
+				file_changed(file);
+			}
+		} else if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+			remove_tree(path);
+		}
+	} else if (wanted(name)) {
+		// New files are handled when they are closed
+		if (event.mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+			file_changed(path);
+		} else if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+			file_removed(path);
+		}
+	}
+}
+
+// Check all PDFs again, after events were lost
+void Watcher::rescan()
+{
+	vector<string> files;
+	for (const string &root : roots) {
+		add_tree(root, files);
+	}
+
+	set<string> present(files.begin(), files.end());
+	for (const auto &entry : entries) {
+		if (present.count(entry.first) == 0) {
+			file_removed(entry.first);
+		}
+	}
+	for (const string &file : files) {
+		file_changed(file);
+	}
+	overflow = false;
+}
+
+void Watcher::release(const string &cache_file)
+{
+	auto it = references.find(cache_file);
+	if (it != references.end() && --it->second == 0) {
+		references.erase(it);
+		remove_cache_entry(opts, cache_file);
+	}
+}
+
+void Watcher::set_entry(const string &path, const string &cache_file)
+{
+	auto it = entries.find(path);
+	if (it != entries.end()) {
+		if (it->second == cache_file) {
+			return;
+		}
+		release(it->second);
+	}
+	entries[path] = cache_file;
+	references[cache_file]++;
+}
+
+/* Extract the changed PDFs and remove the entries of the removed ones. The
+ * changed ones come first, so that the entry of a PDF that was only renamed
+ * is kept. */
+void Watcher::process()
+{
+	if (overflow) {
+		rescan();
+	}
+
+	vector<string> paths(changed.begin(), changed.end());
+	changed.clear();
+
+	struct Result {
+		string cache_file;
+		size_t pages = 0;
+	};
+	vector<Result> results(paths.size());
+	{
+		JobPool pool(opts.jobs);
+		for (size_t i = 0; i < paths.size(); i++) {
+			pool.add([this, &paths, &results, i] {
+				build_document(opts, paths[i], results[i].cache_file, results[i].pages);
+			});
+		}
+		pool.wait();
+	}
+	release_cache_mappings(opts);
+
+	for (size_t i = 0; i < paths.size(); i++) {
+		// A PDF that can't be read may be deleted already, which is
+		// handled with its event.
+		if (results[i].cache_file.empty()) {
+			continue;
+		}
+
+		auto it = entries.find(paths[i]);
+		bool added = it == entries.end();
+		if (!added && it->second == results[i].cache_file && results[i].pages == 0) {
+			continue;
+		}
+
+		set_entry(paths[i], results[i].cache_file);
+		cout << (added ? "Added " : "Updated ") << paths[i] << " ("
+		     << results[i].pages << " pages extracted)" << endl;
+		index_outdated = true;
+	}
+
+	for (const string &path : removed) {
+		auto it = entries.find(path);
+		if (it == entries.end()) {
+			continue;
+		}
+		release(it->second);
+		entries.erase(it);
+		cout << "Removed " << path << endl;
+		index_outdated = true;
+	}
+	removed.clear();
+
+	last_change = chrono::steady_clock::now();
+}
+
+int Watcher::run(const vector<string> &paths)
+{
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0) {
+		err() << "Could not initialize inotify: " << strerror(errno) << endl;
+		return EXIT_ERROR;
+	}
+
+	// The directories are watched before the cache is built, so that no
+	// change in between is lost.
+	vector<string> files;
+	for (const string &path : paths) {
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+			err() << path << " is not a directory" << endl;
+			return EXIT_ERROR;
+		}
+		roots.push_back(path);
+		add_tree(path, files);
+	}
+
+	std::mutex mutex;
+	vector<pair<string, string>> built;
+	build_cache(opts, roots, [&](const string &path, const string &cache_file) {
+		lock_guard<std::mutex> lock(mutex);
+		built.emplace_back(path, cache_file);
+	});
+	for (const auto &entry : built) {
+		set_entry(entry.first, entry.second);
+	}
+
+	while (true) {
+		auto now = chrono::steady_clock::now();
+		bool pending = overflow || !changed.empty() || !removed.empty();
+
+		chrono::milliseconds timeout(-1);
+		if (pending) {
+			timeout = SETTLE_TIME;
+		} else if (index_outdated) {
+			timeout = chrono::duration_cast<chrono::milliseconds>(
+				max(last_change + INDEX_DELAY - now, chrono::steady_clock::duration::zero()));
+		}
+
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int ready = poll(&pfd, 1, timeout.count());
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err() << "Could not wait for inotify events: " << strerror(errno) << endl;
+			return EXIT_ERROR;
+		}
+		if (ready > 0) {
+			read_events();
+			pending = overflow || !changed.empty() || !removed.empty();
+			if (!pending || chrono::steady_clock::now() - first_pending < MAX_BATCH_DELAY) {
+				continue;
+			}
+		}
+
+		if (pending) {
+			process();
+		} else if (index_outdated) {
+			update_trigram_index(opts);
+			index_outdated = false;
+		}
+	}
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
+
+int watch_cache(const Options &opts, const vector<string> &paths)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	Watcher watcher(opts);
+	return watcher.run(paths.empty() ? vector<string> { "." } : paths);
+#else
+	(void) opts;
+	(void) paths;
+	err() << "--watch is not supported on this system" << endl;
+	return EXIT_ERROR;
+#endif
+}
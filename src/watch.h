@@ -0,0 +1,48 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <string>
+#include <vector>
+
+#include "pdfgrep.h"
+
+/** Keep the cache of the PDFs below the directories `paths` current (--watch)
+ *
+ * First, the cache is built like by build_cache(). Then the directory trees
+ * are watched with inotify. PDFs that are added or modified are extracted
+ * again, and the entries of PDFs that are deleted or replaced are removed
+ * from the cache. Changes are handled in batches, once the tree was quiet for
+ * a moment, so that only the PDFs that changed are read. The trigram index
+ * is rebuilt when there were no changes for a while longer.
+ *
+ * Runs until pdfgrep is killed, or returns the exit status if the directories
+ * can't be watched.
+ */
+int watch_cache(const Options &opts, const std::vector<std::string> &paths);
+
+#endif /* WATCH_H */
+
+/* Local Variables: */
+/* mode: c++ */
+/* End: */
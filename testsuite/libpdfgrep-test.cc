@@ -0,0 +1,90 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by Hans-Peter Deifel                               *
+ *   hpd@hpdeifel.de                                                       *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,      *
+ *   Boston, MA 02110-1301 USA.                                            *
+ ***************************************************************************/
+
+/* Searches a PDF with libpdfgrep, for library.exp.
+ *
+ * Prints each match as "PAGE LABEL START END TEXT", where START and END are
+ * the offsets of the match in the text of the page, and each warning as
+ * "warning: MESSAGE". Errors are printed as "error: MESSAGE" and exit with
+ * status 2. With -d, the cache directory of pdfgrep --cache is used. With
+ * several -c, the PDF is searched once with each cache directory.
+ *
+ * Usage: libpdfgrep-test [-m MAX_COUNT] [-c CACHE_DIRECTORY... | -d] PATTERN PDF
+ */
+
+#include "libpdfgrep.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+	pdfgrep::SearchOptions options;
+	vector<string> cache_directories;
+	bool default_cache = false;
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			options.max_count = strtoul(argv[++i], nullptr, 10);
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			cache_directories.push_back(argv[++i]);
+		} else if (strcmp(argv[i], "-d") == 0) {
+			default_cache = true;
+		} else {
+			break;
+		}
+	}
+	if (argc - i != 2) {
+		cerr << "Usage: " << argv[0]
+		     << " [-m MAX_COUNT] [-c CACHE_DIRECTORY... | -d] PATTERN PDF" << endl;
+		return 2;
+	}
+
+	options.on_warning = [](const string &message) {
+		cout << "warning: " << message << endl;
+	};
+
+	try {
+		if (default_cache) {
+			cache_directories.push_back(pdfgrep::default_cache_directory());
+		}
+		if (cache_directories.empty()) {
+			cache_directories.push_back("");
+		}
+		pdfgrep::Pattern pattern(argv[i]);
+		for (const string &directory : cache_directories) {
+			options.cache_directory = directory;
+			pdfgrep::search(argv[i + 1], pattern, [](const pdfgrep::Match &m) {
+				cout << m.page << ' ' << m.label << ' ' << m.start << ' ' << m.end
+				     << ' ' << m.text.substr(m.start, m.end - m.start) << endl;
+				return true;
+			}, options);
+		}
+	} catch (const pdfgrep::Error &e) {
+		cout << "error: " << e.what() << endl;
+		return 2;
+	}
+	return 0;
+}